@@ -0,0 +1,26 @@
+#ifndef _AMBIX_MONITOR_H
+#define _AMBIX_MONITOR_H
+
+// pcm-memory embedded in ctl (pcm-mod/libambix-monitor.a, "make ctl-pcm"): the sampling loop of pcm-memory runs in a
+// thread of ctl and publishes to a private feed instead of the shared memory one, so ctl reads it without a second
+// process. The sampling period, latency windows and sanity checks are the same as with a separate pcm-memory.
+
+#include "pcm-ambix.h"
+
+#define PCM_EMBED_ENV "AMBIX_PCM" // "external": ctl reads the shared memory feed of a separate pcm-memory instead
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Programs the memory counters and starts sampling every period_ms (PCM_PERIOD_MS if <= 0). Returns the feed, or NULL
+// if the counters cannot be used (reasons are printed on stderr).
+memdata_ring_t *ambix_monitor_start(int period_ms);
+// Stops sampling, releases the counters and unmaps the feed
+void ambix_monitor_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,8 +4,8 @@
 
 // Intervals and limits:
 
-#define MEMCHECK_INTERVAL PCM_DELAY * 1000
-#define NVRAMWRCHK_INTERVAL PCM_DELAY * 1000
+#define MEMCHECK_INTERVAL PCM_PERIOD_MS
+#define NVRAMWRCHK_INTERVAL PCM_PERIOD_MS
 #define CLEAR_DELAY 50
 #define ADM_BW_THRESH 10
 
@@ -33,6 +33,8 @@ int buf_size;
 
 addr_info_t *candidates;
 
+memdata_ring_t *memdata_ring = NULL;
+
 struct iovec iov_out, iov_in;
 struct msghdr msg_out, msg_in;
 
@@ -130,29 +132,21 @@ int check_memdata(memdata_t *md) {
     return 1;
 }
 
-memdata_t *read_memdata() {
-    memdata_t *md = malloc(sizeof(memdata_t));
+// Copies the latest sample published by pcm-memory. Returns 1 on success.
+int read_memdata(memdata_t *md, uint64_t *timestamp_ns) {
+    memdata_sample_t sample;
 
-    FILE * in_file = fopen(PCM_FILE_NAME, "r");
-    if (in_file == NULL) {
-        fprintf(stderr, "Error opening memdata file.\n");
-        return md;
+    // Only syscalls until pcm-memory has created the feed, afterwards reads are plain memory accesses
+    if ((memdata_ring == NULL) && ((memdata_ring = memdata_ring_open(0)) == NULL)) {
+        return 0;
     }
-    if (fread(md, sizeof(memdata_t), 1, in_file) != 1) {
-        fprintf(stderr, "Error reading memdata from file.\n");
+    if (!memdata_ring_latest(memdata_ring, &sample)) {
+        return 0;
     }
 
-    fclose(in_file);
-
-    return md;
-}
-
-time_t get_memdata_mtime() {
-    struct stat st;
-    if (stat(PCM_FILE_NAME, &st) != -1) {
-        return st.st_mtime;
-    }
-    return 0;
+    *md = sample.md;
+    *timestamp_ns = sample.timestamp_ns;
+    return 1;
 }
 
 
@@ -530,7 +524,7 @@ void *memcheck_placement(void *args) {
     float mm_usage;
     float adm_usage;
     int n_pages;
-    time_t prev_memdata_lmod = 0;
+    uint64_t prev_memdata_ts = 0;
 
     while (!exit_sig) {
         int n_migrated = 0;
@@ -546,18 +540,18 @@ void *memcheck_placement(void *args) {
         }
 
         if (switch_act) {
-            time_t memdata_lmod = get_memdata_mtime();
-            if (memdata_lmod == 0 || (memdata_lmod == prev_memdata_lmod)) {
+            memdata_t md;
+            uint64_t memdata_ts = 0;
+            if (!read_memdata(&md, &memdata_ts) || (memdata_ts == prev_memdata_ts)) {
                 printf("MEMCHECK: Old or invalid memdata values. Ignoring...\n");
             }
             else {
-                prev_memdata_lmod = memdata_lmod;
-                memdata_t *md = read_memdata();
-                if (!check_memdata(md)) {
+                prev_memdata_ts = memdata_ts;
+                if (!check_memdata(&md)) {
                     printf("MEMCHECK: Unexpected memdata values.\n");
                 }
                 else {
-                    float pmm_bw = md->sys_pmmAppBW;
+                    float pmm_bw = md.sys_pmmAppBW;
                     if (pmm_bw > ADM_BW_THRESH) {
 
                         pthread_mutex_lock(&placement_lock);
@@ -595,7 +589,6 @@ void *memcheck_placement(void *args) {
                 }
 
                 n_migrated += switch_migrated;
-                free(md);
             }
         }
 
@@ -643,28 +636,28 @@ void *memcheck_placement(void *args) {
 }
 
 /*void *nvramWrChk_placement(void *args) {
-    time_t prev_memdata_lmod = 0;
+    uint64_t prev_memdata_ts = 0;
     while (!exit_sig) {
         int sleep_interval = nvramWrChk_interval;
         if (nvramWrChk_act) {
-            time_t memdata_lmod = get_memdata_mtime();
-            if (memdata_lmod == 0 || (memdata_lmod == prev_memdata_lmod)) {
+            memdata_t md;
+            uint64_t memdata_ts = 0;
+            if (!read_memdata(&md, &memdata_ts) || (memdata_ts == prev_memdata_ts)) {
                 printf("NVRAMWRCHK: Old or invalid memdata values. Ignoring...\n");
             }
             else {
-                prev_memdata_lmod = memdata_lmod;
-                memdata_t *md = read_memdata();
-                if (!check_memdata(md)) {
+                prev_memdata_ts = memdata_ts;
+                if (!check_memdata(&md)) {
                     printf("NVRAMWRCHK: Unexpected memdata values.\n");
                 }
                 else {
                     float pmm_bw;
                     if (PMM_MIXED) {
                         // If mixed configuration (AD+MM), pcm cannot isolate PMM AD write BW, so use total AD BW
-                        pmm_bw = md->sys_pmmAppBW;
+                        pmm_bw = md.sys_pmmAppBW;
                     }
                     else {
-                        pmm_bw = md->sys_pmmWrites;
+                        pmm_bw = md.sys_pmmWrites;
                     }
 
                     if ((pmm_bw > NVRAM_BW_WR_THRESH)) {
@@ -685,7 +678,6 @@ void *memcheck_placement(void *args) {
                         sleep_interval -= clearDirty_interval;
                     }
                 }
-                free(md);
             }
         }
 
@@ -36,6 +36,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include "types.h"
 #include "utils.h"
 #include "topology.h"
+#include "regtrace.h"
 
 #if defined (__FreeBSD__) || defined(__DragonFly__)
 #include <sys/param.h>
@@ -78,6 +79,8 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <condition_variable>
 #include <mutex>
 #include <atomic>
+#include <emmintrin.h>
+#include <chrono>
 
 #ifdef __APPLE__
 #include <sys/types.h>
@@ -415,14 +418,38 @@ union PCM_CPUID_INFO
     struct { unsigned int eax, ebx, ecx, edx; } reg;
 };
 
+#ifdef __linux__
+// CPUID results differ per CPU (APIC ids), so traces key them by the CPU the instruction runs on
+static bool pcm_cpuid_replay(const unsigned leaf, const unsigned subleaf, PCM_CPUID_INFO & info)
+{
+    if (!RegisterTrace::replaying()) return false;
+    const int cpu = sched_getcpu();
+    if (!RegisterTrace::replay(RegisterTrace::CPUID, cpu, (uint64(leaf) << 32) | subleaf, info.array, sizeof(info.array)))
+        memset(info.array, 0, sizeof(info.array));
+    return true;
+}
+
+static void pcm_cpuid_record(const unsigned leaf, const unsigned subleaf, const PCM_CPUID_INFO & info)
+{
+    if (RegisterTrace::recording())
+        RegisterTrace::record(RegisterTrace::CPUID, sched_getcpu(), (uint64(leaf) << 32) | subleaf, info.array, sizeof(info.array));
+}
+#endif
+
 void pcm_cpuid(int leaf, PCM_CPUID_INFO & info)
 {
     #ifdef _MSC_VER
     // version for Windows
     __cpuid(info.array, leaf);
     #else
+    #ifdef __linux__
+    if (pcm_cpuid_replay(leaf, 0, info)) return;
+    #endif
     __asm__ __volatile__ ("cpuid" : \
                           "=a" (info.reg.eax), "=b" (info.reg.ebx), "=c" (info.reg.ecx), "=d" (info.reg.edx) : "a" (leaf));
+    #ifdef __linux__
+    pcm_cpuid_record(leaf, 0, info);
+    #endif
     #endif
 }
 
@@ -432,8 +459,14 @@ void pcm_cpuid(const unsigned leaf, const unsigned subleaf, PCM_CPUID_INFO & inf
     #ifdef _MSC_VER
     __cpuidex(info.array, leaf, subleaf);
     #else
+    #ifdef __linux__
+    if (pcm_cpuid_replay(leaf, subleaf, info)) return;
+    #endif
     __asm__ __volatile__ ("cpuid" : \
                           "=a" (info.reg.eax), "=b" (info.reg.ebx), "=c" (info.reg.ecx), "=d" (info.reg.edx) : "a" (leaf), "c" (subleaf));
+    #ifdef __linux__
+    pcm_cpuid_record(leaf, subleaf, info);
+    #endif
     #endif
 }
 
@@ -1745,35 +1778,185 @@ void enableNMIWatchdog()
 }
 #endif
 
+// pause iterations (tens of microseconds) before a thread waiting for CoreTaskQueue work or completion parks
+static const uint32 coreTaskSpinLimit = 1024;
+
+// Completion count of a batch of CoreTaskQueue tasks. The caller spins for a while and then parks until every task of
+// the batch ran; the last task only takes the mutex when the caller is parked.
+class CoreTaskGroup
+{
+    // pending tasks << 1 | 1 while the caller is parked
+    std::atomic<uint64> state;
+    std::mutex m;
+    std::condition_variable condVar;
+    CoreTaskGroup(CoreTaskGroup &) = delete;
+public:
+    CoreTaskGroup() : state(0) {}
+    void add()
+    {
+        state.fetch_add(2);
+    }
+    void done()
+    {
+        if (state.fetch_sub(2) == 3)
+        {
+            // the caller is parked: it returns once state reads 0, which it can only check under the mutex, so the
+            // group is not touched after it may be gone
+            std::lock_guard<std::mutex> lock(m);
+            state.store(0);
+            condVar.notify_one();
+        }
+    }
+    void wait()
+    {
+        for (uint32 spins = 0; spins < coreTaskSpinLimit; ++spins)
+        {
+            if (state.load() == 0) return;
+            _mm_pause();
+        }
+        std::unique_lock<std::mutex> lock(m);
+        uint64 s = state.load();
+        while (s != 0 && !state.compare_exchange_weak(s, s | 1)) {}
+        if (s == 0) return;
+        condVar.wait(lock, [this]() { return state.load() == 0; });
+    }
+};
+
+// Runs tasks on a thread pinned to a core. Tasks are handed over through a bounded lock-free ring of preallocated slots
+// (a sequence number per slot, several producers, one consumer), so a push allocates nothing and costs a CAS and a
+// few stores. The worker spins for a while before it parks on the condition variable, and producers only take the
+// mutex to wake a parked worker.
 class CoreTaskQueue
 {
-    std::queue<std::packaged_task<void()> > wQueue;
+    enum { capacity = 64 }; // power of 2; a full ring makes producers wait
+
+    struct Slot
+    {
+        std::atomic<uint64> seq;
+        void (*run)(const void * fn, int32 arg);
+        const void * fn;
+        int32 arg;
+        CoreTaskGroup * group;
+    };
+
+    Slot slots[capacity];
+    alignas(64) std::atomic<uint64> enqueuePos;
+    alignas(64) uint64 dequeuePos; // worker only
+    std::atomic<bool> parked;
+    std::atomic<bool> stop;
     std::mutex m;
     std::condition_variable condVar;
     std::thread worker;
     CoreTaskQueue() = delete;
     CoreTaskQueue(CoreTaskQueue &) = delete;
+
+    template <class F>
+    static void invoke(const void * fn, int32 arg)
+    {
+        (*static_cast<const F *>(fn))(arg);
+    }
+    bool ready() const
+    {
+        return slots[dequeuePos & (capacity - 1)].seq.load(std::memory_order_acquire) == dequeuePos + 1;
+    }
+    bool runNext()
+    {
+        if (!ready()) return false;
+        Slot & slot = slots[dequeuePos & (capacity - 1)];
+        try {
+            slot.run(slot.fn, slot.arg);
+        }
+        catch (...)
+        {
+            // dropped like the exception of an unread std::future
+        }
+        CoreTaskGroup * group = slot.group;
+        slot.seq.store(dequeuePos + capacity, std::memory_order_release);
+        ++dequeuePos;
+        group->done();
+        return true;
+    }
+    void run(int32 core)
+    {
+        TemporalThreadAffinity tempThreadAffinity(core, false);
+        uint32 spins = 0;
+        while (1)
+        {
+            if (runNext())
+            {
+                spins = 0;
+                continue;
+            }
+            if (stop.load(std::memory_order_acquire)) break;
+            if (++spins < coreTaskSpinLimit)
+            {
+                _mm_pause();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m);
+            parked.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in push
+            condVar.wait(lock, [this]() { return ready() || stop.load(std::memory_order_acquire); });
+            parked.store(false, std::memory_order_relaxed);
+            spins = 0;
+        }
+    }
+
 public:
     CoreTaskQueue(int32 core) :
-        worker([=]() {
-            TemporalThreadAffinity tempThreadAffinity(core, false);
-            std::unique_lock<std::mutex> lock(m);
-            while (1) {
-                while (wQueue.empty()) {
-                    condVar.wait(lock);
-                }
-                while (!wQueue.empty()) {
-                    wQueue.front()();
-                    wQueue.pop();
-                }
-            }
-        })
-    {}
-    void push(std::packaged_task<void()> & task)
+        enqueuePos(0),
+        dequeuePos(0),
+        parked(false),
+        stop(false)
     {
-        std::unique_lock<std::mutex> lock(m);
-        wQueue.push(std::move(task));
-        condVar.notify_one();
+        for (uint64 i = 0; i < capacity; ++i)
+        {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        worker = std::thread(&CoreTaskQueue::run, this, core);
+    }
+    ~CoreTaskQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop.store(true);
+            condVar.notify_one();
+        }
+        worker.join();
+    }
+    // Runs fn(arg) on the core. fn must stay alive until group.wait() returns.
+    template <class F>
+    void push(const F & fn, int32 arg, CoreTaskGroup & group)
+    {
+        group.add();
+        uint64 pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot * slot;
+        while (1)
+        {
+            slot = &slots[pos & (capacity - 1)];
+            const int64 diff = int64(slot->seq.load(std::memory_order_acquire)) - int64(pos);
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else
+            {
+                if (diff < 0) std::this_thread::yield(); // full
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->run = &invoke<F>;
+        slot->fn = &fn;
+        slot->arg = arg;
+        slot->group = &group;
+        slot->seq.store(pos + 1, std::memory_order_release);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in run
+        if (parked.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(m);
+            condVar.notify_one();
+        }
     }
 };
 
@@ -2075,7 +2258,12 @@ PCM::ErrorCode PCM::program(const PCM::ProgramMode mode_, const void * parameter
         canUsePerf = false;
         std::cerr << "Usage of Linux perf events is disabled through PCM_NO_PERF environment variable. Using direct PMU programming...\n";
     }
-    if(num_online_cores < num_cores)
+    if (RegisterTrace::active())
+    {
+        canUsePerf = false;
+        std::cerr << "Linux perf events are not traced (PCM_TRACE). Using direct PMU programming...\n";
+    }
+    else if(num_online_cores < num_cores)
     {
         canUsePerf = false;
         std::cerr << "PCM does not support using Linux perf API on systems with offlined cores. Falling-back to direct PMU programming.\n";
@@ -3670,6 +3858,28 @@ PCM::ErrorCode PCM::programServerUncoreLatencyMetrics(bool enable_pmm)
     return PCM::Success;
 }
 
+PCM::ErrorCode PCM::programServerUncoreReadLatencyMetrics(bool PMM)
+{
+    uint32 MCCntConfig[4] = {0,0,0,0};
+
+    if (MSR.empty() || server_pcicfg_uncore.empty()) return PCM::MSRAccessDenied;
+    if (!DDRLatencyMetricsAvailable()) return PCM::UnknownError;
+
+    MCCntConfig[ServerPCICFGUncore::LatencyPosition::DDR_RPQ_OCC] = MC_CH_PCI_PMON_CTL_EVENT(0x80) + MC_CH_PCI_PMON_CTL_UMASK(0);  // DRAM RPQ occupancy
+    MCCntConfig[ServerPCICFGUncore::LatencyPosition::DDR_RPQ_INS] = MC_CH_PCI_PMON_CTL_EVENT(0x10) + MC_CH_PCI_PMON_CTL_UMASK(0);  // DRAM RPQ insert
+    if (PMM)
+    {
+        MCCntConfig[ServerPCICFGUncore::LatencyPosition::PMM_RDQ_OCC] = MC_CH_PCI_PMON_CTL_EVENT(0xe0) + MC_CH_PCI_PMON_CTL_UMASK(1);  // PMM RDQ occupancy
+        MCCntConfig[ServerPCICFGUncore::LatencyPosition::PMM_RDQ_INS] = MC_CH_PCI_PMON_CTL_EVENT(0xe3) + MC_CH_PCI_PMON_CTL_UMASK(0);  // PMM RDQ insert
+    }
+
+    for (size_t i = 0; i < (size_t)server_pcicfg_uncore.size(); ++i)
+    {
+        server_pcicfg_uncore[i]->programIMC(MCCntConfig);
+    }
+    return PCM::Success;
+}
+
 PCM::ErrorCode PCM::programServerUncoreMemoryMetrics(int rankA, int rankB, bool PMM, bool PMMMixedMode)
 {
     if(MSR.empty() || server_pcicfg_uncore.empty())  return PCM::MSRAccessDenied;
@@ -4327,43 +4537,39 @@ void PCM::getAllCounterStates(SystemCounterState & systemState, std::vector<Sock
     coreStates.clear();
     coreStates.resize(num_cores);
 
-    std::vector<std::future<void> > asyncCoreResults;
+    CoreTaskGroup tasks;
 
+    const auto readCore = [this,&coreStates,&socketStates](int32 core) -> void
+        {
+            coreStates[core].readAndAggregate(MSR[core]);
+            socketStates[topology[core].socket].UncoreCounterState::readAndAggregate(MSR[core]); // read package C state counters
+        };
     for (int32 core = 0; core < num_cores; ++core)
     {
         // read core counters
         if (isCoreOnline(core))
         {
-            std::packaged_task<void()> task([this,&coreStates,&socketStates,core]() -> void
-                {
-                    coreStates[core].readAndAggregate(MSR[core]);
-                    socketStates[topology[core].socket].UncoreCounterState::readAndAggregate(MSR[core]); // read package C state counters
-                }
-            );
-            asyncCoreResults.push_back(std::move(task.get_future()));
-            coreTaskQueues[core]->push(task);
+            coreTaskQueues[core]->push(readCore, core, tasks);
         }
         // std::cout << "DEBUG2: " << core << " " << coreStates[core].InstRetiredAny << " \n";
     }
     // std::cout << std::flush;
+    const auto readSocket = [this, &socketStates](int32 s) -> void
+        {
+            readAndAggregateUncoreMCCounters(s, socketStates[s]);
+            readAndAggregateEnergyCounters(s, socketStates[s]);
+            readPackageThermalHeadroom(s, socketStates[s]);
+        };
     for (uint32 s = 0; s < (uint32)num_sockets; ++s)
     {
         int32 refCore = socketRefCore[s];
         if (refCore<0) refCore = 0;
-        std::packaged_task<void()> task([this, s, &socketStates]() -> void
-            {
-                readAndAggregateUncoreMCCounters(s, socketStates[s]);
-                readAndAggregateEnergyCounters(s, socketStates[s]);
-                readPackageThermalHeadroom(s, socketStates[s]);
-            } );
-        asyncCoreResults.push_back(std::move(task.get_future()));
-        coreTaskQueues[refCore]->push(task);
+        coreTaskQueues[refCore]->push(readSocket, s, tasks);
     }
 
     readQPICounters(systemState);
 
-    for (auto & ar : asyncCoreResults)
-        ar.wait();
+    tasks.wait();
 
     for (int32 core = 0; core < num_cores; ++core)
     {   // aggregate core counters into sockets
@@ -4559,6 +4765,30 @@ ServerUncoreCounterState PCM::getServerUncoreCounterState(uint32 socket)
     return result;
 }
 
+void PCM::getServerUncoreCounterStates(ServerUncoreCounterState * states, uint64 * snapshotNs)
+{
+    CoreTaskGroup tasks;
+
+    const auto readSocket = [this, states, snapshotNs](int32 s) -> void
+        {
+            const auto begin = std::chrono::steady_clock::now();
+            states[s] = getServerUncoreCounterState(s);
+            if (snapshotNs)
+            {
+                const auto end = std::chrono::steady_clock::now();
+                snapshotNs[s] = std::chrono::duration_cast<std::chrono::nanoseconds>((begin + (end - begin) / 2).time_since_epoch()).count();
+            }
+        };
+    for (uint32 s = 0; s < (uint32)num_sockets; ++s)
+    {
+        int32 refCore = socketRefCore[s];
+        if (refCore < 0) refCore = 0;
+        coreTaskQueues[refCore]->push(readSocket, s, tasks);
+    }
+
+    tasks.wait();
+}
+
 #ifndef _MSC_VER
 void print_mcfg(const char * path)
 {
@@ -4781,6 +5011,10 @@ bool PCM::useLinuxPerfForUncore() const
     static bool printed = false;
     bool secureBoot = isSecureBoot();
 #ifdef PCM_USE_PERF
+    if (RegisterTrace::active())
+    {
+        return false;
+    }
     const char * perf_env = std::getenv("PCM_USE_UNCORE_PERF");
     if (perf_env != NULL && std::string(perf_env) == std::string("1"))
     {
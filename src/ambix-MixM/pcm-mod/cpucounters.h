@@ -363,6 +363,13 @@ public:
         NM_HIT=0,  // NM :  Near Memory (DRAM cache) in Memory Mode
         M2M_CLOCKTICKS=1
     };
+    //! \brief iMC counters programmed by PCM::programServerUncoreReadLatencyMetrics
+    enum LatencyPosition {
+        DDR_RPQ_OCC=0,
+        DDR_RPQ_INS=1,
+        PMM_RDQ_OCC=2,
+        PMM_RDQ_INS=3
+    };
     //! \brief Initialize access data structures
     //! \param socket_ socket id
     //! \param pcm pointer to PCM instance
@@ -1032,6 +1039,14 @@ public:
     */
     ErrorCode programServerUncoreLatencyMetrics(bool enable_pmm);
 
+    /*! \brief Programs the DDR and PMM read latency counters together (RPQ and PMM RDQ occupancy and inserts)
+        \param PMM also program the PMM RDQ counters (counters 2 and 3)
+
+        Counters are in the order of ServerPCICFGUncore::LatencyPosition.
+        \warning After this call the memory bandwidth counters will not work until programServerUncoreMemoryMetrics is called again.
+    */
+    ErrorCode programServerUncoreReadLatencyMetrics(bool PMM);
+
     /*! \brief Programs uncore power/energy counters on microarchitectures codename SandyBridge-EP and later Xeon uarch
         \param mc_profile profile for integrated memory controller PMU. See possible profile values in pcm-power.cpp example
         \param pcu_profile profile for power control unit PMU. See possible profile values in pcm-power.cpp example
@@ -1082,6 +1097,14 @@ public:
     */
     ServerUncoreCounterState getServerUncoreCounterState(uint32 socket);
 
+    /*! \brief Reads the server uncore counter state of all sockets in parallel, each socket on the task queue of its
+               reference core, so that the snapshots of the sockets are taken at about the same time
+        \param states array of getNumSockets() entries receiving the state of each socket
+        \param snapshotNs optional array of getNumSockets() entries receiving the steady clock time (ns) at the middle
+               of the read of each socket, the spread between them is the skew of the snapshot
+    */
+    void getServerUncoreCounterStates(ServerUncoreCounterState * states, uint64 * snapshotNs = NULL);
+
     /*! \brief Cleanups resources and stops performance counting
 
             One needs to call this method when your program finishes or/and you are not going to use the
@@ -23,6 +23,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #endif
 #include "types.h"
 #include "msr.h"
+#include "regtrace.h"
 #include <assert.h>
 
 #ifdef _MSC_VER
@@ -212,6 +213,7 @@ int32 MsrHandle::read(uint64 msr_number, uint64 * value)
 // here comes a Linux version
 MsrHandle::MsrHandle(uint32 cpu) : fd(-1), cpu_id(cpu)
 {
+    if (RegisterTrace::replaying()) return;
     char * path = new char[200];
     snprintf(path, 200, "/dev/cpu/%d/msr", cpu);
     int handle = ::open(path, O_RDWR);
@@ -236,12 +238,21 @@ MsrHandle::~MsrHandle()
 
 int32 MsrHandle::write(uint64 msr_number, uint64 value)
 {
+    if (RegisterTrace::replaying()) return sizeof(uint64);
     return ::pwrite(fd, (const void *)&value, sizeof(uint64), msr_number);
 }
 
 int32 MsrHandle::read(uint64 msr_number, uint64 * value)
 {
-    return ::pread(fd, (void *)value, sizeof(uint64), msr_number);
+    if (RegisterTrace::replaying())
+    {
+        if (!RegisterTrace::replay(RegisterTrace::MSR, cpu_id, msr_number, value, sizeof(uint64))) *value = 0;
+        return sizeof(uint64);
+    }
+    const int32 result = ::pread(fd, (void *)value, sizeof(uint64), msr_number);
+    if (result == sizeof(uint64) && RegisterTrace::recording())
+        RegisterTrace::record(RegisterTrace::MSR, cpu_id, msr_number, value, sizeof(uint64));
+    return result;
 }
 
 #endif
@@ -22,6 +22,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "pci.h"
+#include "regtrace.h"
 
 #ifndef _MSC_VER
 #include <sys/mman.h>
@@ -392,10 +393,18 @@ int openHandle(uint32 groupnr_, uint32 bus, uint32 device, uint32 function)
 
 PciHandle::PciHandle(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 function_) :
     fd(-1),
+    groupnr(groupnr_),
     bus(bus_),
     device(device_),
     function(function_)
 {
+    if (RegisterTrace::replaying())
+    {
+        if (exists(groupnr_, bus_, device_, function_)) return;
+        throw std::runtime_error(std::string("PCM error: PciHandle ")
+            + std::to_string(groupnr_) + ":" + std::to_string(bus_) + ":" + std::to_string(device_) + ":" + std::to_string(function_)
+            + " is not in the register trace");
+    }
     int handle = openHandle(groupnr_, bus_, device_, function_);
     if (handle < 0)
     {
@@ -410,7 +419,19 @@ PciHandle::PciHandle(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 functi
 
 bool PciHandle::exists(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 function_)
 {
+    const uint64 traceDevice = RegisterTrace::pciDevice(groupnr_, bus_, device_, function_);
+    uint64 found = 0;
+
+    if (RegisterTrace::replaying())
+    {
+        RegisterTrace::replay(RegisterTrace::PCI_EXISTS, traceDevice, 0, &found, sizeof(found));
+        return found != 0;
+    }
+
     int handle = openHandle(groupnr_, bus_, device_, function_);
+    found = (handle >= 0);
+    if (RegisterTrace::recording())
+        RegisterTrace::record(RegisterTrace::PCI_EXISTS, traceDevice, 0, &found, sizeof(found));
 
     if (handle < 0) return false;
 
@@ -421,21 +442,41 @@ bool PciHandle::exists(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 func
 
 int32 PciHandle::read32(uint64 offset, uint32 * value)
 {
-    return ::pread(fd, (void *)value, sizeof(uint32), offset);
+    const uint64 traceDevice = RegisterTrace::pciDevice(groupnr, bus, device, function);
+    if (RegisterTrace::replaying())
+    {
+        if (!RegisterTrace::replay(RegisterTrace::PCICFG, traceDevice, offset, value, sizeof(uint32))) *value = 0;
+        return sizeof(uint32);
+    }
+    const int32 result = ::pread(fd, (void *)value, sizeof(uint32), offset);
+    if (result == sizeof(uint32) && RegisterTrace::recording())
+        RegisterTrace::record(RegisterTrace::PCICFG, traceDevice, offset, value, sizeof(uint32));
+    return result;
 }
 
 int32 PciHandle::write32(uint64 offset, uint32 value)
 {
+    if (RegisterTrace::replaying()) return sizeof(uint32);
     return ::pwrite(fd, (const void *)&value, sizeof(uint32), offset);
 }
 
 int32 PciHandle::read64(uint64 offset, uint64 * value)
 {
+    const uint64 traceDevice = RegisterTrace::pciDevice(groupnr, bus, device, function);
+    if (RegisterTrace::replaying())
+    {
+        if (!RegisterTrace::replay(RegisterTrace::PCICFG, traceDevice, offset, value, sizeof(uint64))) *value = 0;
+        return sizeof(uint64);
+    }
     size_t res = ::pread(fd, (void *)value, sizeof(uint64), offset);
     if(res != sizeof(uint64))
     {
         std::cerr << " ERROR: pread from " << fd << " with offset 0x" << std::hex << offset << std::dec << " returned " << res << " bytes \n";
     }
+    else if (RegisterTrace::recording())
+    {
+        RegisterTrace::record(RegisterTrace::PCICFG, traceDevice, offset, value, sizeof(uint64));
+    }
     return res;
 }
 
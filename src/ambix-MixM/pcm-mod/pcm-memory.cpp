@@ -27,42 +27,63 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <string>
 #include <assert.h>
+#include <errno.h>
+#include <algorithm>
 #include "cpucounters.h"
 #include "utils.h"
 #include "../pcm-ambix.h"
+#include "../ambix-monitor.h"
+#ifdef AMBIX_MONITOR_EMBED
+#include <thread>
+#endif
 
 
 using namespace std;
 using namespace pcm;
 
 uint32 max_imc_channels = ServerUncoreCounterState::maxChannels;
+uint32 imc_per_socket = ServerUncoreCounterState::maxControllers;
 const uint32 max_imc_controllers = ServerUncoreCounterState::maxControllers;
 
-PCM *m = PCM::getInstance();
+PCM *m = NULL; // set in monitor_init, so that embedding ctl does not touch the PMU before it asks for a monitor
 uint32 numSockets;
 ServerUncoreCounterState * BeforeState;
 ServerUncoreCounterState * AfterState;
-uint32 BeforeTime;
-uint32 AfterTime;
-
-bool pmm = (PMM_MIXED == 0 ? true : false);
-bool pmmMixed = !pmm;
+uint64 BeforeTime; // CLOCK_MONOTONIC ns of the counter reads
+uint64 AfterTime;
+vector<CoreCounterState> BeforeCoreState; // only read on systems with RDT MBM
+vector<CoreCounterState> AfterCoreState;
+int period_ms = PCM_PERIOD_MS;
+uint32 latencyEvery = PCM_LATENCY_EVERY; // 0: bandwidth only
+bool display = true; // prints system bandwidth about once per second (off when embedded in ctl)
+bool parallelRead = true; // sockets are read in parallel on their reference cores (multi-socket systems)
+vector<uint64> snapshotNs; // time of the read of each socket, for the skew between sockets
+
+// Set in main from the detected NVRAM configuration
+bool pmm = false;
+bool pmmMixed = false;
+bool mmLayout = false; // the node layout shows Memory Mode nodes
+bool mmSeen = false; // DRAM cache misses to Memory Mode NVRAM were counted
 
 memdata_t md;
+memdata_ring_t * ring = NULL;
 
 void print_help(const string prog_name)
 {
     cerr << "\n Usage: \n " << prog_name
-         << " --help | [delay] [options] [-- external_program [external_program_options]]\n";
-    cerr << "   <delay>                           => time interval to sample performance counters.\n";
-    cerr << "                                        If not specified, or 0, with external program given\n";
-    cerr << "                                        will read counters only after external program finishes\n";
+         << " --help | [period] [options]\n";
+    cerr << "   <period>                          => time interval to sample performance counters in milliseconds\n";
+    cerr << "                                        (default " << PCM_PERIOD_MS << ", at least " << PCM_PERIOD_MIN_MS << ").\n";
+    cerr << "                                        Bandwidth is still printed about once per second.\n";
     cerr << " Supported <options> are: \n";
     cerr << "  -h    | --help  | /h               => print this help and exit\n";
+    cerr << "  --no-latency                       => do not measure read latency (one period out of " << PCM_LATENCY_EVERY << " otherwise)\n";
+    cerr << "  --serial                           => read the counters of the sockets one after the other\n";
     cerr << " Examples:\n";
-    cerr << "  " << prog_name << " 1                  => print counters every second without core and socket output\n";
+    cerr << "  " << prog_name << " 50                 => publish a sample every 50 ms\n";
     cerr << "\n";
 }
 
@@ -79,10 +100,20 @@ void display_sys_bandwidth(memdata_t *md)
         \r|--                    PMM Read Throughput(MB/s):" << setw(14) << md->sys_pmmReads <<                                            "                --|\n\
         \r|--                   PMM Write Throughput(MB/s):" << setw(14) << md->sys_pmmWrites <<                                           "                --|\n";
 
-    if (PMM_MIXED) {
+    if (pmmMixed) {
         cout << "\
             \r|--                      PMM AD Throughput(MB/s):" << setw(14) << md->sys_pmmAppBW <<                                            "                --|\n\
-            \r|--                      PMM MM Throughput(MB/s):" << setw(14) << md->sys_pmmMemBW <<                                           "                --|\n";
+            \r|--                      PMM MM Throughput(MB/s):" << setw(14) << md->sys_pmmMemBW <<                                           "                --|\n\
+            \r|--                     DRAM Cache Miss Rate (%):" << setw(14) << md->sys_mmMissRate * 100 <<                                    "                --|\n";
+    }
+    if (md->n_sockets > 1) {
+        cout << "\
+            \r|--                    Socket Snapshot Skew (us):" << setw(14) << md->snapshot_skew_ns / 1000.0 <<                                 "                --|\n";
+    }
+    if (md->latency_ns > 0) {
+        cout << "\
+            \r|--                        DDR Read Latency (ns):" << setw(14) << md->sys_ddrReadLatency <<                                      "                --|\n\
+            \r|--                        PMM Read Latency (ns):" << setw(14) << md->sys_pmmReadLatency <<                                      "                --|\n";
     }
     cout << "\
         \r|--                        Read Throughput(MB/s):" << setw(14) << md->sys_dramReads+md->sys_pmmReads <<                              "                --|\n\
@@ -93,27 +124,101 @@ void display_sys_bandwidth(memdata_t *md)
         \r|--                    Total Optane Read (MEv/s):" << setw(14) << md->total_rOptane << "                --|\n\
         \r|--                   Total Optane Write (MEv/s):" << setw(14) << md->total_wOptane << "                --|\n\
         \r|---------------------------------------||---------------------------------------|\n";
+
+    for (uint32 skt = 0; skt < md->n_sockets; ++skt)
+    {
+        const socket_bw_t *sb = &md->socket[skt];
+        cout << "\
+        \r|-- Socket " << setw(2) << skt << " (MB/s) DRAM R/W:" << setw(10) << sb->dramReads << setw(10) << sb->dramWrites
+             << "  PMM R/W:" << setw(10) << sb->pmmReads << setw(10) << sb->pmmWrites << " --|\n";
+    }
 }
 
-void write_memdata(memdata_t md) {
+void write_memdata(memdata_t md, uint64 timestamp_ns) {
+    if (ring == NULL) {
+        return;
+    }
+    memdata_ring_publish(ring, &md, timestamp_ns);
+}
 
-    FILE * out_file;
-    out_file = fopen("memdata.tmp", "w");
-    fwrite(&md, sizeof(md), 1, out_file);
-    fclose(out_file);
+// Reads the uncore counters of every socket and returns the skew between the socket snapshots in ns
+uint64 read_uncore_states(ServerUncoreCounterState * states)
+{
+    if (parallelRead && numSockets > 1)
+    {
+        m->getServerUncoreCounterStates(states, snapshotNs.data());
+    }
+    else
+    {
+        for(uint32 i=0; i<numSockets; ++i)
+        {
+            const uint64 begin = memdata_now_ns();
+            states[i] = m->getServerUncoreCounterState(i);
+            snapshotNs[i] = begin + (memdata_now_ns() - begin) / 2;
+        }
+    }
+    const auto range = minmax_element(snapshotNs.begin(), snapshotNs.end());
+    return *range.second - *range.first;
+}
 
-    rename("memdata.tmp", PCM_FILE_NAME);
+// Per-core memory bandwidth (local + remote) from RDT MBM: PCM associates every core with its own RMID
+void read_core_states(vector<CoreCounterState> & states)
+{
+    for(uint32 i=0; i<md.n_cores; ++i)
+        if (m->isCoreOnline(i))
+            states[i] = m->getCoreCounterState(i);
+}
 
-    FILE * txt_file;
-    txt_file = fopen("pcmEvents.tmp", "w");
-    fprintf(txt_file, "R_DRAM: %lu\nW_DRAM: %lu\nR_OPT: %lu\nW_OPT: %lu\n", md.total_rDram, md.total_wDram, md.total_rOptane, md.total_wOptane);
-    fclose(txt_file);
+void calculate_core_bandwidth(const vector<CoreCounterState> & before, const vector<CoreCounterState> & after, const uint64 elapsedNs)
+{
+    const double maxCoreBW = 1000000.0; // MB/s, larger values come from invalid MBM readings
 
-    rename("pcmEvents.tmp", "pcmEvents.txt");
+    for(uint32 i=0; i<md.n_cores; ++i)
+    {
+        // MBM counters are accumulated in MB
+        double bw = (getLocalMemoryBW(before[i], after[i]) + getRemoteMemoryBW(before[i], after[i])) * 1e9 / elapsedNs;
+        md.core_mbw[i] = (bw < maxCoreBW) ? (float) bw : 0.0f;
+    }
 }
 
+// Read latency at the memory controllers of every socket (occupancy / inserts, in DRAM clocks, as in pcm-latency).
+// Counters must have been programmed with programServerUncoreReadLatencyMetrics.
+void calculate_latency(const ServerUncoreCounterState uncState1[], const ServerUncoreCounterState uncState2[], const uint64 elapsedNs, const uint64 timestampNs)
+{
+    double sysDdrNs = 0, sysDdrReads = 0, sysPmmNs = 0, sysPmmReads = 0;
+
+    for(uint32 skt=0; skt < numSockets; ++skt)
+    {
+        double ddrOcc = 0, ddrIns = 0, pmmOcc = 0, pmmIns = 0;
+        // DRAM clocks per ns
+        const double dramSpeed = double(getDRAMClocks(0, uncState1[skt], uncState2[skt])) / elapsedNs;
+
+        for (uint32 channel = 0; channel < max_imc_channels; ++channel)
+        {
+            ddrOcc += getMCCounter(channel, ServerPCICFGUncore::LatencyPosition::DDR_RPQ_OCC, uncState1[skt], uncState2[skt]);
+            ddrIns += getMCCounter(channel, ServerPCICFGUncore::LatencyPosition::DDR_RPQ_INS, uncState1[skt], uncState2[skt]);
+            pmmOcc += getMCCounter(channel, ServerPCICFGUncore::LatencyPosition::PMM_RDQ_OCC, uncState1[skt], uncState2[skt]);
+            pmmIns += getMCCounter(channel, ServerPCICFGUncore::LatencyPosition::PMM_RDQ_INS, uncState1[skt], uncState2[skt]);
+        }
 
-memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const ServerUncoreCounterState uncState2[], const uint64 elapsedTime)
+        const double ddrNs = (ddrIns > 0 && dramSpeed > 0) ? ddrOcc / ddrIns / dramSpeed : 0;
+        const double pmmNs = (pmmIns > 0 && dramSpeed > 0) ? pmmOcc / pmmIns / dramSpeed : 0;
+        sysDdrNs += ddrNs * ddrIns;
+        sysDdrReads += ddrIns;
+        sysPmmNs += pmmNs * pmmIns;
+        sysPmmReads += pmmIns;
+        if (skt < PCM_MAX_SOCKETS) {
+            md.latency[skt].ddrRead = ddrNs;
+            md.latency[skt].pmmRead = pmmNs;
+        }
+    }
+
+    md.sys_ddrReadLatency = (sysDdrReads > 0) ? sysDdrNs / sysDdrReads : 0;
+    md.sys_pmmReadLatency = (sysPmmReads > 0) ? sysPmmNs / sysPmmReads : 0;
+    md.latency_ns = timestampNs;
+}
+
+memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const ServerUncoreCounterState uncState2[], const uint64 elapsedNs)
 {
     //uint64 pmmMemoryModeCleanMisses = 0, pmmMemoryModeDirtyMisses = 0;
 
@@ -125,17 +230,27 @@ memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const
     md.sys_pmmAppBW = 0.0;
     md.sys_pmmMemBW = 0.0;
 
-    auto toBW = [&elapsedTime](const uint64 nEvents)
+    uint64 sysReads = 0, sysMisses = 0;
+
+    md.elapsed_ns = elapsedNs;
+
+    auto toBW = [&elapsedNs](const uint64 nEvents)
     {
-        return (float)(nEvents * 64 / 1000000.0 / (elapsedTime / 1000.0));
+        return (float)(nEvents * 64 * 1000.0 / elapsedNs);
     };
-    auto toMEv = [&elapsedTime](const uint64 nEvents)
+    auto toMEv = [](const uint64 nEvents)
     {
         return (uint64)(nEvents / 1000000);
     };
 
+    const uint32 channelsPerImc = max(max_imc_channels / max(imc_per_socket, uint32(1)), uint32(1));
+
     for(uint32 skt=0; skt < numSockets; ++skt)
     {
+        // Sockets past PCM_MAX_SOCKETS only count in the system totals
+        socket_bw_t sb;
+        memset(&sb, 0, sizeof(sb));
+
         for (uint32 channel = 0; channel < max_imc_channels; ++channel)
         {
             uint64 reads = 0, writes = 0, pmmReads = 0, pmmWrites = 0, pmmMemoryModeCleanMisses = 0, pmmMemoryModeDirtyMisses = 0;
@@ -157,21 +272,36 @@ memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const
                 continue;
             }
 
+            sysReads += reads;
+            sysMisses += pmmMemoryModeCleanMisses + pmmMemoryModeDirtyMisses;
+
             md.total_rDram += toMEv(reads);
             md.total_wDram += toMEv(writes);
 
-            md.sys_dramReads += toBW(reads);
-            md.sys_dramWrites += toBW(writes);
+            sb.dramReads += toBW(reads);
+            sb.dramWrites += toBW(writes);
+            if (channel < PCM_MAX_CHANNELS) {
+                sb.channel[channel].dramReads = toBW(reads);
+                sb.channel[channel].dramWrites = toBW(writes);
+            }
 
             if (pmm) {
                 md.total_rOptane += toMEv(pmmReads);
                 md.total_wOptane += toMEv(pmmWrites);
 
-                md.sys_pmmReads += toBW(pmmReads);
-                md.sys_pmmWrites += toBW(pmmWrites);
+                sb.pmmReads += toBW(pmmReads);
+                sb.pmmWrites += toBW(pmmWrites);
+                if (channel < PCM_MAX_CHANNELS) {
+                    sb.channel[channel].pmmReads = toBW(pmmReads);
+                    sb.channel[channel].pmmWrites = toBW(pmmWrites);
+                }
+                if (channel / channelsPerImc < PCM_MAX_IMCS) {
+                    sb.imc[channel / channelsPerImc].pmmReads += toBW(pmmReads);
+                    sb.imc[channel / channelsPerImc].pmmWrites += toBW(pmmWrites);
+                }
             }
             else if (pmmMixed) {
-                md.sys_pmmMemBW += toBW(pmmMemoryModeCleanMisses + 2 * pmmMemoryModeDirtyMisses);
+                sb.pmmMemBW += toBW(pmmMemoryModeCleanMisses + 2 * pmmMemoryModeDirtyMisses);
             }
         }
 
@@ -184,52 +314,48 @@ memdata_t calculate_bandwidth(const ServerUncoreCounterState uncState1[], const
                 md.total_rOptane += toMEv(pmmReads);
                 md.total_wOptane += toMEv(pmmWrites);
 
-                md.sys_pmmReads += toBW(pmmReads);
-                md.sys_pmmWrites += toBW(pmmWrites);
+                sb.pmmReads += toBW(pmmReads);
+                sb.pmmWrites += toBW(pmmWrites);
+                if (c < PCM_MAX_IMCS) {
+                    sb.imc[c].pmmReads = toBW(pmmReads);
+                    sb.imc[c].pmmWrites = toBW(pmmWrites);
+                }
             }
+            sb.pmmAppBW = max(sb.pmmReads + sb.pmmWrites - sb.pmmMemBW, float(0.0));
+        }
+        else {
+            sb.pmmAppBW = sb.pmmReads + sb.pmmWrites;
+        }
+
+        md.sys_dramReads += sb.dramReads;
+        md.sys_dramWrites += sb.dramWrites;
+        md.sys_pmmReads += sb.pmmReads;
+        md.sys_pmmWrites += sb.pmmWrites;
+        md.sys_pmmMemBW += sb.pmmMemBW;
+        if (skt < PCM_MAX_SOCKETS) {
+            md.socket[skt] = sb;
         }
     }
 
     if (pmmMixed) {
         md.sys_pmmAppBW = max(md.sys_pmmReads + md.sys_pmmWrites - md.sys_pmmMemBW, float(0.0));
+        // Every DRAM cache access is an iMC read (misses are filled from NVRAM through the same read)
+        md.sys_mmMissRate = (sysReads > 0) ? min(float(1.0 * sysMisses / sysReads), float(1.0)) : 0;
+        mmSeen = mmSeen || (sysMisses > 0);
     }
+    else {
+        md.sys_pmmAppBW = md.sys_pmmReads + md.sys_pmmWrites; // all NVRAM traffic is App Direct
+    }
+    md.pmm_mixed = mmLayout || mmSeen;
 
     return md;
 }
 
-int main(int argc, char * argv[])
+// Checks the processor, programs the memory counters and takes the first counter reads. Errors go to cerr, returns
+// false if the counters cannot be used.
+bool monitor_init()
 {
-    set_signal_handlers();
-
-#ifdef PCM_FORCE_SILENT
-    null_stream nullStream1, nullStream2;
-    cout.rdbuf(&nullStream1);
-    cerr.rdbuf(&nullStream2);
-#endif
-
-    cerr << "\n";
-    cerr << " Processor Counter Monitor: Memory Bandwidth Monitoring Utility " << PCM_VERSION << "\n";
-    cerr << "\n";
-
-    cerr << " This utility measures memory bandwidth per channel or per DIMM rank in real-time\n";
-    cerr << "\n";
-
-    string program = string(argv[0]);
-
-
-    if (argc > 1) do
-    {
-        argv++;
-        argc--;
-        if (strncmp(*argv, "--help", 6) == 0 ||
-            strncmp(*argv, "-h", 2) == 0 ||
-            strncmp(*argv, "/h", 2) == 0)
-        {
-            print_help(program);
-            exit(EXIT_FAILURE);
-        }
-    } while(argc > 1); // end of command line parsing loop
-
+    m = PCM::getInstance();
     m->disableJKTWorkaround();
     print_cpu_details();
     if (!m->hasPCICFGUncore())
@@ -237,13 +363,21 @@ int main(int argc, char * argv[])
         cerr << "Unsupported processor model (" << m->getCPUModel() << ").\n";
         if (m->memoryTrafficMetricsAvailable())
             cerr << "For processor-level memory bandwidth statistics please use pcm.x\n";
-        exit(EXIT_FAILURE);
+        return false;
     }
     if ((m->PMMTrafficMetricsAvailable()) == false)
     {
         cerr << "PMM traffic metrics are not available on your processor.\n";
-        exit(EXIT_FAILURE);
+        return false;
     }
+    // Mixed mode counters (PMM traffic from M2M, Memory Mode misses from the iMC) also measure App Direct only
+    // systems, so they are used unless the node layout rules Memory Mode out
+    int pmmMode = pmm_detect_mode();
+    mmLayout = (pmmMode == PMM_MODE_MIXED);
+    pmmMixed = (pmmMode != PMM_MODE_AD);
+    pmm = !pmmMixed;
+    cerr << "NVRAM configuration: " << (mmLayout ? "App Direct + Memory Mode" : (pmmMixed ? "unknown (no HMAT), detecting Memory Mode from DRAM cache misses" : "App Direct")) << "\n";
+
     PCM::ErrorCode status = m->programServerUncoreMemoryMetrics(-1, -1, pmm || pmmMixed, pmmMixed);
     switch (status)
     {
@@ -251,9 +385,10 @@ int main(int argc, char * argv[])
             break;
         case PCM::MSRAccessDenied:
             cerr << "Access to Processor Counter Monitor has denied (no MSR or PCI CFG space access).\n";
-            exit(EXIT_FAILURE);
+            return false;
         case PCM::PMUBusy:
             cerr << "Access to Processor Counter Monitor has denied (Performance Monitoring Unit is occupied by other application). Try to stop the application that uses PMU.\n";
+#ifndef AMBIX_MONITOR_EMBED
             cerr << "Alternatively you can try to reset PMU configuration at your own risk. Try to reset? (y/n)\n";
             char yn;
             cin >> yn;
@@ -262,20 +397,51 @@ int main(int argc, char * argv[])
                 m->resetPMU();
                 cerr << "PMU configuration has been reset. Try to rerun the program again.\n";
             }
-            exit(EXIT_FAILURE);
+#endif
+            return false;
         default:
             cerr << "Access to Processor Counter Monitor has denied (Unknown error).\n";
-            exit(EXIT_FAILURE);
+            return false;
     }
 
     numSockets = m->getNumSockets();
-    if(numSockets > MAX_SOCKETS)
+    snapshotNs.resize(numSockets);
+    if(numSockets > PCM_MAX_SOCKETS)
     {
-        cerr << "Only systems with up to " << MAX_SOCKETS << " sockets are supported! Program aborted\n";
-        exit(EXIT_FAILURE);
+        cerr << "Per-socket bandwidth is only published for the first " << PCM_MAX_SOCKETS << " sockets.\n";
     }
 
     max_imc_channels = m->getMCChannelsPerSocket();
+    imc_per_socket = m->getMCPerSocket();
+    if(max_imc_channels > PCM_MAX_CHANNELS || imc_per_socket > PCM_MAX_IMCS)
+    {
+        cerr << "Per-channel bandwidth is only published for the first " << PCM_MAX_CHANNELS << " channels and "
+             << PCM_MAX_IMCS << " memory controllers of each socket.\n";
+    }
+
+    md.n_sockets = min(numSockets, uint32(PCM_MAX_SOCKETS));
+    md.n_imcs = min(imc_per_socket, uint32(PCM_MAX_IMCS));
+    md.n_channels = min(max_imc_channels, uint32(PCM_MAX_CHANNELS));
+
+    if (latencyEvery > 0 && !m->DDRLatencyMetricsAvailable())
+    {
+        cerr << "Read latency metrics are not available on your processor.\n";
+        latencyEvery = 0;
+    }
+
+    md.n_cores = 0;
+    if (m->CoreLocalMemoryBWMetricAvailable())
+    {
+        md.n_cores = min(m->getNumCores(), uint32(PCM_MAX_CORES));
+        if (m->getNumCores() > PCM_MAX_CORES)
+            cerr << "Per-core memory bandwidth is only published for the first " << PCM_MAX_CORES << " cores.\n";
+        BeforeCoreState.resize(md.n_cores);
+        AfterCoreState.resize(md.n_cores);
+    }
+    else
+    {
+        cerr << "Per-core memory bandwidth (RDT MBM) is not available, ctl attributes traffic with perf events.\n";
+    }
 
     BeforeState = new ServerUncoreCounterState[numSockets];
     AfterState = new ServerUncoreCounterState[numSockets];
@@ -284,12 +450,12 @@ int main(int argc, char * argv[])
 
     m->setBlocked(false);
 
-    cerr << "Update every " << PCM_DELAY << " seconds\n";
+    cerr << "Update every " << period_ms << " ms\n";
 
-    for(uint32 i=0; i<numSockets; ++i)
-        BeforeState[i] = m->getServerUncoreCounterState(i);
+    read_uncore_states(BeforeState);
+    read_core_states(BeforeCoreState);
 
-    BeforeTime = m->getTickCount();
+    BeforeTime = memdata_now_ns();
 
     // Init MD
 
@@ -306,24 +472,196 @@ int main(int argc, char * argv[])
     md.total_rOptane = 0;
     md.total_wOptane = 0;
 
-    while (true)
+    md.sys_mmMissRate = 0.0;
+    md.pmm_mixed = mmLayout;
+
+    md.sys_ddrReadLatency = 0.0;
+    md.sys_pmmReadLatency = 0.0;
+    md.latency_ns = 0;
+    md.snapshot_skew_ns = 0;
+
+    return true;
+}
+
+// Publishes a sample every period_ms to ring until *stop is set
+void monitor_loop(volatile bool * stop)
+{
+    const uint64 periodNs = (uint64) period_ms * 1000000ULL;
+    const uint64 displayEvery = max(1000 / period_ms, 1);
+    uint64 deadline = BeforeTime;
+    uint64 nSamples = 0;
+    bool latencyWindow = false; // the iMC counters are programmed for read latency during this period
+
+    while (!*stop)
     {
-        MySleep(PCM_DELAY);
+        // Absolute deadlines: the time spent reading and publishing counters does not add up as drift
+        deadline += periodNs;
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+        AfterTime = memdata_now_ns();
+        md.snapshot_skew_ns = read_uncore_states(AfterState);
+        read_core_states(AfterCoreState);
+
+        bool reprogram = false;
+        if (latencyWindow)
+        {
+            // No sample is published for the latency window, its latency goes out with the next bandwidth sample
+            calculate_latency(BeforeState,AfterState,AfterTime-BeforeTime,AfterTime);
+            m->programServerUncoreMemoryMetrics(-1, -1, pmm || pmmMixed, pmmMixed);
+            latencyWindow = false;
+            reprogram = true;
+        }
+        else
+        {
+            calculate_bandwidth(BeforeState,AfterState,AfterTime-BeforeTime);
+            calculate_core_bandwidth(BeforeCoreState,AfterCoreState,AfterTime-BeforeTime);
+            write_memdata(md, AfterTime);
+            if ((++nSamples % displayEvery) == 0 && display)
+                display_sys_bandwidth(&md);
 
-        AfterTime = m->getTickCount();
-        for(uint32 i=0; i<numSockets; ++i)
-            AfterState[i] = m->getServerUncoreCounterState(i);
+            if (latencyEvery > 0 && (nSamples % latencyEvery) == 0)
+            {
+                latencyWindow = (m->programServerUncoreReadLatencyMetrics(pmm || pmmMixed) == PCM::Success);
+                reprogram = latencyWindow;
+            }
+        }
 
-        calculate_bandwidth(BeforeState,AfterState,AfterTime-BeforeTime);
-        write_memdata(md);
-        display_sys_bandwidth(&md);
+        // After a stall (e.g. the process was stopped) skip the missed periods instead of sampling back to back
+        if (AfterTime > deadline + periodNs)
+            deadline = AfterTime;
 
         swap(BeforeTime, AfterTime);
         swap(BeforeState, AfterState);
+        swap(BeforeCoreState, AfterCoreState);
+
+        // Reprogramming resets the iMC counters: the next period starts from a fresh read
+        if (reprogram)
+        {
+            read_uncore_states(BeforeState);
+            BeforeTime = memdata_now_ns();
+        }
     }
+}
 
+void monitor_fini()
+{
     delete[] BeforeState;
     delete[] AfterState;
+    BeforeState = AfterState = NULL;
+}
+
+#ifdef AMBIX_MONITOR_EMBED
+
+std::thread * monitorThread = NULL;
+volatile bool monitorStop = false;
+
+memdata_ring_t * ambix_monitor_start(int period)
+{
+    if (monitorThread != NULL)
+        return ring;
+
+    period_ms = (period > 0) ? max(period, PCM_PERIOD_MIN_MS) : PCM_PERIOD_MS;
+    display = false;
+    if ((ring = memdata_ring_anon()) == NULL)
+    {
+        cerr << "Error allocating the memory feed: " << strerror(errno) << "\n";
+        return NULL;
+    }
+    if (!monitor_init())
+    {
+        memdata_ring_close(ring);
+        ring = NULL;
+        return NULL;
+    }
+
+    monitorStop = false;
+    monitorThread = new std::thread(monitor_loop, &monitorStop);
+    return ring;
+}
+
+void ambix_monitor_stop()
+{
+    if (monitorThread == NULL)
+        return;
+
+    monitorStop = true;
+    monitorThread->join();
+    delete monitorThread;
+    monitorThread = NULL;
+
+    monitor_fini();
+    m->cleanup();
+    memdata_ring_close(ring);
+    ring = NULL;
+}
+
+#else
+
+int main(int argc, char * argv[])
+{
+    set_signal_handlers();
+
+#ifdef PCM_FORCE_SILENT
+    null_stream nullStream1, nullStream2;
+    cout.rdbuf(&nullStream1);
+    cerr.rdbuf(&nullStream2);
+#endif
+
+    cerr << "\n";
+    cerr << " Processor Counter Monitor: Memory Bandwidth Monitoring Utility " << PCM_VERSION << "\n";
+    cerr << "\n";
+
+    cerr << " This utility measures memory bandwidth per channel or per DIMM rank in real-time\n";
+    cerr << "\n";
+
+    string program = string(argv[0]);
+
+
+    if (argc > 1) do
+    {
+        argv++;
+        argc--;
+        if (strncmp(*argv, "--help", 6) == 0 ||
+            strncmp(*argv, "-h", 2) == 0 ||
+            strncmp(*argv, "/h", 2) == 0)
+        {
+            print_help(program);
+            exit(EXIT_FAILURE);
+        }
+        else if (strncmp(*argv, "--no-latency", 12) == 0)
+        {
+            latencyEvery = 0;
+        }
+        else if (strncmp(*argv, "--serial", 8) == 0)
+        {
+            parallelRead = false;
+        }
+        else if (isdigit(**argv))
+        {
+            period_ms = max(atoi(*argv), PCM_PERIOD_MIN_MS);
+        }
+    } while(argc > 1); // end of command line parsing loop
+
+    if (!monitor_init())
+        exit(EXIT_FAILURE);
+
+    ring = memdata_ring_open(1);
+    if (ring == NULL)
+    {
+        cerr << "Error creating shared memory feed " << PCM_SHM_NAME << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    volatile bool stop = false;
+    monitor_loop(&stop);
+
+    monitor_fini();
+    memdata_ring_close(ring);
 
     exit(EXIT_SUCCESS);
 }
+
+#endif
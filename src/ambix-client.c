@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "ambix.h"
 
 #include <numa.h>
@@ -5,19 +6,66 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/mman.h>
 
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
 
 
-int bind_uds(int pid_arg) {
+// Sends a single request to ctl over the unix domain socket and reads reply_size bytes of reply (if any). Returns 1 on success.
+static int send_uds_req(req_t *req, void *reply, size_t reply_size) {
     // Unix domain socket
     struct sockaddr_un uds_addr;
     int unix_fd, w_ret;
+
+    if((unix_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "Error creating UD socket: %s\n", strerror(errno));
+        return 0;
+    }
+    memset(&uds_addr, 0, sizeof(uds_addr));
+    uds_addr.sun_family = AF_UNIX;
+
+    strncpy(uds_addr.sun_path, UDS_path, sizeof(uds_addr.sun_path)-1);
+
+    if(connect(unix_fd, (struct sockaddr*)&uds_addr, sizeof(uds_addr))) {
+        fprintf(stderr, "Error connecting to server via UDS: %s\n", strerror(errno));
+
+        close(unix_fd);
+        return 0;
+    }
+
+    if ((w_ret = write(unix_fd, req, sizeof(req_t))) != sizeof(req_t)) {
+        if (w_ret == -1) {
+            fprintf(stderr, "Error writing to UDS fd: %s\n", strerror(errno));
+        }
+        else {
+            fprintf(stderr, "Unexpected amount of bytes written to UDS fd.\n");
+        }
+
+        close(unix_fd);
+        return 0;
+    }
+
+    if ((reply != NULL) && (read(unix_fd, reply, reply_size) != (ssize_t) reply_size)) {
+        fprintf(stderr, "Unexpected reply from ctl via UDS.\n");
+
+        close(unix_fd);
+        return 0;
+    }
+
+    close(unix_fd);
+    return 1;
+}
+
+
+int bind_uds_prio(int pid_arg, int priority, int weight) {
     req_t bind_req;
     int pid;
 
@@ -54,46 +102,21 @@ int bind_uds(int pid_arg) {
         return 0;
     }*/
 
-    if((unix_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        fprintf(stderr, "Error creating UD socket: %s\n", strerror(errno));
-        return 0;
-    }
-    memset(&uds_addr, 0, sizeof(uds_addr));
-    uds_addr.sun_family = AF_UNIX;
-
-    strncpy(uds_addr.sun_path, UDS_path, sizeof(uds_addr.sun_path)-1);
-
-    if(connect(unix_fd, (struct sockaddr*)&uds_addr, sizeof(uds_addr))) {
-        fprintf(stderr, "Error connecting to server via UDS: %s\n", strerror(errno));
-
-        close(unix_fd);
-        return 0;
-    }
-
+    memset(&bind_req, 0, sizeof(bind_req));
     bind_req.op_code = BIND_OP;
     bind_req.pid_n = pid;
+    bind_req.priority = priority;
+    bind_req.weight = weight;
 
-    if ((w_ret = write(unix_fd, &bind_req, sizeof(bind_req))) != sizeof(bind_req)) {
-        if (w_ret == -1) {
-            fprintf(stderr, "Error writing to UDS fd: %s\n", strerror(errno));
-        }
-        else {
-            fprintf(stderr, "Unexpected amount of bytes written to UDS fd.\n");
-        }
-
-        close(unix_fd);
-        return 0;
-    }
+    return send_uds_req(&bind_req, NULL, 0);
+}
 
-    close(unix_fd);
-    return 1;
+int bind_uds(int pid_arg) {
+    return bind_uds_prio(pid_arg, PRIO_NORMAL, DEFAULT_WEIGHT);
 }
 
 
 int unbind_uds(int pid_arg) {
-    // Unix domain socket
-    struct sockaddr_un uds_addr;
-    int unix_fd, w_ret;
     req_t unbind_req;
     int pid;
 
@@ -105,45 +128,188 @@ int unbind_uds(int pid_arg) {
     }
     // munlock(0, MAX_ADDRESS);
 
-    if((unix_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        fprintf(stderr, "Error creating UD socket: %s\n", strerror(errno));
+    memset(&unbind_req, 0, sizeof(unbind_req));
+    unbind_req.op_code = UNBIND_OP;
+    unbind_req.pid_n = pid;
+
+    return send_uds_req(&unbind_req, NULL, 0);
+}
+
+void bind_uds_ft_() {
+    bind_uds(0);
+}
+void bind_uds_prio_ft_(int *priority, int *weight) {
+    bind_uds_prio(0, *priority, *weight);
+}
+void unbind_uds_ft_() {
+    unbind_uds(0);
+}
+
+
+// Hints are page-granular: the range is widened to the pages it touches
+static int send_hint(int kind, void *addr, size_t len) {
+    req_t hint_req;
+    unsigned long page_mask = ~((unsigned long) sysconf(_SC_PAGESIZE) - 1);
+    unsigned long start = (unsigned long) addr & page_mask;
+    unsigned long end = ((unsigned long) addr + len + ~page_mask) & page_mask;
+
+    if (len == 0) {
         return 0;
     }
-    memset(&uds_addr, 0, sizeof(uds_addr));
-    uds_addr.sun_family = AF_UNIX;
 
-    strncpy(uds_addr.sun_path, UDS_path, sizeof(uds_addr.sun_path)-1);
+    memset(&hint_req, 0, sizeof(hint_req));
+    hint_req.op_code = HINT_OP;
+    hint_req.pid_n = getpid();
+    hint_req.mode = kind;
+    hint_req.addr = start;
+    hint_req.len = end - start;
 
-    if(connect(unix_fd, (struct sockaddr*)&uds_addr, sizeof(uds_addr))) {
-        fprintf(stderr, "Error connecting to server via UDS: %s\n", strerror(errno));
+    return send_uds_req(&hint_req, NULL, 0);
+}
 
-        close(unix_fd);
-        return 0;
+int ambix_hint_hot(void *addr, size_t len) {
+    return send_hint(HINT_HOT, addr, len);
+}
+
+int ambix_hint_cold(void *addr, size_t len) {
+    return send_hint(HINT_COLD, addr, len);
+}
+
+int ambix_pin_tier(void *addr, size_t len, int tier) {
+    if (tier == DRAM_MODE) {
+        return send_hint(HINT_PIN_DRAM, addr, len);
     }
+    else if (tier == NVRAM_MODE) {
+        return send_hint(HINT_PIN_NVRAM, addr, len);
+    }
+    return 0;
+}
 
-    unbind_req.op_code = UNBIND_OP;
-    unbind_req.pid_n = pid;
+int ambix_hint_clear(void *addr, size_t len) {
+    return send_hint(HINT_CLEAR, addr, len);
+}
 
-    if ((w_ret = write(unix_fd, &unbind_req, sizeof(unbind_req))) != sizeof(unbind_req)) {
-        if (w_ret == -1) {
-            fprintf(stderr, "Error writing to UDS fd: %s\n", strerror(errno));
+
+// Allocation-time placement
+
+static __thread int alloc_tier = TIER_ANY; // call-site tier set by ambix_alloc_tier
+
+static pthread_mutex_t headroom_lock = PTHREAD_MUTEX_INITIALIZER;
+static headroom_t headroom;
+static int headroom_valid = 0;
+static long long headroom_time_ms = 0;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int ambix_headroom(headroom_t *out) {
+    req_t headroom_req;
+
+    memset(&headroom_req, 0, sizeof(headroom_req));
+    headroom_req.op_code = HEADROOM_OP;
+    headroom_req.pid_n = getpid();
+
+    return send_uds_req(&headroom_req, out, sizeof(headroom_t));
+}
+
+int ambix_alloc_tier(int tier) {
+    int prev = alloc_tier;
+    alloc_tier = tier;
+    return prev;
+}
+
+// Picks the tier for a new allocation of len bytes, TIER_ANY leaves it to first touch
+static int choose_tier(size_t len) {
+    int tier = TIER_ANY;
+
+    if (alloc_tier != TIER_ANY) {
+        return alloc_tier;
+    }
+    if (len >= ((size_t) ALLOC_NVRAM_MIN_MB << 20)) {
+        return NVRAM_MODE;
+    }
+
+    pthread_mutex_lock(&headroom_lock);
+    // Headroom is reused between refreshes and charged locally so that bursts of allocations do not overcommit DRAM
+    if ((headroom_time_ms == 0) || (now_ms() - headroom_time_ms >= HEADROOM_REFRESH_MS)) {
+        headroom_valid = ambix_headroom(&headroom);
+        headroom_time_ms = now_ms();
+    }
+    if (headroom_valid) {
+        if ((long long) len <= headroom.dram_free) {
+            headroom.dram_free -= len;
+            tier = DRAM_MODE;
         }
         else {
-            fprintf(stderr, "Unexpected amount of bytes written to UDS fd.\n");
+            headroom.nvram_free -= len;
+            tier = NVRAM_MODE;
         }
+    }
+    pthread_mutex_unlock(&headroom_lock);
+    return tier;
+}
 
+// Node of the tier closest to the CPU the caller is running on
+static int closest_node(int tier) {
+    const int *nodes = (tier == DRAM_MODE) ? DRAM_NODES : NVRAM_NODES;
+    int n_nodes = (tier == DRAM_MODE) ? n_dram_nodes : n_nvram_nodes;
+    int cpu = sched_getcpu();
+    int cpu_node = (cpu >= 0) ? numa_node_of_cpu(cpu) : -1;
+    int best = nodes[0];
 
-        close(unix_fd);
-        return 0;
+    if (cpu_node < 0) {
+        return best;
     }
+    for (int i=1; i < n_nodes; i++) {
+        if (numa_distance(cpu_node, nodes[i]) < numa_distance(cpu_node, best)) {
+            best = nodes[i];
+        }
+    }
+    return best;
+}
 
-    close(unix_fd);
-    return 1;
+int ambix_place(void *addr, size_t len) {
+    unsigned long page_mask = ~((unsigned long) sysconf(_SC_PAGESIZE) - 1);
+    // Only whole pages inside the allocation are bound, partial pages may be shared with neighbouring data
+    unsigned long start = ((unsigned long) addr + ~page_mask) & page_mask;
+    unsigned long end = ((unsigned long) addr + len) & page_mask;
+    unsigned long nodemask;
+    int tier, node;
+
+    if ((addr == NULL) || (len < ((size_t) ALLOC_PLACE_MIN_MB << 20)) || (end <= start)) {
+        return TIER_ANY;
+    }
+    if ((tier = choose_tier(len)) == TIER_ANY) {
+        return TIER_ANY;
+    }
+    if (((node = closest_node(tier)) > numa_max_node()) || (node >= (int) (sizeof(nodemask) * 8))) {
+        return TIER_ANY;
+    }
+
+    // Preferred rather than bound: a full tier falls back to other nodes and Ambix can still migrate the pages later
+    nodemask = 1UL << node;
+    if (mbind((void *) start, end - start, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0)) {
+        fprintf(stderr, "Error in mbind: %s\n", strerror(errno));
+        return TIER_ANY;
+    }
+    return tier;
 }
 
-void bind_uds_ft_() {
-    bind_uds(0);
+void *ambix_malloc(size_t size) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    ambix_place(ptr, size);
+    return ptr;
 }
-void unbind_uds_ft_() {
-    unbind_uds(0);
+
+void ambix_free(void *ptr, size_t size) {
+    if (ptr != NULL) {
+        munmap(ptr, size);
+    }
 }
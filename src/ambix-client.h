@@ -1,9 +1,26 @@
 #ifndef _CLIENT_PLACEMENT_H
 #define _CLIENT_PLACEMENT_H
 
+#include <stddef.h>
+
 // Client bind via UDS
 
 extern int bind_uds(int pid);
+extern int bind_uds_prio(int pid, int priority, int weight); // priority is one of the PRIO_* classes in ambix.h
 extern int unbind_uds(int pid);
 
+// Placement hints for the calling process (must be bound). Ranges are rounded out to whole pages.
+
+extern int ambix_hint_hot(void *addr, size_t len);
+extern int ambix_hint_cold(void *addr, size_t len);
+extern int ambix_pin_tier(void *addr, size_t len, int tier); // tier is DRAM_MODE or NVRAM_MODE in ambix.h
+extern int ambix_hint_clear(void *addr, size_t len);
+
+// Allocation-time placement: large allocations are bound to a tier before first touch (see ALLOC_* in ambix.h)
+
+extern int ambix_alloc_tier(int tier); // call-site tier for the calling thread (DRAM_MODE, NVRAM_MODE or TIER_ANY), returns the previous one
+extern int ambix_place(void *addr, size_t len); // places a fresh, untouched allocation, returns the chosen tier or TIER_ANY
+extern void *ambix_malloc(size_t size);
+extern void ambix_free(void *ptr, size_t size);
+
 #endif
@@ -0,0 +1,113 @@
+#ifndef _AMBIX_POLICY_H
+#define _AMBIX_POLICY_H
+
+// Placement policy plugins: shared objects loaded by ctl with dlopen, exporting a policy_t named POLICY_SYMBOL.
+// ctl keeps everything that is common to all policies (node memory accounting, pcm feed, cost model, snapshots,
+// pressure events and the memcheck interval) and asks the policy what to move on every memcheck tick.
+// Policies can be swapped at runtime with the "policy load [path]" command. Otherwise ctl picks POLICY_DEFAULT or
+// POLICY_MIXED from the detected NVRAM configuration, and swaps them if pcm reports a different one.
+
+#include "ambix.h"
+#include "pcm-ambix.h"
+
+#include <math.h>
+
+#define POLICY_API_VERSION 5
+#define POLICY_SYMBOL "ambix_policy"
+#define POLICY_DEFAULT "./policy-hyb.so" // App Direct only systems
+#define POLICY_MIXED "./policy-mixm.so" // App Direct + Memory Mode systems
+#define POLICY_ENV "AMBIX_POLICY" // overrides the automatic choice between POLICY_DEFAULT and POLICY_MIXED
+
+// System state handed to the policy on every memcheck tick
+typedef struct policy_state {
+    float dram_usage, nvram_usage; // used fraction of each tier
+    long long dram_sz, nvram_sz; // tier sizes in bytes
+    long page_size;
+    int memdata_valid; // md holds a new sample that passed the sanity checks
+    memdata_t md;
+    int pmm_mixed; // Memory Mode is in use (from the pcm feed, or from the node layout until the first sample)
+    float bound_share; // fraction of the memory traffic generated by bound processes, -1 if unknown
+    float nvram_latency; // worst NVRAM read latency of the sockets in ns, 0 if not measured recently
+    float latency_slo; // ns, 0 if the latency trigger is disabled
+    int pressure; // memcheck was woken up by a memory pressure event
+    int switch_act, thresh_act; // placement components enabled by the user
+    int memcheck_interval; // in microseconds
+} policy_state_t;
+
+// Outcome of a tick, used by ctl to schedule the next one
+typedef struct policy_result {
+    int n_migrated;
+    int active; // a placement condition was met (resets the idle backoff)
+    int slept_us; // time spent sleeping inside the tick (e.g. clear window), deducted from the next sleep
+} policy_result_t;
+
+// ctl functions available to policies. find and clear take the placement lock themselves.
+typedef struct policy_api {
+    int (*find)(int n_pages, int mode); // asks the module for candidates and migrates them, returns migrated pages
+    int (*find_nodes)(int n_pages, int mode, unsigned long node_mask); // same, only walking the nodes in node_mask
+    int (*clear)(unsigned long *young, unsigned long *scanned); // NVRAM_CLEAR walk, returns young/scanned pages
+    void (*refresh)(policy_state_t *st); // re-reads tier usage after migrations
+    long long (*time_us)();
+    int (*node_socket)(int node); // socket index of the pcm feed the node belongs to, -1 if unknown
+} policy_api_t;
+
+typedef struct policy {
+    int api_version; // must be POLICY_API_VERSION
+    const char *name;
+    int (*init)(const policy_api_t *api); // optional, non-zero fails the load
+    void (*tick)(policy_state_t *st, policy_result_t *res);
+    // Optional: filters/reorders the candidates returned by the module before they are migrated and returns how many
+    // of them (from the start) are kept. In SWITCH_MODE cands holds the NVRAM candidates, a separator and as many
+    // DRAM candidates, and the same count is kept from both lists.
+    int (*on_candidates)(int mode, addr_info_t *cands, int n);
+    int (*command)(char *args); // optional: handles "policy [args]" commands, returns 0 if args are not understood
+    void (*stats)(); // optional: prints policy state on "stats"
+    void (*fini)(); // optional
+} policy_t;
+
+// Latency trigger shared by the policies: NVRAM reads are slower than the SLO
+static inline int policy_latency_missed(const policy_state_t *st) {
+    return (st->latency_slo > 0) && (st->nvram_latency > st->latency_slo);
+}
+
+// Observation window between the NVRAM clear and the switch walk, shared by the policies (see CLEAR_DELAY)
+typedef struct policy_clear_window {
+    int interval_us;
+    long long last_clear_us;
+} policy_clear_window_t;
+
+#define POLICY_CLEAR_WINDOW_INIT {CLEAR_DELAY * 1000, 0}
+
+// Sets the window after a clear at now_us. The rate at which NVRAM pages are first touched is estimated from the young
+// pages of the epoch that just ended (or from NVRAM bandwidth without one), and the window is sized to see about
+// n_wanted young pages. Saturated epochs get the shortest window.
+static inline void policy_adapt_clear_window(policy_clear_window_t *w, long long now_us, unsigned long young,
+                                             unsigned long scanned, float pmm_bw, int n_wanted, long page_size) {
+    double epoch_s = (w->last_clear_us > 0) ? (now_us - w->last_clear_us) / 1000000.0 : 0;
+    double rate, window_us;
+
+    w->last_clear_us = now_us;
+
+    if ((young > 0) && (epoch_s > 0)) {
+        rate = young / epoch_s;
+    }
+    else {
+        // Bandwidth bound: every touched page moves at least one page worth of data
+        rate = pmm_bw * 1000000.0 / page_size;
+    }
+
+    if ((scanned > 0) && ((1.0 * young / scanned) >= CLEAR_DENSITY_HIGH)) {
+        window_us = CLEAR_DELAY_MIN * 1000;
+    }
+    else if (rate > 0) {
+        window_us = n_wanted / rate * 1000000;
+    }
+    else {
+        window_us = CLEAR_DELAY_MAX * 1000;
+    }
+    window_us = fmin(fmax(window_us, CLEAR_DELAY_MIN * 1000), CLEAR_DELAY_MAX * 1000);
+
+    w->interval_us = COST_EWMA_WEIGHT * window_us + (1 - COST_EWMA_WEIGHT) * w->interval_us;
+}
+
+#endif
@@ -0,0 +1,243 @@
+// LD_PRELOAD shim that binds unmodified binaries to Ambix from their first allocation:
+//   LD_PRELOAD=./libambix-preload.so ./app
+//
+// Environment:
+//   AMBIX_PRIO       batch | normal | latency (default normal)
+//   AMBIX_WEIGHT     DRAM share weight, 1 to MAX_WEIGHT (default DEFAULT_WEIGHT)
+//   AMBIX_HINT       hot | cold | dram | nvram: reports large mmap/malloc regions with this hint (default off)
+//   AMBIX_HINT_MIN   smallest region reported, in MB (default PRELOAD_HINT_MIN_MB)
+//   AMBIX_PLACE      1: binds large mmap/malloc regions to a tier before first touch (see ambix_place)
+//
+// The shim must be started from the same directory as ctl (UDS_path is relative).
+
+#define _GNU_SOURCE
+#include "ambix.h"
+#include "ambix-client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PRELOAD_HINT_MIN_MB 64
+#define PRELOAD_HINT_OFF -1
+
+// glibc entry points, used so that malloc interposition never depends on dlsym
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t) = NULL;
+static int (*real_munmap)(void *, size_t) = NULL;
+
+static int bound_pid = 0; // pid the shim bound, 0 if binding failed or was undone
+static int prio = PRIO_NORMAL;
+static int weight = DEFAULT_WEIGHT;
+static int hint_kind = PRELOAD_HINT_OFF;
+static size_t hint_min = (size_t) PRELOAD_HINT_MIN_MB << 20;
+static int place = 0;
+
+// Set while the shim talks to ctl, so allocations made on that path are not reported again
+static __thread int in_shim = 0;
+
+
+static void parse_env() {
+    const char *str;
+
+    if ((str = getenv("AMBIX_PRIO")) != NULL) {
+        if (!strcmp(str, "batch")) {
+            prio = PRIO_BATCH;
+        }
+        else if (!strcmp(str, "latency")) {
+            prio = PRIO_LATENCY;
+        }
+    }
+    if ((str = getenv("AMBIX_WEIGHT")) != NULL) {
+        int val = atoi(str);
+        if ((val > 0) && (val <= MAX_WEIGHT)) {
+            weight = val;
+        }
+    }
+    if ((str = getenv("AMBIX_HINT")) != NULL) {
+        if (!strcmp(str, "hot")) {
+            hint_kind = HINT_HOT;
+        }
+        else if (!strcmp(str, "cold")) {
+            hint_kind = HINT_COLD;
+        }
+        else if (!strcmp(str, "dram")) {
+            hint_kind = HINT_PIN_DRAM;
+        }
+        else if (!strcmp(str, "nvram")) {
+            hint_kind = HINT_PIN_NVRAM;
+        }
+    }
+    if ((str = getenv("AMBIX_PLACE")) != NULL) {
+        place = atoi(str) > 0;
+    }
+    if ((str = getenv("AMBIX_HINT_MIN")) != NULL) {
+        long val = atol(str);
+        if (val > 0) {
+            hint_min = (size_t) val << 20;
+        }
+    }
+}
+
+static int hinting() {
+    return (hint_kind != PRELOAD_HINT_OFF) && (bound_pid != 0) && (bound_pid == getpid()) && !in_shim;
+}
+
+// Called for every new region: places it (AMBIX_PLACE) and reports it with the configured hint (AMBIX_HINT)
+static void report_region(void *addr, size_t len) {
+    if (place && !in_shim && (addr != NULL)) {
+        in_shim = 1;
+        ambix_place(addr, len);
+        in_shim = 0;
+    }
+    if ((addr == NULL) || (len < hint_min) || !hinting()) {
+        return;
+    }
+    in_shim = 1;
+    switch (hint_kind) {
+        case HINT_HOT:
+            ambix_hint_hot(addr, len);
+            break;
+        case HINT_COLD:
+            ambix_hint_cold(addr, len);
+            break;
+        case HINT_PIN_DRAM:
+            ambix_pin_tier(addr, len, DRAM_MODE);
+            break;
+        case HINT_PIN_NVRAM:
+            ambix_pin_tier(addr, len, NVRAM_MODE);
+            break;
+    }
+    in_shim = 0;
+}
+
+static void forget_region(void *addr, size_t len) {
+    if ((addr == NULL) || (len < hint_min) || !hinting()) {
+        return;
+    }
+    in_shim = 1;
+    ambix_hint_clear(addr, len);
+    in_shim = 0;
+}
+
+static void bind_self(int after_exec) {
+    in_shim = 1;
+    if (bind_uds_prio(0, prio, weight)) {
+        bound_pid = getpid();
+        if (after_exec && (hint_kind != PRELOAD_HINT_OFF)) {
+            // After exec the pid stays bound but its old address space (and hints) are gone
+            ambix_hint_clear(NULL, MAX_ADDRESS);
+        }
+    }
+    else {
+        bound_pid = 0;
+    }
+    in_shim = 0;
+}
+
+// Forked children are new processes: bind them with the parent's settings
+static void atfork_child() {
+    bound_pid = 0;
+    bind_self(0);
+}
+
+
+/*
+-------------------------------------------------------------------------------
+
+CONSTRUCTOR/DESTRUCTOR
+
+-------------------------------------------------------------------------------
+*/
+
+__attribute__((constructor))
+static void ambix_preload_init() {
+    real_mmap = dlsym(RTLD_NEXT, "mmap");
+    real_munmap = dlsym(RTLD_NEXT, "munmap");
+
+    parse_env();
+    pthread_atfork(NULL, NULL, atfork_child);
+    bind_self(1);
+}
+
+__attribute__((destructor))
+static void ambix_preload_fini() {
+    // Only the process that bound itself unbinds (children that exit through the parent's atexit path do not)
+    if ((bound_pid != 0) && (bound_pid == getpid())) {
+        in_shim = 1;
+        unbind_uds(0);
+        bound_pid = 0;
+        in_shim = 0;
+    }
+}
+
+
+/*
+-------------------------------------------------------------------------------
+
+INTERPOSED FUNCTIONS
+
+-------------------------------------------------------------------------------
+*/
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    void *ret;
+
+    if (real_mmap == NULL) {
+        real_mmap = dlsym(RTLD_NEXT, "mmap");
+    }
+    ret = real_mmap(addr, length, prot, flags, fd, offset);
+    if ((ret != MAP_FAILED) && (flags & MAP_ANONYMOUS)) {
+        report_region(ret, length);
+    }
+    return ret;
+}
+
+int munmap(void *addr, size_t length) {
+    if (real_munmap == NULL) {
+        real_munmap = dlsym(RTLD_NEXT, "munmap");
+    }
+    forget_region(addr, length);
+    return real_munmap(addr, length);
+}
+
+// glibc serves large requests with its internal mmap, which bypasses the interposed mmap above
+void *malloc(size_t size) {
+    void *ret = __libc_malloc(size);
+    report_region(ret, size);
+    return ret;
+}
+
+void *calloc(size_t n, size_t size) {
+    void *ret = __libc_calloc(n, size);
+    report_region(ret, n * size);
+    return ret;
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *ret;
+
+    if (ptr != NULL) {
+        forget_region(ptr, malloc_usable_size(ptr));
+    }
+    ret = __libc_realloc(ptr, size);
+    report_region(ret, size);
+    return ret;
+}
+
+void free(void *ptr) {
+    if (ptr != NULL) {
+        forget_region(ptr, malloc_usable_size(ptr));
+    }
+    __libc_free(ptr);
+}
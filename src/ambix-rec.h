@@ -0,0 +1,146 @@
+#ifndef _AMBIX_REC_H
+#define _AMBIX_REC_H
+
+// Placement recorder: ctl appends bandwidth samples, tier usage, FIND results and memcheck ticks to a memory-mapped
+// ring of fixed-size records, so recording costs a few stores and no syscalls. The oldest records are overwritten once
+// the ring is full. rec2csv exports a recording to CSV.
+
+#define REC_PATH "./ambix.rec"
+#define REC_ENV "AMBIX_REC" // path of the recording, "off" disables it
+#define REC_MAGIC 0x43455241 // "AREC"
+#define REC_VERSION 1
+#define REC_RECORDS 65536 // about 4 MB
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+enum rec_type {
+    REC_MEMDATA = 1, // system bandwidth sample used by memcheck
+    REC_USAGE, // tier usage at the start of a memcheck tick
+    REC_FIND, // FIND request and the migrations that followed
+    REC_TICK, // outcome of a memcheck tick
+};
+
+typedef struct rec_memdata {
+    float dram_reads, dram_writes, pmm_reads, pmm_writes; // MB/s
+    float pmm_app_bw, pmm_mem_bw; // MB/s
+    float mm_miss_rate;
+    float nvram_latency; // ns, 0 if not measured recently
+    float bound_share; // -1 if unknown
+} rec_memdata_t;
+
+typedef struct rec_usage {
+    float dram_usage, nvram_usage;
+    int64_t dram_sz, nvram_sz; // bytes
+    int32_t pressure;
+} rec_usage_t;
+
+typedef struct rec_find {
+    int32_t mode;
+    int32_t n_requested, n_found, n_migrated;
+    uint64_t node_mask;
+    int64_t elapsed_us;
+} rec_find_t;
+
+typedef struct rec_tick {
+    int32_t n_migrated;
+    int32_t active;
+    int32_t slept_us;
+    int32_t sleep_us; // interval until the next tick
+} rec_tick_t;
+
+typedef struct rec_entry {
+    uint64_t index; // index + 1 once the record is complete, 0 while it is written
+    uint64_t timestamp_ns; // CLOCK_REALTIME
+    int32_t type;
+    int32_t pad;
+    union {
+        rec_memdata_t memdata;
+        rec_usage_t usage;
+        rec_find_t find;
+        rec_tick_t tick;
+    } u;
+} rec_entry_t;
+
+typedef struct rec_log {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t n_records;
+    uint64_t n_written;
+    rec_entry_t records[REC_RECORDS];
+} rec_log_t;
+
+
+static inline int rec_valid(const rec_log_t *log) {
+    return (log != NULL) && (log->magic == REC_MAGIC) && (log->version == REC_VERSION)
+           && (log->record_size == sizeof(rec_entry_t)) && (log->n_records == REC_RECORDS);
+}
+
+// Maps a recording. The writer creates it (or keeps appending to a valid one), readers map it read-only.
+// Returns NULL on failure.
+static inline rec_log_t *rec_open(const char *path, int writer) {
+    int fd = open(path, writer ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    rec_log_t *log;
+
+    if (fd == -1) {
+        return NULL;
+    }
+    if (writer && (ftruncate(fd, sizeof(rec_log_t)) == -1)) {
+        close(fd);
+        return NULL;
+    }
+
+    log = (rec_log_t *) mmap(NULL, sizeof(rec_log_t), writer ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (writer && !rec_valid(log)) {
+        memset(log, 0, sizeof(rec_log_t));
+        log->version = REC_VERSION;
+        log->record_size = sizeof(rec_entry_t);
+        log->n_records = REC_RECORDS;
+        __atomic_store_n(&log->magic, REC_MAGIC, __ATOMIC_RELEASE);
+    }
+    return log;
+}
+
+static inline void rec_close(rec_log_t *log) {
+    munmap((void *) log, sizeof(rec_log_t));
+}
+
+// Fills in index and timestamp of e and copies it to the next slot. Safe with several writers.
+static inline void rec_append(rec_log_t *log, rec_entry_t *e) {
+    uint64_t index = __atomic_fetch_add(&log->n_written, 1, __ATOMIC_RELAXED);
+    rec_entry_t *slot = &log->records[index % REC_RECORDS];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    e->timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->index = 0;
+
+    __atomic_store_n(&slot->index, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot, e, sizeof(rec_entry_t));
+    __atomic_store_n(&slot->index, index + 1, __ATOMIC_RELEASE);
+}
+
+// Copies record index if it is still in the ring and complete. Returns 1 on success.
+static inline int rec_read(const rec_log_t *log, uint64_t index, rec_entry_t *e) {
+    const rec_entry_t *slot = &log->records[index % REC_RECORDS];
+
+    if (__atomic_load_n(&slot->index, __ATOMIC_ACQUIRE) != index + 1) {
+        return 0;
+    }
+    memcpy(e, slot, sizeof(rec_entry_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->index, __ATOMIC_RELAXED) == index + 1;
+}
+
+#endif
@@ -4,18 +4,34 @@
 
 // Intervals and limits:
 
-#define MEMCHECK_INTERVAL PCM_DELAY * 1000
-#define NVRAMWRCHK_INTERVAL PCM_DELAY * 1000
-#define CLEAR_DELAY 50
+#define MEMCHECK_INTERVAL PCM_PERIOD_MS // in ms, stretched to the pcm-memory sampling period if that is longer
+#define NVRAMWRCHK_INTERVAL PCM_PERIOD_MS
+#define CLEAR_DELAY 50 // initial NVRAM clear-to-switch observation window in ms, adapted at runtime:
+#define CLEAR_DELAY_MIN 5
+#define CLEAR_DELAY_MAX 200
+#define CLEAR_DENSITY_HIGH 0.5 // fraction of young NVRAM pages above which the window is cut to CLEAR_DELAY_MIN
 #define NVRAM_BW_THRESH 10
+#define NVRAM_LAT_SLO 600 // ns: NVRAM read latency above which promotions start regardless of bandwidth, 0 disables
+#define SOCKET_BW_SHARE 0.5 // promotions only walk NVRAM nodes of sockets with at least this share of the busiest socket's NVRAM bandwidth
 
 // BW info (for checking pcm output)
 #define DRAM_BW_MAX 50000
 #define NVRAM_BW_MAX 20000
 
+// Cost model (initial per-tier bandwidth estimates in MB/s, raised as higher values are measured by pcm)
+#define DRAM_RD_BW 40000
+#define DRAM_WR_BW 30000
+#define NVRAM_RD_BW 8000
+#define NVRAM_WR_BW 2500
+#define TLB_SHOOTDOWN_US 5 // estimated per-page remap/shootdown cost until migration throughput is measured
+#define COST_HORIZON_MS 4000 // time a promoted page is expected to stay hot
+#define COST_MARGIN 1.0 // expected benefit must exceed COST_MARGIN times the migration cost
+#define COST_EWMA_WEIGHT 0.25 // weight of the newest measurement in the moving averages
+
 // PID info
 #define MAX_PIDS 500 // sets the number of PIDs that can be bound to Ambix at any given time
 #define MAX_PID_N 2147483647 // set to INT_MAX. true max pid number is shown in /proc/sys/kernel/pid_max
+#define MAX_EXIT_EVENTS 16 // process exits handled per epoll_wait in ctl
 
 // Find-related constants:
 #define DRAM_MODE 0
@@ -50,6 +66,61 @@ static const int n_nvram_nodes = sizeof(NVRAM_NODES)/sizeof(NVRAM_NODES[0]);
 #define FIND_OP 0
 #define BIND_OP 1
 #define UNBIND_OP 2
+#define HINT_OP 3
+#define HEADROOM_OP 4
+#define FAIL_OP 5 // ctl -> module only: req_t (pid_n holds the number of ranges) followed by fail_range_t entries
+#define TRAFFIC_OP 6 // ctl -> module only: req_t (pid_n holds the number of entries) followed by traffic_t entries
+
+// Migration failure classes (move_pages per-page status):
+#define FAIL_BUSY 0 // EBUSY/EAGAIN: page under I/O or temporarily pinned
+#define FAIL_SHARED 1 // EACCES: mapped by other processes
+#define FAIL_UNMOVABLE 2 // any other error: zero page, unmapped, mlocked/special mappings
+#define FAIL_NOMEM 3 // ENOMEM: destination node full, not a property of the page
+#define N_FAIL_CLASSES 4
+#define FAIL_BACKOFF_BUSY_MS 2000 // time the module skips pages that failed with FAIL_BUSY
+#define FAIL_BACKOFF_MS 30000 // time the module skips pages that failed with FAIL_SHARED or FAIL_UNMOVABLE
+#define MAX_FAIL_RANGES 4096 // failure ranges kept by the module across all bound processes
+#define MAX_FAIL_PER_REQ ((MAX_PAYLOAD - sizeof(req_t)) / sizeof(fail_range_t))
+
+// Hint kinds (HINT_OP mode):
+#define HINT_HOT 0 // prioritized for DRAM, never demoted
+#define HINT_COLD 1 // prioritized for NVRAM, never promoted
+#define HINT_PIN_DRAM 2
+#define HINT_PIN_NVRAM 3
+#define HINT_CLEAR 4 // removes hints in the range
+#define MAX_HINTS 4096 // hint ranges kept by the module across all bound processes
+
+// Allocation-time placement (client library):
+#define ALLOC_PLACE_MIN_MB 64 // smaller allocations are left to first touch (glibc serves these sizes with their own mmap)
+#define ALLOC_NVRAM_MIN_MB 4096 // allocations at least this large are placed on NVRAM regardless of DRAM headroom
+#define HEADROOM_REFRESH_MS 100 // how long the client keeps using the headroom last reported by ctl
+#define TIER_ANY -1 // no call-site tier: decided by size class and headroom
+
+// Placement snapshot (ctl):
+#define SNAPSHOT_PATH "./ambix.snapshot"
+#define SNAPSHOT_ENV "AMBIX_SNAPSHOT" // overrides SNAPSHOT_PATH
+#define SNAPSHOT_INTERVAL 60 // seconds between snapshots
+#define SNAPSHOT_MAGIC 0x534d4241 // "AMBS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NAME_MAX 256
+#define SNAPSHOT_MAX_RANGES 65536 // DRAM ranges kept per process
+#define SNAPSHOT_QUERY_PAGES 4096 // pages per move_pages status query
+#define SNAPSHOT_SCAN_PAGES 262144 // pages a snapshot round queries per second (1 GB of address space with 4 KB pages)
+#define SNAPSHOT_RESTORE_TICKS 300 // restore steps (one per PCM_AGG_WINDOW_MS) during which a matched process keeps getting its hot ranges restored
+
+// Per-process memory traffic attribution (ctl, TRAFFIC_OP):
+#define TRAFFIC_SHARE_SCALE 1000 // traffic shares are in thousandths of the traffic of all bound processes
+#define TRAFFIC_SHARE_MIN 20 // added to every share in bandwidth-driven promotions, so quiet processes are not starved
+#define TRAFFIC_PERF_BYTES 64 // bytes of memory traffic per LLC miss counted by the perf_event fallback
+#define MAX_TRAFFIC_PER_REQ ((MAX_PAYLOAD - sizeof(req_t)) / sizeof(traffic_t))
+
+// Process priority classes (BIND): latency processes are promoted first and demoted last
+#define PRIO_BATCH 0
+#define PRIO_NORMAL 1
+#define PRIO_LATENCY 2
+#define N_PRIO_CLASSES 3
+#define DEFAULT_WEIGHT 10 // DRAM share weight relative to other processes of the same class
+#define MAX_WEIGHT 1000
 
 // Comm-related structures:
 typedef struct addr_info {
@@ -61,8 +132,30 @@ typedef struct req {
     int op_code;
     int pid_n; // Stores pid for BIND/UNBIND and the number of pages for FIND
     int mode;
+    int priority; // BIND only: one of the PRIO_* classes
+    int weight; // BIND only: DRAM share weight, 1 to MAX_WEIGHT
+    unsigned long addr; // HINT only: page-aligned start of the hinted range
+    unsigned long len; // HINT only: length of the hinted range in bytes
+    unsigned long node_mask; // FIND only: bit per node the candidates must reside on, 0 for any node of the tier
 } req_t;
 
+typedef struct fail_range {
+    unsigned long start;
+    unsigned long end; // exclusive
+    int pid;
+    int backoff_ms;
+} fail_range_t;
+
+typedef struct traffic {
+    int pid;
+    int share; // TRAFFIC_SHARE_SCALE is all the memory traffic of the bound processes, -1 if unknown
+} traffic_t;
+
+typedef struct headroom {
+    long long dram_free; // bytes DRAM can take before reaching DRAM_TARGET
+    long long nvram_free; // bytes NVRAM can take before reaching NVRAM_TARGET
+} headroom_t; // ctl reply to HEADROOM_OP
+
 //Client-ctl comms:
 #define PORT 8080
 #define SELECT_TIMEOUT 1
@@ -73,8 +166,13 @@ typedef struct req {
 #define DRAM_LIMIT 0.96
 #define NVRAM_TARGET 0.95
 #define NVRAM_LIMIT 0.98
-#define MAX_INTERVAL_MUL 1
-#define INTERVAL_INC_FACTOR 1.0
+#define MAX_INTERVAL_MUL 4 // idle memcheck ticks stretch the interval up to this multiple (pressure events still wake it)
+#define INTERVAL_INC_FACTOR 1.5
+
+// Memory pressure triggers:
+#define PSI_STALL_US 150000 // PSI trigger: tasks stalled on memory for this long...
+#define PSI_WINDOW_US 1000000 // ...within this window wake memcheck and demote down to DRAM_TARGET
+#define CGROUP_ENV "AMBIX_CGROUP" // cgroup v2 directory whose memory.events (high/max) is watched as well
 
 // Memory ranges: (64-bit systems only use 48-bit)
 #define IS_64BIT (sizeof(void*) == 8)
@@ -86,14 +184,14 @@ typedef struct req {
 
 #define BETWEEN(value, min, max) (value <= max && value >= min)
 
-int int_min(int val1, int val2) {
+static inline int int_min(int val1, int val2) {
     if (val1 > val2) {
         return val2;
     }
     return val1;
 }
 
-int contains(int value, int mode) {
+static inline int contains(int value, int mode) {
     const int *array;
     int size, i;
 
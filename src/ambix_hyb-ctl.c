@@ -1,13 +1,27 @@
 #include "ambix.h"
 #include "pcm-ambix.h"
+#include "ambix-policy.h"
+#include "ambix-rec.h"
+#ifdef AMBIX_PCM_EMBED
+#include "ambix-monitor.h"
+#endif
 
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <linux/netlink.h>
+#include <linux/perf_event.h>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
 
 #include <pthread.h>
+#include <dlfcn.h>
 
 #include <numaif.h>
 #include <numa.h>
@@ -20,8 +34,17 @@
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
 
 int netlink_fd;
+int lifecycle_fd = -1; // epoll set of the pidfds of bound processes
 
 long page_size; // in kB
 
@@ -33,19 +56,29 @@ int buf_size;
 
 addr_info_t *candidates;
 
+memdata_ring_t *memdata_ring = NULL;
+int pcm_embedded = 0; // memdata_ring is the private feed of the pcm-memory thread
+
 struct iovec iov_out, iov_in;
 struct msghdr msg_out, msg_in;
 
 volatile int exit_sig = 0;
 volatile int switch_act = 1;
 volatile int thresh_act = 1;
+volatile int cost_act = 1;
 
 // In microseconds
 int memcheck_interval = MEMCHECK_INTERVAL * 1000;
-int clear_interval = CLEAR_DELAY * 1000;
 
-pthread_t stdin_thread, socket_thread, memcheck_thread;
-pthread_mutex_t comm_lock, placement_lock;
+policy_t *policy = NULL; // loaded placement policy, swapped with policy_lock and placement_lock held
+void *policy_handle = NULL;
+char policy_path[PATH_MAX]; // file the loaded policy came from
+int policy_auto = 1; // policy follows the NVRAM configuration (no AMBIX_POLICY or "policy load")
+int pmm_mixed = 0; // App Direct + Memory Mode system
+float latency_slo = NVRAM_LAT_SLO; // ns, 0 disables the latency trigger
+
+pthread_t stdin_thread, socket_thread, memcheck_thread, lifecycle_thread, snapshot_thread;
+pthread_mutex_t comm_lock, placement_lock, node_mem_lock, procs_lock, snapshot_lock, policy_lock;
 
 
 
@@ -106,6 +139,403 @@ void configure_netlink_inbound() {
 
 
 
+/*
+-------------------------------------------------------------------------------
+
+NODE MEMORY SNAPSHOT
+
+-------------------------------------------------------------------------------
+*/
+
+
+typedef struct node_mem {
+    int fd; // node meminfo file kept open for pread, -1 falls back to libnuma
+    long long size;
+    long long free;
+    int socket; // package of the node's CPUs (of the closest node with CPUs for CPU-less NVRAM nodes), -1 if unknown
+} node_mem_t;
+
+node_mem_t *node_mem; // indexed by node id
+int n_node_mem;
+
+// Package id of the first CPU of the node, -1 for CPU-less nodes
+int node_cpu_socket(int node) {
+    char path[96];
+    struct bitmask *cpus = numa_allocate_cpumask();
+    int socket = -1;
+
+    if (numa_node_to_cpus(node, cpus) == 0) {
+        for (unsigned int cpu=0; cpu < cpus->size; cpu++) {
+            if (numa_bitmask_isbitset(cpus, cpu)) {
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+                socket = sysfs_read_ll(path);
+                break;
+            }
+        }
+    }
+    numa_free_cpumask(cpus);
+    return socket;
+}
+
+void node_socket_init() {
+    int *cpu_socket = malloc(sizeof(int) * n_node_mem);
+
+    for (int i=0; i < n_node_mem; i++) {
+        cpu_socket[i] = node_cpu_socket(i);
+    }
+    for (int i=0; i < n_node_mem; i++) {
+        int best = -1;
+        for (int j=0; (cpu_socket[i] == -1) && (j < n_node_mem); j++) {
+            if ((cpu_socket[j] != -1) && ((best == -1) || (numa_distance(i, j) < numa_distance(i, best)))) {
+                best = j;
+            }
+        }
+        node_mem[i].socket = (best != -1) ? cpu_socket[best] : cpu_socket[i];
+    }
+    free(cpu_socket);
+}
+
+int node_socket(int node) {
+    return ((node < 0) || (node >= n_node_mem)) ? -1 : node_mem[node].socket;
+}
+
+void node_mem_init() {
+    char path[64];
+
+    n_node_mem = numa_max_node() + 1;
+    node_mem = calloc(n_node_mem, sizeof(node_mem_t));
+
+    for (int i=0; i < n_node_mem; i++) {
+        node_mem[i].fd = -1;
+    }
+    node_socket_init();
+
+    for (int i=0; i < n_dram_nodes + n_nvram_nodes; i++) {
+        int node = (i < n_dram_nodes) ? DRAM_NODES[i] : NVRAM_NODES[i - n_dram_nodes];
+        if (node >= n_node_mem) {
+            fprintf(stderr, "Node %d is not available in this system.\n", node);
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/meminfo", node);
+        if ((node_mem[node].fd = open(path, O_RDONLY)) == -1) {
+            fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        }
+    }
+}
+
+void node_mem_close() {
+    for (int i=0; i < n_node_mem; i++) {
+        if (node_mem[i].fd != -1) {
+            close(node_mem[i].fd);
+        }
+    }
+    free(node_mem);
+}
+
+int read_node_meminfo(int fd, long long *sz, long long *fr) {
+    char buf[4096];
+    char *field;
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    if (((field = strstr(buf, "MemTotal:")) == NULL) || (sscanf(field, "MemTotal: %lld", sz) != 1)) {
+        return 0;
+    }
+    if (((field = strstr(buf, "MemFree:")) == NULL) || (sscanf(field, "MemFree: %lld", fr) != 1)) {
+        return 0;
+    }
+
+    // meminfo values are in kB
+    *sz *= 1024;
+    *fr *= 1024;
+    return 1;
+}
+
+// Reads every monitored node once. Placement decisions within a tick use this snapshot.
+void node_mem_refresh() {
+    pthread_mutex_lock(&node_mem_lock);
+    for (int i=0; i < n_dram_nodes + n_nvram_nodes; i++) {
+        int node = (i < n_dram_nodes) ? DRAM_NODES[i] : NVRAM_NODES[i - n_dram_nodes];
+        if (node >= n_node_mem) {
+            continue;
+        }
+        if ((node_mem[node].fd == -1) || !read_node_meminfo(node_mem[node].fd, &node_mem[node].size, &node_mem[node].free)) {
+            node_mem[node].size = numa_node_size64(node, &node_mem[node].free);
+        }
+    }
+    pthread_mutex_unlock(&node_mem_lock);
+}
+
+// Updates the snapshot with the outcome of a move_pages call (status holds destination node or -errno per page)
+void node_mem_account(int src_mode, int *status, int n) {
+    int src_node = -1;
+
+    // Source node is only known for certain when the source tier has a single node
+    if ((src_mode == DRAM_MODE) && (n_dram_nodes == 1)) {
+        src_node = DRAM_NODES[0];
+    }
+    else if ((src_mode == NVRAM_MODE) && (n_nvram_nodes == 1)) {
+        src_node = NVRAM_NODES[0];
+    }
+
+    pthread_mutex_lock(&node_mem_lock);
+    for (int i=0; i < n; i++) {
+        if ((status[i] < 0) || (status[i] >= n_node_mem) || (status[i] == src_node)) {
+            continue;
+        }
+        node_mem[status[i]].free -= page_size;
+        if (src_node != -1) {
+            node_mem[src_node].free += page_size;
+        }
+    }
+    pthread_mutex_unlock(&node_mem_lock);
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+BOUND PROCESSES
+
+-------------------------------------------------------------------------------
+*/
+
+
+typedef struct proc_info {
+    int pid;
+    int priority;
+    int weight;
+    int pidfd; // refers to the bound process itself, so it stays valid if the pid is reused. -1 without pidfd support
+    int home_node; // node the most threads of the process last ran on, -1 if unknown
+    float traffic_bw; // memory bandwidth attributed to the process in MB/s (moving average), -1 if unknown
+    long long traffic_us; // time of the last traffic sample, 0 before the first one
+    long long cpu_ns; // CPU time of the process at the last traffic sample
+    uint64_t llc_misses; // perf_fd count at the last traffic sample
+    int perf_fd; // LLC miss counter of the perf_event fallback, -1 until needed, -2 if it could not be opened
+} proc_info_t;
+
+proc_info_t bound_procs[MAX_PIDS];
+int n_bound = 0;
+
+const char *prio_names[N_PRIO_CLASSES] = {"batch", "normal", "latency"};
+
+// Caller must hold procs_lock
+proc_info_t *procs_find(int pid) {
+    for (int i=0; i < n_bound; i++) {
+        if (bound_procs[i].pid == pid) {
+            return &bound_procs[i];
+        }
+    }
+    return NULL;
+}
+
+// Opens a pidfd for pid and adds it to the lifecycle epoll set. Returns -1 if not supported.
+int pidfd_watch(int pid) {
+    struct epoll_event ev;
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (pidfd == -1) {
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN; // readable once the process exits
+    ev.data.fd = pidfd;
+    if ((lifecycle_fd != -1) && epoll_ctl(lifecycle_fd, EPOLL_CTL_ADD, pidfd, &ev)) {
+        fprintf(stderr, "Error watching pid=%d: %s\n", pid, strerror(errno));
+    }
+    return pidfd;
+}
+
+void procs_add(int pid, int priority, int weight) {
+    pthread_mutex_lock(&procs_lock);
+    proc_info_t *proc = procs_find(pid);
+    if ((proc == NULL) && (n_bound < MAX_PIDS)) {
+        proc = &bound_procs[n_bound++];
+        proc->pidfd = pidfd_watch(pid);
+        proc->home_node = -1;
+        proc->traffic_bw = -1;
+        proc->traffic_us = 0;
+        proc->perf_fd = -1;
+    }
+    if (proc != NULL) {
+        proc->pid = pid;
+        proc->priority = priority;
+        proc->weight = weight;
+    }
+    pthread_mutex_unlock(&procs_lock);
+}
+
+void procs_remove(int pid) {
+    pthread_mutex_lock(&procs_lock);
+    proc_info_t *proc = procs_find(pid);
+    if (proc != NULL) {
+        if (proc->pidfd != -1) {
+            close(proc->pidfd); // also removes it from the epoll set
+        }
+        if (proc->perf_fd >= 0) {
+            close(proc->perf_fd);
+        }
+        *proc = bound_procs[--n_bound];
+    }
+    pthread_mutex_unlock(&procs_lock);
+}
+
+// Pid of the bound process behind pidfd, 0 if it is no longer bound
+int procs_pid_of(int pidfd) {
+    int pid = 0;
+
+    pthread_mutex_lock(&procs_lock);
+    for (int i=0; i < n_bound; i++) {
+        if (bound_procs[i].pidfd == pidfd) {
+            pid = bound_procs[i].pid;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&procs_lock);
+    return pid;
+}
+
+// Returns 0 only if pid is bound and its process is known to have exited
+int procs_alive(int pid) {
+    int alive = 1;
+
+    pthread_mutex_lock(&procs_lock);
+    proc_info_t *proc = procs_find(pid);
+    if ((proc != NULL) && (proc->pidfd != -1)) {
+        alive = !syscall(SYS_pidfd_send_signal, proc->pidfd, 0, NULL, 0) || (errno != ESRCH);
+    }
+    pthread_mutex_unlock(&procs_lock);
+    return alive;
+}
+
+// Reads fields of a /proc stat file (numbered as in proc(5), in increasing order). Returns 0 on failure.
+int read_stat_fields(const char *path, const int *fields, long long *values, int n) {
+    char buf[1024];
+    char *p;
+    int fd, field, i = 0;
+    ssize_t len;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return 0;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    // The command name may contain spaces, fields are counted from the closing parenthesis (field 2)
+    if ((p = strrchr(buf, ')')) == NULL) {
+        return 0;
+    }
+    for (field = 2; (*p != '\0') && (i < n); p++) {
+        if ((*p == ' ') && (++field == fields[i])) {
+            values[i++] = atoll(p + 1);
+        }
+    }
+    return i == n;
+}
+
+// CPU a thread last ran on (field 39 of its stat file), -1 on failure
+int task_last_cpu(int pid, const char *tid) {
+    const int fields[] = {39};
+    long long cpu;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", pid, tid);
+    return read_stat_fields(path, fields, &cpu, 1) ? cpu : -1;
+}
+
+// Node most threads of pid last ran on, -1 if none could be read
+int sample_home_node(int pid) {
+    int n_nodes = numa_max_node() + 1;
+    int counts[n_nodes];
+    int home = -1;
+    char path[64];
+    struct dirent *entry;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if ((dir = opendir(path)) == NULL) {
+        return -1;
+    }
+    memset(counts, 0, sizeof(counts));
+
+    while ((entry = readdir(dir)) != NULL) {
+        int cpu, node;
+        if ((entry->d_name[0] == '.') || ((cpu = task_last_cpu(pid, entry->d_name)) < 0)) {
+            continue;
+        }
+        if (((node = numa_node_of_cpu(cpu)) >= 0) && (node < n_nodes)) {
+            counts[node]++;
+        }
+    }
+    closedir(dir);
+
+    for (int i=0; i < n_nodes; i++) {
+        if ((counts[i] > 0) && ((home == -1) || (counts[i] > counts[home]))) {
+            home = i;
+        }
+    }
+    return home;
+}
+
+// Updates the home node of every bound process. /proc is read without holding procs_lock.
+void procs_sample_cpus() {
+    int pids[MAX_PIDS];
+    int homes[MAX_PIDS];
+    int n;
+
+    pthread_mutex_lock(&procs_lock);
+    n = n_bound;
+    for (int i=0; i < n; i++) {
+        pids[i] = bound_procs[i].pid;
+    }
+    pthread_mutex_unlock(&procs_lock);
+
+    for (int i=0; i < n; i++) {
+        homes[i] = sample_home_node(pids[i]);
+    }
+
+    pthread_mutex_lock(&procs_lock);
+    for (int i=0; i < n; i++) {
+        proc_info_t *proc = procs_find(pids[i]);
+        if ((proc != NULL) && (homes[i] != -1)) {
+            proc->home_node = homes[i];
+        }
+    }
+    pthread_mutex_unlock(&procs_lock);
+}
+
+int procs_home_node(int pid) {
+    int home = -1;
+
+    pthread_mutex_lock(&procs_lock);
+    proc_info_t *proc = procs_find(pid);
+    if (proc != NULL) {
+        home = proc->home_node;
+    }
+    pthread_mutex_unlock(&procs_lock);
+    return home;
+}
+
+int parse_prio(const char *str) {
+    for (int i=0; i < N_PRIO_CLASSES; i++) {
+        if (!strcmp(str, prio_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+
 /*
 -------------------------------------------------------------------------------
 
@@ -117,42 +547,92 @@ HELPER FUNCTIONS
 int check_memdata(memdata_t *md) {
     if ((md == NULL) || !BETWEEN(md->sys_dramReads, 0, DRAM_BW_MAX) || !BETWEEN(md->sys_dramWrites, 0, DRAM_BW_MAX)
             || !BETWEEN(md->sys_pmmReads, 0, NVRAM_BW_MAX) || !BETWEEN(md->sys_pmmWrites, 0, NVRAM_BW_MAX)
-            || !BETWEEN(md->sys_pmmAppBW, 0, NVRAM_BW_MAX) || !BETWEEN(md->sys_pmmMemBW, 0, NVRAM_BW_MAX)) {
+            || !BETWEEN(md->sys_pmmAppBW, 0, NVRAM_BW_MAX) || !BETWEEN(md->sys_pmmMemBW, 0, NVRAM_BW_MAX)
+            || !BETWEEN(md->n_sockets, 0, PCM_MAX_SOCKETS) || !BETWEEN(md->n_cores, 0, PCM_MAX_CORES)) {
         return 0;
     }
 
     return 1;
 }
 
-memdata_t *read_memdata() {
-    memdata_t *md = malloc(sizeof(memdata_t));
+// Starts pcm-memory inside ctl (ctl-pcm builds) unless PCM_EMBED_ENV asks for a separate process. If the counters
+// cannot be programmed ctl falls back to the shared memory feed.
+void memdata_init() {
+#ifdef AMBIX_PCM_EMBED
+    const char *mode = getenv(PCM_EMBED_ENV);
 
-    FILE * in_file = fopen(PCM_FILE_NAME, "r");
-    if (in_file == NULL) {
-        fprintf(stderr, "Error opening memdata file.\n");
-        return md;
+    if ((mode != NULL) && !strcmp(mode, "external")) {
+        printf("Reading the memory feed of a separate pcm-memory.\n");
+        return;
     }
-    if (fread(md, sizeof(memdata_t), 1, in_file) != 1) {
-        fprintf(stderr, "Error reading memdata from file.\n");
+    if ((memdata_ring = ambix_monitor_start(PCM_PERIOD_MS)) == NULL) {
+        fprintf(stderr, "Could not start the embedded pcm-memory, waiting for a separate one.\n");
+        return;
     }
+    pcm_embedded = 1;
+#endif
+}
+
+void memdata_close() {
+#ifdef AMBIX_PCM_EMBED
+    if (pcm_embedded) {
+        ambix_monitor_stop();
+        memdata_ring = NULL;
+        pcm_embedded = 0;
+    }
+#endif
+}
 
-    fclose(in_file);
+// Copies the latest sample published by pcm-memory. Returns 1 on success.
+int read_memdata(memdata_t *md, uint64_t *timestamp_ns) {
+    memdata_sample_t sample;
+
+    // Only syscalls until pcm-memory has created the feed, afterwards reads are plain memory accesses
+    if ((memdata_ring == NULL) && ((memdata_ring = memdata_ring_open(0)) == NULL)) {
+        return 0;
+    }
+    if (!memdata_ring_latest(memdata_ring, &sample)) {
+        return 0;
+    }
 
-    return md;
+    *md = sample.md;
+    *timestamp_ns = sample.timestamp_ns;
+    return 1;
 }
 
-time_t get_memdata_mtime() {
-    struct stat st;
-    if (stat(PCM_FILE_NAME, &st) != -1) {
-        return st.st_mtime;
+// Worst NVRAM read latency among the sockets with NVRAM reads (ns). pcm measures latency once every
+// PCM_LATENCY_EVERY periods: older measurements, and sockets with too few reads for a meaningful latency, give 0.
+float memdata_nvram_latency(const memdata_t *md, uint64_t timestamp_ns) {
+    float worst = 0;
+
+    if ((md->latency_ns == 0) || (timestamp_ns - md->latency_ns > 2 * PCM_LATENCY_EVERY * md->elapsed_ns)) {
+        return 0;
     }
-    return 0;
+    for (uint32_t i=0; i < md->n_sockets; i++) {
+        if (md->socket[i].pmmReads >= NVRAM_BW_THRESH) {
+            worst = fmax(worst, md->latency[i].pmmRead);
+        }
+    }
+    return worst;
+}
+
+// Time-weighted average of the samples of the last window_ms, for estimates that should not follow short bursts
+int read_memdata_window(memdata_t *md, int window_ms) {
+    return memdata_ring_aggregate(memdata_ring, (uint64_t) window_ms * 1000000, md) > 0;
 }
 
 
 long long free_space_node(int node, long long *sz) {
     long long node_fr = 0;
-    *sz = numa_node_size64(node, &node_fr);
+
+    if (node >= n_node_mem) {
+        *sz = 0;
+        return 0;
+    }
+    pthread_mutex_lock(&node_mem_lock);
+    *sz = node_mem[node].size;
+    node_fr = fmax(node_mem[node].free, 0);
+    pthread_mutex_unlock(&node_mem_lock);
     return node_fr;
 }
 
@@ -201,205 +681,1616 @@ int free_space_tot_pages(int mode) {
     return free_space_tot_bytes(mode, &sz) / page_size;
 }
 
+// Bytes a tier can take before reaching its target occupancy
+long long tier_headroom(int mode) {
+    long long sz = 0;
+    long long fr = free_space_tot_bytes(mode, &sz);
+    double target = (mode == DRAM_MODE) ? DRAM_TARGET : NVRAM_TARGET;
+    return fmax(fr - (1.0 - target) * sz, 0);
+}
+
+long long get_time_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 
 
 /*
 -------------------------------------------------------------------------------
 
-MIGRATION FUNCTIONS
+RECORDER
 
 -------------------------------------------------------------------------------
 */
 
 
-int do_migration(int mode, int n_found) {
-    void **addr = malloc(sizeof(unsigned long) * n_found);
-    int *dest_nodes = malloc(sizeof(int) * n_found);
-    int *status = malloc(sizeof(int) * n_found);
+rec_log_t *rec_log = NULL; // NULL if recording is off or the recording could not be mapped
 
-    const int *node_list;
-    int n_nodes;
+void rec_init() {
+    const char *path = getenv(REC_ENV);
 
-    if (mode == DRAM_MODE) {
-        node_list = NVRAM_NODES;
-        n_nodes = n_nvram_nodes;
+    if (path == NULL) {
+        path = REC_PATH;
     }
-    else {
-        node_list = DRAM_NODES;
-        n_nodes = n_dram_nodes;
+    if (!strcmp(path, "off")) {
+        return;
     }
+    if ((rec_log = rec_open(path, 1)) == NULL) {
+        fprintf(stderr, "Could not map recording %s: %s\n", path, strerror(errno));
+    }
+}
 
-    for (int i=0; i< n_found; i++) {
-        status[i] = -123;
+void rec_fini() {
+    if (rec_log != NULL) {
+        msync(rec_log, sizeof(rec_log_t), MS_ASYNC);
+        rec_close(rec_log);
+        rec_log = NULL;
     }
+}
 
-    int n_processed = 0;
-    for (int i=0; (i < n_nodes) && (n_processed < n_found); i++) {
-        int curr_node = node_list[i];
+void rec_memdata(const policy_state_t *st) {
+    rec_entry_t e;
 
-        int n_avail_pages = free_space_pages(curr_node);
+    if (rec_log == NULL) {
+        return;
+    }
+    memset(&e, 0, sizeof(e));
+    e.type = REC_MEMDATA;
+    e.u.memdata.dram_reads = st->md.sys_dramReads;
+    e.u.memdata.dram_writes = st->md.sys_dramWrites;
+    e.u.memdata.pmm_reads = st->md.sys_pmmReads;
+    e.u.memdata.pmm_writes = st->md.sys_pmmWrites;
+    e.u.memdata.pmm_app_bw = st->md.sys_pmmAppBW;
+    e.u.memdata.pmm_mem_bw = st->md.sys_pmmMemBW;
+    e.u.memdata.mm_miss_rate = st->md.sys_mmMissRate;
+    e.u.memdata.nvram_latency = st->nvram_latency;
+    e.u.memdata.bound_share = st->bound_share;
+    rec_append(rec_log, &e);
+}
 
-        int j=0;
-        for (; (j < n_avail_pages) && (n_processed+j < n_found); j++) {
-            addr[n_processed+j] = (void *) candidates[n_processed+j].addr;
-            dest_nodes[n_processed+j] = curr_node;
-        }
+void rec_usage(const policy_state_t *st) {
+    rec_entry_t e;
 
-        n_processed += j;
+    if (rec_log == NULL) {
+        return;
     }
-    int n_migrated, i;
-    int e = 0; // counts failed migrations
-
-    for (n_migrated=0, i=0; n_migrated < n_processed; n_migrated+=i) {
-        int curr_pid;
-        curr_pid=candidates[n_migrated].pid_retval;
+    memset(&e, 0, sizeof(e));
+    e.type = REC_USAGE;
+    e.u.usage.dram_usage = st->dram_usage;
+    e.u.usage.nvram_usage = st->nvram_usage;
+    e.u.usage.dram_sz = st->dram_sz;
+    e.u.usage.nvram_sz = st->nvram_sz;
+    e.u.usage.pressure = st->pressure;
+    rec_append(rec_log, &e);
+}
 
-        for (i=1; (candidates[n_migrated+i].pid_retval == curr_pid) && (n_migrated+i < n_processed); i++);
+void rec_find(int mode, int n_requested, int n_found, int n_migrated, unsigned long node_mask, long long elapsed_us) {
+    rec_entry_t e;
 
-        void **addr_displacement = addr + n_migrated;
-        int *dest_nodes_displacement = dest_nodes + n_migrated;
-        if (move_pages(curr_pid, (unsigned long) i, addr_displacement, dest_nodes_displacement, status, 0)) {
-            // Migrate all and output addresses that could not migrate
-            for (int j=0; j < i; j++) {
-                if (move_pages(curr_pid, 1, addr_displacement + j, dest_nodes_displacement + j, status, 0)) {
-                    printf("Error migrating addr: %ld, pid: %d\n", (unsigned long) *(addr_displacement + j), curr_pid);
-                    e++;
-                }
-            }
-        }
+    if (rec_log == NULL) {
+        return;
     }
-
-    free(addr);
-    free(dest_nodes);
-    free(status);
-    return n_migrated - e;
+    memset(&e, 0, sizeof(e));
+    e.type = REC_FIND;
+    e.u.find.mode = mode;
+    e.u.find.n_requested = n_requested;
+    e.u.find.n_found = n_found;
+    e.u.find.n_migrated = n_migrated;
+    e.u.find.node_mask = node_mask;
+    e.u.find.elapsed_us = elapsed_us;
+    rec_append(rec_log, &e);
 }
 
-int do_switch(int n_found) {
-    void **addr_dram = malloc(sizeof(unsigned long) * n_found);
-    int *dest_nodes_dram = malloc(sizeof(int) * n_found);
-    void **addr_nvram = malloc(sizeof(unsigned long) * n_found);
-    int *dest_nodes_nvram = malloc(sizeof(int) * n_found);
-    int *status = malloc(sizeof(int) * n_found);
+void rec_tick(const policy_result_t *res, int active, int sleep_us) {
+    rec_entry_t e;
 
-    for (int i=0; i < n_found; i++) {
-        status[i] = -123;
+    if (rec_log == NULL) {
+        return;
     }
+    memset(&e, 0, sizeof(e));
+    e.type = REC_TICK;
+    e.u.tick.n_migrated = res->n_migrated;
+    e.u.tick.active = active;
+    e.u.tick.slept_us = res->slept_us;
+    e.u.tick.sleep_us = sleep_us;
+    rec_append(rec_log, &e);
+}
 
-    int dram_migrated = 0;
-    int nvram_migrated = 0;
-    int dram_e = 0; // counts failed migrations
-    int nvram_e = 0; // counts failed migrations
 
-    int dram_free = 1;
-    int nvram_free = 1;
 
-    while ((((dram_migrated + dram_e) < n_found) || ((nvram_migrated + nvram_e) < n_found)) && (dram_free || nvram_free)) {
-        // DRAM -> NVRAM
-        int old_n_processed = dram_migrated + dram_e;
-        int dram_processed = old_n_processed;
+/*
+-------------------------------------------------------------------------------
 
-        for (int i=0; (i < n_nvram_nodes) && (dram_processed < n_found); i++) {
-            int curr_node = NVRAM_NODES[i];
+PRESSURE EVENTS
 
-            long long node_fr = 0;
-            numa_node_size64(curr_node, &node_fr);
-            int n_avail_pages = node_fr / page_size;
+-------------------------------------------------------------------------------
+*/
 
-            int j=0;
-            for (; (j < n_avail_pages) && (j+dram_processed < n_found); j++) {
-                addr_dram[dram_processed+j] = (void *) candidates[n_found+1+j].addr;
-                dest_nodes_nvram[dram_processed+j] = curr_node;
-            }
 
-            dram_processed += j;
-        }
-        if (old_n_processed < dram_processed) {
-            // Send processed pages to NVRAM
-            int n_migrated, i;
-            dram_free = 1;
+int psi_fd = -1; // PSI trigger, POLLPRI when the stall threshold is crossed
+int cg_inotify_fd = -1; // watches memory.events of the cgroup given in CGROUP_ENV
+char cg_events_path[PATH_MAX];
+long cg_events = 0; // high + max events seen so far
 
-            for (n_migrated=0, i=0; n_migrated < dram_processed; n_migrated+=i) {
-                int curr_pid;
-                curr_pid = candidates[n_found+1+n_migrated].pid_retval;
+// Sum of the high and max counters of memory.events, -1 on failure
+long read_cg_events() {
+    char buf[512];
+    char *field;
+    long high = 0, max = 0;
+    int fd = open(cg_events_path, O_RDONLY);
+    ssize_t len;
 
-                for (i=1; (candidates[n_found+1+n_migrated+i].pid_retval == curr_pid) && (n_migrated+i < dram_processed); i++);
-                void **addr_displacement = addr_dram + n_migrated;
-                int *dest_nodes_displacement = dest_nodes_nvram + n_migrated;
-                if (numa_move_pages(curr_pid, (unsigned long) i, addr_displacement, dest_nodes_displacement, status, 0)) {
-                    // Migrate all and output addresses that could not migrate
-                    for (int j=0; j < i; j++) {
-                        if (numa_move_pages(curr_pid, 1, addr_displacement + j, dest_nodes_displacement + j, status, 0)) {
-                            printf("Error migrating DRAM/MEM addr: %ld, pid: %d\n", (unsigned long) *(addr_displacement + j), curr_pid);
-                            dram_e++;
-                        }
-                    }
-                }
-            }
-        }
-        else {
-            dram_free = 0;
-        }
+    if (fd == -1) {
+        return -1;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
 
-        dram_migrated = dram_processed - dram_e;
+    if ((field = strstr(buf, "\nhigh ")) != NULL) {
+        high = strtol(field + 6, NULL, 10);
+    }
+    if ((field = strstr(buf, "\nmax ")) != NULL) {
+        max = strtol(field + 5, NULL, 10);
+    }
+    return high + max;
+}
 
-        // NVRAM -> DRAM
+void pressure_init() {
+    char trigger[64];
+    const char *cgroup = getenv(CGROUP_ENV);
+
+    // Needs a kernel with PSI, otherwise memcheck keeps polling on its interval only
+    if ((psi_fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK)) == -1) {
+        fprintf(stderr, "PSI memory trigger not available: %s\n", strerror(errno));
+    }
+    else {
+        snprintf(trigger, sizeof(trigger), "some %d %d", PSI_STALL_US, PSI_WINDOW_US);
+        if (write(psi_fd, trigger, strlen(trigger) + 1) < 0) {
+            fprintf(stderr, "Error setting PSI memory trigger: %s\n", strerror(errno));
+            close(psi_fd);
+            psi_fd = -1;
+        }
+    }
+
+    if (cgroup == NULL) {
+        return;
+    }
+    snprintf(cg_events_path, sizeof(cg_events_path), "%s/memory.events", cgroup);
+    // memory.events generates a file modified event whenever one of its counters changes
+    if (((cg_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+            || (inotify_add_watch(cg_inotify_fd, cg_events_path, IN_MODIFY) == -1)) {
+        fprintf(stderr, "Error watching %s: %s\n", cg_events_path, strerror(errno));
+        if (cg_inotify_fd != -1) {
+            close(cg_inotify_fd);
+            cg_inotify_fd = -1;
+        }
+        return;
+    }
+    cg_events = read_cg_events();
+}
+
+void pressure_close() {
+    if (psi_fd != -1) {
+        close(psi_fd);
+    }
+    if (cg_inotify_fd != -1) {
+        close(cg_inotify_fd);
+    }
+}
+
+// Sleeps for up to timeout_us. Returns 1 if woken early by memory pressure.
+int pressure_wait(int timeout_us) {
+    struct pollfd fds[2];
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    int n_fds = 0;
+    int ret = 0;
+
+    if ((psi_fd == -1) && (cg_inotify_fd == -1)) {
+        usleep(timeout_us);
+        return 0;
+    }
+    if (psi_fd != -1) {
+        fds[n_fds].fd = psi_fd;
+        fds[n_fds++].events = POLLPRI;
+    }
+    if (cg_inotify_fd != -1) {
+        fds[n_fds].fd = cg_inotify_fd;
+        fds[n_fds++].events = POLLIN;
+    }
+
+    long long end_us = get_time_us() + timeout_us;
+    long long left_us = timeout_us;
+
+    while ((left_us > 0) && !ret) {
+        if (poll(fds, n_fds, (left_us + 999) / 1000) > 0) {
+            for (int i=0; i < n_fds; i++) {
+                if ((fds[i].fd == psi_fd) && (fds[i].revents & POLLPRI)) {
+                    ret = 1;
+                }
+                else if ((fds[i].fd == cg_inotify_fd) && (fds[i].revents & POLLIN)) {
+                    while (read(cg_inotify_fd, buf, sizeof(buf)) > 0);
+                    // Only new high/max events count, low and oom_kill changes are ignored
+                    long events = read_cg_events();
+                    if (events > cg_events) {
+                        ret = 1;
+                    }
+                    cg_events = events;
+                }
+                else if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                    // Trigger went away (e.g. the cgroup was removed): sleep out the remaining time
+                    usleep(fmax(end_us - get_time_us(), 0));
+                    return 0;
+                }
+            }
+        }
+        left_us = end_us - get_time_us();
+    }
+    return ret;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+COST MODEL
+
+-------------------------------------------------------------------------------
+*/
+
+
+typedef struct cost_model {
+    float rd_bw[2], wr_bw[2]; // per-tier bandwidth in MB/s (indexed by DRAM_MODE/NVRAM_MODE)
+    float pmm_rd, pmm_wr; // last measured NVRAM application traffic in MB/s
+    double page_mig_us; // measured time to migrate one page (copy + remap + TLB shootdown)
+    double hot_pages; // estimated number of NVRAM pages sharing the NVRAM traffic
+    long skipped_pages;
+    long skipped_batches;
+} cost_model_t;
+
+cost_model_t cost;
+
+// Benefit multiplier of each priority class, scaled further by the process weight
+const double prio_benefit[N_PRIO_CLASSES] = {0.5, 1.0, 2.0};
+
+void cost_init() {
+    double page_mb = page_size / 1000000.0;
+
+    cost.rd_bw[DRAM_MODE] = DRAM_RD_BW;
+    cost.wr_bw[DRAM_MODE] = DRAM_WR_BW;
+    cost.rd_bw[NVRAM_MODE] = NVRAM_RD_BW;
+    cost.wr_bw[NVRAM_MODE] = NVRAM_WR_BW;
+    cost.pmm_rd = 0;
+    cost.pmm_wr = 0;
+
+    // Until a migration is measured assume a page is read from NVRAM and written to DRAM (worst direction)
+    cost.page_mig_us = page_mb / NVRAM_RD_BW * 1000000 + page_mb / DRAM_WR_BW * 1000000 + TLB_SHOOTDOWN_US;
+    cost.hot_pages = 0;
+    cost.skipped_pages = 0;
+    cost.skipped_batches = 0;
+}
+
+void cost_update_memdata(memdata_t *md) {
+    // Peak observed bandwidth is the best available estimate of what each tier sustains
+    cost.rd_bw[DRAM_MODE] = fmax(cost.rd_bw[DRAM_MODE], md->sys_dramReads);
+    cost.wr_bw[DRAM_MODE] = fmax(cost.wr_bw[DRAM_MODE], md->sys_dramWrites);
+    cost.rd_bw[NVRAM_MODE] = fmax(cost.rd_bw[NVRAM_MODE], md->sys_pmmReads);
+    cost.wr_bw[NVRAM_MODE] = fmax(cost.wr_bw[NVRAM_MODE], md->sys_pmmWrites);
+
+    if (md->pmm_mixed) {
+        // Only App Direct traffic can be moved by migrations, split it by the measured read/write mix
+        float pmm_tot = md->sys_pmmReads + md->sys_pmmWrites;
+        float rd_ratio = (pmm_tot > 0) ? md->sys_pmmReads / pmm_tot : 0.5;
+        cost.pmm_rd = md->sys_pmmAppBW * rd_ratio;
+        cost.pmm_wr = md->sys_pmmAppBW * (1 - rd_ratio);
+    }
+    else {
+        cost.pmm_rd = md->sys_pmmReads;
+        cost.pmm_wr = md->sys_pmmWrites;
+    }
+}
+
+void cost_update_migration(int n_migrated, long long elapsed_us) {
+    if (n_migrated <= 0) {
+        return;
+    }
+    double sample = 1.0 * elapsed_us / n_migrated;
+    cost.page_mig_us = COST_EWMA_WEIGHT * sample + (1 - COST_EWMA_WEIGHT) * cost.page_mig_us;
+}
+
+// Returns 1 if promoting the n_found NVRAM candidates (and demoting as many DRAM pages in SWITCH_MODE) pays off
+int cost_batch_profitable(int mode, int n_found, int n_requested) {
+    // The module returns fewer pages than requested only when it ran out of young pages,
+    // so a short batch is an exact count of the hot set and a full one is a lower bound
+    if (n_found < n_requested) {
+        cost.hot_pages = COST_EWMA_WEIGHT * n_found + (1 - COST_EWMA_WEIGHT) * cost.hot_pages;
+    }
+    else {
+        cost.hot_pages = fmax(cost.hot_pages, n_found);
+    }
+
+    double share = fmin(1.0, n_found / fmax(cost.hot_pages, 1.0));
+
+    // Pages of latency-critical and heavily weighted processes are worth more
+    double importance = 0;
+    pthread_mutex_lock(&procs_lock);
+    for (int i=0, run; i < n_found; i += run) {
+        int pid = candidates[i].pid_retval;
+        for (run=1; (i+run < n_found) && (candidates[i+run].pid_retval == pid); run++);
+
+        proc_info_t *proc = procs_find(pid);
+        if (proc != NULL) {
+            importance += run * prio_benefit[proc->priority] * proc->weight / DEFAULT_WEIGHT;
+        }
+        else {
+            importance += run;
+        }
+    }
+    pthread_mutex_unlock(&procs_lock);
+    importance /= n_found;
+    double horizon_s = COST_HORIZON_MS / 1000.0;
+
+    // Time spent serving the batch's share of NVRAM traffic on NVRAM instead of DRAM (in us)
+    double rd_mb = cost.pmm_rd * share * horizon_s;
+    double wr_mb = cost.pmm_wr * share * horizon_s;
+    double benefit_us = rd_mb * (1.0 / cost.rd_bw[NVRAM_MODE] - 1.0 / cost.rd_bw[DRAM_MODE]) * 1000000
+                        + wr_mb * (1.0 / cost.wr_bw[NVRAM_MODE] - 1.0 / cost.wr_bw[DRAM_MODE]) * 1000000;
+    benefit_us *= importance;
+
+    int n_moved = (mode == SWITCH_MODE) ? n_found * 2 : n_found;
+    double cost_us = n_moved * cost.page_mig_us;
+
+    if (benefit_us < COST_MARGIN * cost_us) {
+        cost.skipped_pages += n_moved;
+        cost.skipped_batches++;
+        printf("COST: Skipped batch of %d pages (benefit: %.2fms, cost: %.2fms).\n", n_moved, benefit_us / 1000, cost_us / 1000);
+        return 0;
+    }
+    return 1;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+MIGRATION FAILURES
+
+-------------------------------------------------------------------------------
+*/
+
+
+// Failed pages collected during one send_find (caller holds placement_lock), sent to the module afterwards
+fail_range_t fail_ranges[MAX_FAIL_PER_REQ];
+int n_fail_ranges = 0;
+
+long fail_counts[N_FAIL_CLASSES];
+const char *fail_names[N_FAIL_CLASSES] = {"busy", "shared", "unmovable", "no memory"};
+const int fail_backoff_ms[N_FAIL_CLASSES] = {FAIL_BACKOFF_BUSY_MS, FAIL_BACKOFF_MS, FAIL_BACKOFF_MS, 0};
+
+int fail_class(int err) {
+    switch (err) {
+        case EBUSY:
+        case EAGAIN:
+            return FAIL_BUSY;
+        case EACCES:
+            return FAIL_SHARED;
+        case ENOMEM:
+            return FAIL_NOMEM;
+        default:
+            return FAIL_UNMOVABLE;
+    }
+}
+
+// Adds a failed page to the current ranges, merging it with the previous one when contiguous
+void fail_record(int pid, unsigned long addr, int class) {
+    fail_range_t *last = (n_fail_ranges > 0) ? &fail_ranges[n_fail_ranges - 1] : NULL;
+
+    fail_counts[class]++;
+    if (fail_backoff_ms[class] == 0) {
+        return;
+    }
+    if ((last != NULL) && (last->pid == pid) && (last->end == addr) && (last->backoff_ms == fail_backoff_ms[class])) {
+        last->end += page_size;
+        return;
+    }
+    // Once full, later failures are reported when they happen again
+    if (n_fail_ranges == MAX_FAIL_PER_REQ) {
+        return;
+    }
+    fail_ranges[n_fail_ranges].pid = pid;
+    fail_ranges[n_fail_ranges].start = addr;
+    fail_ranges[n_fail_ranges].end = addr + page_size;
+    fail_ranges[n_fail_ranges++].backoff_ms = fail_backoff_ms[class];
+}
+
+// Moves n pages of pid in a single call and records the pages that failed. Returns the number of pages migrated.
+int move_batch(int pid, int src_mode, void **addr, int *dest_nodes, int *status, int n) {
+    int n_migrated = 0;
+
+    // A process that exited since FIND may already have its pid reused by an unrelated process
+    if (!procs_alive(pid)) {
+        return 0;
+    }
+    if (numa_move_pages(pid, (unsigned long) n, addr, dest_nodes, status, 0) < 0) {
+        // The call itself failed (e.g. the process exited): nothing was moved and there is nothing to blacklist
+        fail_counts[fail_class(errno)] += n;
+        return 0;
+    }
+
+    for (int i=0; i < n; i++) {
+        if (status[i] == dest_nodes[i]) {
+            n_migrated++;
+        }
+        else if (status[i] < 0) {
+            fail_record(pid, (unsigned long) addr[i], fail_class(-status[i]));
+        }
+    }
+    node_mem_account(src_mode, status, n);
+    return n_migrated;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+MIGRATION FUNCTIONS
+
+-------------------------------------------------------------------------------
+*/
+
+
+// Assigns destination nodes of dest_mode to cands[from, n), choosing for each page the node of the tier closest to
+// its process's home node that still has room. Returns the index of the first candidate left without a destination.
+int assign_dest(addr_info_t *cands, void **addr, int *dest_nodes, int from, int n, int dest_mode) {
+    const int *node_list = (dest_mode == DRAM_MODE) ? DRAM_NODES : NVRAM_NODES;
+    int n_nodes = (dest_mode == DRAM_MODE) ? n_dram_nodes : n_nvram_nodes;
+    int avail[n_nodes];
+    int curr_pid = -1;
+    int home = -1;
+    int i;
+
+    for (i=0; i < n_nodes; i++) {
+        avail[i] = free_space_pages(node_list[i]);
+    }
+
+    for (i=from; i < n; i++) {
+        int best = -1;
+
+        // Candidates are grouped by pid
+        if (cands[i].pid_retval != curr_pid) {
+            curr_pid = cands[i].pid_retval;
+            home = procs_home_node(curr_pid);
+        }
+        for (int k=0; k < n_nodes; k++) {
+            if ((avail[k] > 0) && ((best == -1)
+                    || ((home != -1) && (numa_distance(home, node_list[k]) < numa_distance(home, node_list[best]))))) {
+                best = k;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        avail[best]--;
+        addr[i] = (void *) cands[i].addr;
+        dest_nodes[i] = node_list[best];
+    }
+    return i;
+}
+
+int do_migration(int mode, int n_found) {
+    void **addr = malloc(sizeof(unsigned long) * n_found);
+    int *dest_nodes = malloc(sizeof(int) * n_found);
+    int *status = malloc(sizeof(int) * n_found);
+
+    for (int i=0; i< n_found; i++) {
+        status[i] = -123;
+    }
+
+    int n_processed = assign_dest(candidates, addr, dest_nodes, 0, n_found, (mode == DRAM_MODE) ? NVRAM_MODE : DRAM_MODE);
+    int n_migrated, i;
+    int e = 0; // counts failed migrations
+
+    for (n_migrated=0, i=0; n_migrated < n_processed; n_migrated+=i) {
+        int curr_pid;
+        curr_pid=candidates[n_migrated].pid_retval;
+
+        for (i=1; (candidates[n_migrated+i].pid_retval == curr_pid) && (n_migrated+i < n_processed); i++);
+
+        void **addr_displacement = addr + n_migrated;
+        int *dest_nodes_displacement = dest_nodes + n_migrated;
+        e += i - move_batch(curr_pid, mode, addr_displacement, dest_nodes_displacement, status, i);
+    }
+
+    free(addr);
+    free(dest_nodes);
+    free(status);
+    return n_migrated - e;
+}
+
+int do_switch(int n_found) {
+    void **addr_dram = malloc(sizeof(unsigned long) * n_found);
+    int *dest_nodes_dram = malloc(sizeof(int) * n_found);
+    void **addr_nvram = malloc(sizeof(unsigned long) * n_found);
+    int *dest_nodes_nvram = malloc(sizeof(int) * n_found);
+    int *status = malloc(sizeof(int) * n_found);
+
+    for (int i=0; i < n_found; i++) {
+        status[i] = -123;
+    }
+
+    int dram_migrated = 0;
+    int nvram_migrated = 0;
+    int dram_e = 0; // counts failed migrations
+    int nvram_e = 0; // counts failed migrations
+
+    int dram_free = 1;
+    int nvram_free = 1;
+
+    while ((((dram_migrated + dram_e) < n_found) || ((nvram_migrated + nvram_e) < n_found)) && (dram_free || nvram_free)) {
+        // DRAM -> NVRAM
+        int old_n_processed = dram_migrated + dram_e;
+        // DRAM candidates follow the NVRAM ones and the separator entry
+        int dram_processed = assign_dest(candidates + n_found + 1, addr_dram, dest_nodes_nvram, old_n_processed, n_found, NVRAM_MODE);
+        if (old_n_processed < dram_processed) {
+            // Send the pages processed in this round to NVRAM
+            int n_migrated, i;
+            dram_free = 1;
+
+            for (n_migrated=old_n_processed, i=0; n_migrated < dram_processed; n_migrated+=i) {
+                int curr_pid;
+                curr_pid = candidates[n_found+1+n_migrated].pid_retval;
+
+                for (i=1; (n_migrated+i < dram_processed) && (candidates[n_found+1+n_migrated+i].pid_retval == curr_pid); i++);
+                void **addr_displacement = addr_dram + n_migrated;
+                int *dest_nodes_displacement = dest_nodes_nvram + n_migrated;
+                dram_e += i - move_batch(curr_pid, DRAM_MODE, addr_displacement, dest_nodes_displacement, status, i);
+            }
+        }
+        else {
+            dram_free = 0;
+        }
+
+        dram_migrated = dram_processed - dram_e;
+
+        // NVRAM -> DRAM
         old_n_processed = nvram_migrated + nvram_e;
-        int nvram_processed = old_n_processed;
+        int nvram_processed = assign_dest(candidates, addr_nvram, dest_nodes_dram, old_n_processed, n_found, DRAM_MODE);
 
-        for (int i=0; (i < n_dram_nodes) && (nvram_processed < n_found); i++) {
-            int curr_node = DRAM_NODES[i];
+        if (old_n_processed < nvram_processed) {
+            // Send the pages processed in this round to DRAM
+            int n_migrated, i;
+            nvram_free = 1;
+
+            for (n_migrated=old_n_processed, i=0; n_migrated < nvram_processed; n_migrated+=i) {
+                int curr_pid;
+                curr_pid=candidates[n_migrated].pid_retval;
+
+                for (i=1; (n_migrated+i < nvram_processed) && (candidates[n_migrated+i].pid_retval == curr_pid); i++);
+                void **addr_displacement = addr_nvram + n_migrated;
+                int *dest_nodes_displacement = dest_nodes_dram + n_migrated;
+                nvram_e += i - move_batch(curr_pid, NVRAM_MODE, addr_displacement, dest_nodes_displacement, status, i);
+            }
+        }
+        else {
+            nvram_free = 0;
+        }
+
+        nvram_migrated = nvram_processed - nvram_e;
+    }
+
+    free(addr_dram);
+    free(addr_nvram);
+    free(dest_nodes_dram);
+    free(dest_nodes_nvram);
+    free(status);
+
+    return dram_migrated + nvram_migrated;
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+REQUEST PROCESSING FUNCTIONS
+
+-------------------------------------------------------------------------------
+*/
+
+
+// Sends a request (payload_len bytes, at most MAX_PAYLOAD) to the module and copies the reply entries to *out
+int send_payload(const void *payload, size_t payload_len, addr_info_t **out) {
+
+    pthread_mutex_lock(&comm_lock);
+
+    memset(NLMSG_DATA(nlmh_out), 0, MAX_PAYLOAD);
+    memcpy(NLMSG_DATA(nlmh_out), payload, payload_len);
+    sendmsg(netlink_fd, &msg_out, 0);
+
+    //configure_netlink_inbound();
+    memset(buffer, 0, buf_size);
+    int len = recvmsg(netlink_fd, &msg_in, 0);
+
+    addr_info_t *curr_pointer = *out;
+    int i = 0;
+    struct nlmsghdr * curr_nlmh;
+    for (curr_nlmh = (struct nlmsghdr *) buffer; NLMSG_OK(curr_nlmh, len); curr_nlmh = NLMSG_NEXT(curr_nlmh, len)) {
+        if (curr_nlmh->nlmsg_type == NLMSG_ERROR) {
+            pthread_mutex_unlock(&comm_lock);
+            return 0;
+        }
+        int payload_len = NLMSG_PAYLOAD(curr_nlmh, 0);
+        memcpy(curr_pointer, (addr_info_t *) NLMSG_DATA(curr_nlmh), payload_len);
+        curr_pointer += payload_len/sizeof(addr_info_t);
+        i++;
+
+    }
+    pthread_mutex_unlock(&comm_lock);
+    return 1;
+}
+
+int send_req(req_t req, addr_info_t **out) {
+    return send_payload(&req, sizeof(req), out);
+}
+
+// Reports the ranges collected by fail_record so the module skips them for their backoff period
+int send_fail() {
+    char payload[MAX_PAYLOAD];
+    req_t req;
+    addr_info_t *op_retval;
+    int ret;
+
+    if (n_fail_ranges == 0) {
+        return 1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.op_code = FAIL_OP;
+    req.pid_n = n_fail_ranges;
+    memcpy(payload, &req, sizeof(req));
+    memcpy(payload + sizeof(req), fail_ranges, sizeof(fail_range_t) * n_fail_ranges);
+    n_fail_ranges = 0;
+
+    op_retval = malloc(sizeof(addr_info_t));
+    send_payload(payload, sizeof(req) + sizeof(fail_range_t) * req.pid_n, &op_retval);
+    ret = (op_retval->pid_retval == 0);
+    free(op_retval);
+    return ret;
+}
+
+// Reports the traffic share of the bound processes, used by the module to split bandwidth-driven promotions
+int send_traffic(const traffic_t *shares, int n) {
+    char payload[MAX_PAYLOAD];
+    req_t req;
+    addr_info_t *op_retval;
+    int ret;
+
+    if (n == 0) {
+        return 1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.op_code = TRAFFIC_OP;
+    req.pid_n = int_min(n, MAX_TRAFFIC_PER_REQ);
+    memcpy(payload, &req, sizeof(req));
+    memcpy(payload + sizeof(req), shares, sizeof(traffic_t) * req.pid_n);
+
+    op_retval = malloc(sizeof(addr_info_t));
+    send_payload(payload, sizeof(req) + sizeof(traffic_t) * req.pid_n, &op_retval);
+    ret = (op_retval->pid_retval == 0);
+    free(op_retval);
+    return ret;
+}
+
+int send_bind(int pid, int priority, int weight) {
+    req_t req;
+    addr_info_t *op_retval = malloc(sizeof(addr_info_t));
+
+    if ((priority < 0) || (priority >= N_PRIO_CLASSES)) {
+        priority = PRIO_NORMAL;
+    }
+    if ((weight <= 0) || (weight > MAX_WEIGHT)) {
+        weight = DEFAULT_WEIGHT;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.op_code = BIND_OP;
+    req.pid_n = pid;
+    req.priority = priority;
+    req.weight = weight;
+
+    send_req(req, &op_retval);
+    if (op_retval->pid_retval == 0) {
+        procs_add(pid, priority, weight);
+        free(op_retval);
+        return 1;
+    }
+    free(op_retval);
+    return 0;
+}
+
+int send_unbind(int pid) {
+    req_t req;
+    addr_info_t *op_retval = malloc(sizeof(addr_info_t));
+
+    memset(&req, 0, sizeof(req));
+    req.op_code = UNBIND_OP;
+    req.pid_n = pid;
+
+    send_req(req, &op_retval);
+    procs_remove(pid);
+    if (op_retval->pid_retval == 0) {
+        free(op_retval);
+        return 1;
+    }
+    free(op_retval);
+    return 0;
+}
+
+// Clears the young bits of NVRAM pages. Reports how many were young (accessed since the previous clear) out of those scanned.
+int send_clear(unsigned long *young, unsigned long *scanned) {
+    req_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.op_code = FIND_OP;
+    req.mode = NVRAM_CLEAR;
+
+    *young = 0;
+    *scanned = 0;
+    send_req(req, &candidates);
+    if (candidates[2].pid_retval != 0) {
+        return 0;
+    }
+    *young = candidates[0].addr;
+    *scanned = candidates[1].addr;
+    return 1;
+}
+
+int send_hint(int pid, int kind, unsigned long addr, unsigned long len) {
+    req_t req;
+    addr_info_t *op_retval = malloc(sizeof(addr_info_t));
+
+    memset(&req, 0, sizeof(req));
+    req.op_code = HINT_OP;
+    req.pid_n = pid;
+    req.mode = kind;
+    req.addr = addr;
+    req.len = len;
+
+    send_req(req, &op_retval);
+    if (op_retval->pid_retval == 0) {
+        free(op_retval);
+        return 1;
+    }
+    free(op_retval);
+    return 0;
+}
+
+// Asks the module for candidates and migrates them, returns migrated pages. n_found_out gets the candidates kept.
+// node_mask restricts the walk to the nodes whose bit is set (0 for every node of the tier)
+int find_migrate(int n_pages, int mode, unsigned long node_mask, int *n_found_out) {
+    req_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.op_code = FIND_OP;
+    req.pid_n = n_pages;
+    req.mode = mode;
+    req.node_mask = node_mask;
+
+    send_req(req, &candidates);
+
+    int n_found=-1;
+
+    while (candidates[++n_found].pid_retval > 0);
+    *n_found_out = n_found;
+
+    if (n_found == 0) {
+        return 0;
+    }
+
+    if ((policy != NULL) && (policy->on_candidates != NULL)) {
+        int n_kept = int_min(policy->on_candidates(mode, candidates, n_found), n_found);
+        if (n_kept <= 0) {
+            return 0;
+        }
+        if ((mode == SWITCH_MODE) && (n_kept < n_found)) {
+            // Keep the separator and the first n_kept DRAM candidates right after the kept NVRAM ones
+            memmove(candidates + n_kept, candidates + n_found, sizeof(addr_info_t) * (n_kept + 1));
+        }
+        n_found = n_kept;
+        *n_found_out = n_found;
+    }
+
+    // Capacity-driven modes must migrate regardless, only bandwidth-driven promotions are scored
+    if (cost_act && ((mode == NVRAM_INTENSIVE_MODE) || (mode == SWITCH_MODE))
+            && !cost_batch_profitable(mode, n_found, n_pages)) {
+        return 0;
+    }
+
+    int n_migrated = 0;
+    long long start_us = get_time_us();
+
+    switch (mode) {
+        case DRAM_MODE:
+            n_migrated = do_migration(DRAM_MODE, n_found);
+            break;
+        case NVRAM_MODE:
+        case NVRAM_INTENSIVE_MODE:
+        case NVRAM_WRITE_MODE:
+            n_migrated = do_migration(NVRAM_MODE, n_found);
+            break;
+        case SWITCH_MODE:
+            n_migrated = do_switch(n_found);
+            break;
+    }
+
+    cost_update_migration(n_migrated, get_time_us() - start_us);
+    send_fail();
+    return n_migrated;
+}
+
+int send_find_nodes(int n_pages, int mode, unsigned long node_mask) {
+    long long start_us = get_time_us();
+    int n_found = 0;
+    int n_migrated = find_migrate(n_pages, mode, node_mask, &n_found);
+
+    rec_find(mode, n_pages, n_found, n_migrated, node_mask, get_time_us() - start_us);
+    return n_migrated;
+}
+
+int send_find(int n_pages, int mode) {
+    return send_find_nodes(n_pages, mode, 0);
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+PROCESS TRAFFIC
+
+-------------------------------------------------------------------------------
+*/
+
+
+// Memory traffic attributed to each bound process, so that bandwidth-driven promotions go to the processes that
+// generate it. With RDT MBM pcm publishes the bandwidth of every core, which is split among the processes by the CPU
+// time they spent on it. Without it each process counts its LLC misses with a perf event.
+
+float bound_traffic_share = -1; // fraction of the system memory traffic generated by bound processes, -1 if unknown
+
+// CPU time of pid in ns (utime + stime of all its threads), -1 on failure
+long long proc_cpu_ns(int pid) {
+    const int fields[] = {14, 15};
+    long long ticks[2];
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (!read_stat_fields(path, fields, ticks, 2)) {
+        return -1;
+    }
+    return (ticks[0] + ticks[1]) * (1000000000LL / sysconf(_SC_CLK_TCK));
+}
+
+// Counts the LLC misses of pid and of the threads and children it creates afterwards (threads that already existed
+// when the counter is opened are not counted). Returns -1 on failure.
+int perf_open_llc(int pid) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Bandwidth (MB/s) of the cores pid ran on, weighted by the fraction of the interval it ran there. The CPU time is
+// split evenly among the threads, each one counted on the CPU it last ran on.
+float mbm_proc_bw(int pid, const memdata_t *md, long long cpu_ns, long long elapsed_ns) {
+    int cpu_threads[PCM_MAX_CORES];
+    int n_cores = (md->n_cores < PCM_MAX_CORES) ? md->n_cores : PCM_MAX_CORES;
+    int n_threads = 0;
+    float bw = 0;
+    char path[64];
+    struct dirent *entry;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if ((dir = opendir(path)) == NULL) {
+        return -1;
+    }
+    memset(cpu_threads, 0, sizeof(int) * n_cores);
+
+    while ((entry = readdir(dir)) != NULL) {
+        int cpu;
+        if ((entry->d_name[0] == '.') || ((cpu = task_last_cpu(pid, entry->d_name)) < 0)) {
+            continue;
+        }
+        n_threads++;
+        if (cpu < n_cores) {
+            cpu_threads[cpu]++;
+        }
+    }
+    closedir(dir);
+
+    for (int cpu=0; (n_threads > 0) && (cpu < n_cores); cpu++) {
+        if (cpu_threads[cpu] > 0) {
+            bw += md->core_mbw[cpu] * fmin(1.0 * cpu_ns * cpu_threads[cpu] / n_threads / elapsed_ns, 1);
+        }
+    }
+    return bw;
+}
+
+// Samples the traffic of one process (a copy of its proc_info_t, updated in place)
+void sample_proc_traffic(proc_info_t *proc, const memdata_t *md, long long now_us) {
+    long long elapsed_us = now_us - proc->traffic_us;
+    float bw = -1;
+
+    if (md->n_cores > 0) {
+        long long cpu_ns = proc_cpu_ns(proc->pid);
+        if (cpu_ns < 0) {
+            return;
+        }
+        if ((proc->traffic_us > 0) && (elapsed_us > 0)) {
+            bw = mbm_proc_bw(proc->pid, md, cpu_ns - proc->cpu_ns, elapsed_us * 1000);
+        }
+        proc->cpu_ns = cpu_ns;
+    }
+    else {
+        uint64_t misses;
+        if (proc->perf_fd == -1) {
+            if ((proc->perf_fd = perf_open_llc(proc->pid)) < 0) {
+                fprintf(stderr, "Could not count LLC misses of pid=%d: %s\n", proc->pid, strerror(errno));
+                proc->perf_fd = -2;
+            }
+            proc->traffic_us = 0;
+        }
+        if ((proc->perf_fd < 0) || (read(proc->perf_fd, &misses, sizeof(misses)) != sizeof(misses))) {
+            return;
+        }
+        if ((proc->traffic_us > 0) && (elapsed_us > 0)) {
+            bw = 1.0 * (misses - proc->llc_misses) * TRAFFIC_PERF_BYTES / elapsed_us; // bytes/us = MB/s
+        }
+        proc->llc_misses = misses;
+    }
+
+    if (bw >= 0) {
+        proc->traffic_bw = (proc->traffic_bw < 0) ? bw : COST_EWMA_WEIGHT * bw + (1 - COST_EWMA_WEIGHT) * proc->traffic_bw;
+    }
+    proc->traffic_us = now_us;
+}
+
+// Attributes the traffic of the md sample to the bound processes and sends their shares to the module.
+// /proc is read without holding procs_lock.
+void procs_sample_traffic(const memdata_t *md) {
+    proc_info_t procs[MAX_PIDS];
+    traffic_t shares[MAX_PIDS];
+    int opened[MAX_PIDS]; // perf counter opened by this sample
+    float sys_bw = md->sys_dramReads + md->sys_dramWrites + md->sys_pmmReads + md->sys_pmmWrites;
+    float bound_bw = 0;
+    long long now_us = get_time_us();
+    int n, n_known = 0, n_shares = 0;
+
+    pthread_mutex_lock(&procs_lock);
+    n = n_bound;
+    memcpy(procs, bound_procs, sizeof(proc_info_t) * n);
+    pthread_mutex_unlock(&procs_lock);
+
+    for (int i=0; i < n; i++) {
+        int perf_fd = procs[i].perf_fd;
+        sample_proc_traffic(&procs[i], md, now_us);
+        opened[i] = (procs[i].perf_fd != perf_fd);
+    }
+
+    pthread_mutex_lock(&procs_lock);
+    for (int i=0; i < n; i++) {
+        proc_info_t *proc = procs_find(procs[i].pid);
+        if (proc == NULL) {
+            // Unbound meanwhile: a counter opened here is not known to procs_remove
+            if (opened[i] && (procs[i].perf_fd >= 0)) {
+                close(procs[i].perf_fd);
+            }
+            procs[i].traffic_bw = -1;
+            continue;
+        }
+        proc->traffic_bw = procs[i].traffic_bw;
+        proc->traffic_us = procs[i].traffic_us;
+        proc->cpu_ns = procs[i].cpu_ns;
+        proc->llc_misses = procs[i].llc_misses;
+        proc->perf_fd = procs[i].perf_fd;
+    }
+    pthread_mutex_unlock(&procs_lock);
+
+    for (int i=0; i < n; i++) {
+        if (procs[i].traffic_bw >= 0) {
+            bound_bw += procs[i].traffic_bw;
+            n_known++;
+        }
+    }
+    for (int i=0; (bound_bw > 0) && (i < n); i++) {
+        if (procs[i].traffic_bw >= 0) {
+            shares[n_shares].pid = procs[i].pid;
+            shares[n_shares++].share = round(procs[i].traffic_bw / bound_bw * TRAFFIC_SHARE_SCALE);
+        }
+    }
+
+    bound_traffic_share = ((n_known == 0) || (sys_bw <= 0)) ? -1 : fmin(bound_bw / sys_bw, 1);
+    send_traffic(shares, n_shares);
+}
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+PLACEMENT SNAPSHOT
+
+-------------------------------------------------------------------------------
+*/
+
+
+typedef struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t n_procs;
+} snap_header_t;
+
+// Followed by n_ranges snap_range_t in the file
+typedef struct snap_proc {
+    int32_t pid;
+    uint32_t n_ranges;
+    char exe[SNAPSHOT_NAME_MAX];
+    char cgroup[SNAPSHOT_NAME_MAX];
+} snap_proc_t;
+
+// DRAM-resident range, relative to its mapping so that it survives a different address space layout in a new run
+typedef struct snap_range {
+    uint32_t vma_hash; // hash of the mapping's path (empty for anonymous memory)
+    uint32_t vma_ord; // position among the mappings with the same hash
+    uint64_t offset;
+    uint64_t len;
+} snap_range_t;
+
+typedef struct vma_info {
+    unsigned long start;
+    unsigned long end;
+    uint32_t hash;
+    uint32_t ord;
+} vma_info_t;
+
+typedef struct snap_entry {
+    snap_proc_t proc;
+    snap_range_t *ranges;
+} snap_entry_t;
+
+// Process being scanned by the snapshot round in progress
+typedef struct snap_scan {
+    snap_entry_t e;
+    uint32_t max_ranges;
+    unsigned long addr; // next address to query
+    int done;
+} snap_scan_t;
+
+typedef struct snap_restore {
+    int pid;
+    int entry; // index in snap_entries
+    int ticks_left;
+    uint32_t range; // range the next tick resumes at
+    uint64_t offset; // bytes of that range already handled
+    int clean; // every page of that range handled so far is in DRAM
+    char *done; // per range, set once all its pages are in DRAM
+    uint32_t n_done;
+} snap_restore_t;
+
+char snapshot_path[PATH_MAX];
+snap_entry_t *snap_entries = NULL; // read once at startup
+int n_snap_entries = 0;
+snap_restore_t snap_restores[MAX_PIDS]; // pending restores, guarded by snapshot_lock
+int n_snap_restores = 0;
+// Snapshot thread only (and the exit path once it is joined):
+snap_scan_t snap_scans[MAX_PIDS]; // round in progress
+int n_snap_scans = 0;
+int snap_scanning = 0;
+snap_entry_t snap_taken[MAX_PIDS]; // last complete round, written out by snapshot_write
+int n_snap_taken = 0;
+
+uint32_t name_hash(const char *str) {
+    uint32_t h = 2166136261u; // FNV-1a
+
+    for (; *str != '\0'; str++) {
+        h ^= (unsigned char) *str;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int vma_cmp(const void *a, const void *b) {
+    const vma_info_t *va = a, *vb = b;
+
+    if (va->hash != vb->hash) {
+        return (va->hash < vb->hash) ? -1 : 1;
+    }
+    if (va->ord != vb->ord) {
+        return (va->ord < vb->ord) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Writable mappings of pid sorted by (hash, ord). Returns their number, -1 on failure (*out must be freed otherwise).
+int read_vmas(int pid, vma_info_t **out) {
+    char path[64];
+    char line[PATH_MAX + 128];
+    int n = 0, max = 64;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    *out = malloc(sizeof(vma_info_t) * max);
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long start, end;
+        char perms[5];
+        int name_pos = 0;
+
+        if ((sscanf(line, "%lx-%lx %4s %*s %*s %*s %n", &start, &end, perms, &name_pos) < 3) || (perms[1] != 'w')) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        if (n == max) {
+            max *= 2;
+            *out = realloc(*out, sizeof(vma_info_t) * max);
+        }
+        (*out)[n].start = start;
+        (*out)[n].end = end;
+        (*out)[n].hash = name_hash(line + name_pos);
+        (*out)[n++].ord = 0;
+    }
+    fclose(f);
+
+    // Mappings are listed in address order, so a stable sort by hash keeps that order within each hash
+    for (int i=0; i < n; i++) {
+        (*out)[i].ord = i;
+    }
+    qsort(*out, n, sizeof(vma_info_t), vma_cmp);
+    for (int i=0; i < n; i++) {
+        (*out)[i].ord = ((i > 0) && ((*out)[i].hash == (*out)[i-1].hash)) ? (*out)[i-1].ord + 1 : 0;
+    }
+    return n;
+}
+
+// Executable and cgroup (v2 path, or the first hierarchy listed) of pid. Returns 1 on success.
+int read_proc_identity(int pid, char *exe, char *cgroup) {
+    char path[64];
+    char line[SNAPSHOT_NAME_MAX + 16];
+    ssize_t len;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    if ((len = readlink(path, exe, SNAPSHOT_NAME_MAX - 1)) <= 0) {
+        return 0;
+    }
+    exe[len] = '\0';
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    cgroup[0] = '\0';
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((cgroup[0] == '\0') || !strncmp(line, "0::", 3)) {
+            strncpy(cgroup, line, SNAPSHOT_NAME_MAX - 1);
+            cgroup[SNAPSHOT_NAME_MAX - 1] = '\0';
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+int vma_addr_cmp(const void *a, const void *b) {
+    const vma_info_t *va = a, *vb = b;
+
+    return (va->start < vb->start) ? -1 : (va->start > vb->start);
+}
+
+// Queries the location of up to budget pages of sc's process, from where the previous call stopped, and adds the
+// DRAM-resident ones to its ranges. Sets sc->done once the address space is covered. Returns the pages queried.
+int collect_hot_ranges(snap_scan_t *sc, int budget) {
+    void *pages[SNAPSHOT_QUERY_PAGES];
+    int status[SNAPSHOT_QUERY_PAGES];
+    snap_proc_t *proc = &sc->e.proc;
+    vma_info_t *vmas;
+    int n_vmas, queried = 0;
+
+    if ((n_vmas = read_vmas(proc->pid, &vmas)) < 0) {
+        proc->n_ranges = 0; // exited, nothing worth keeping
+        sc->done = 1;
+        return 0;
+    }
+    // Address order, so that the cursor stays valid when mappings come and go between calls
+    qsort(vmas, n_vmas, sizeof(vma_info_t), vma_addr_cmp);
+
+    for (int v=0; (v < n_vmas) && (queried < budget) && (proc->n_ranges < SNAPSHOT_MAX_RANGES); v++) {
+        if (vmas[v].end <= sc->addr) {
+            continue;
+        }
+        if (sc->addr < vmas[v].start) {
+            sc->addr = vmas[v].start;
+        }
+
+        while ((sc->addr < vmas[v].end) && (queried < budget) && (proc->n_ranges < SNAPSHOT_MAX_RANGES)) {
+            int cnt = fmin(fmin(SNAPSHOT_QUERY_PAGES, (vmas[v].end - sc->addr) / page_size), budget - queried);
+
+            for (int j=0; j < cnt; j++) {
+                pages[j] = (void *) (sc->addr + j * page_size);
+            }
+            sc->addr += cnt * page_size;
+            queried += cnt;
+            // Without target nodes move_pages only reports where each page is
+            if (numa_move_pages(proc->pid, cnt, pages, NULL, status, 0) < 0) {
+                continue;
+            }
+            for (int j=0; (j < cnt) && (proc->n_ranges < SNAPSHOT_MAX_RANGES); j++) {
+                uint64_t offset = (unsigned long) pages[j] - vmas[v].start;
+                snap_range_t *last = (proc->n_ranges > 0) ? &sc->e.ranges[proc->n_ranges - 1] : NULL;
+
+                if ((status[j] < 0) || !contains(status[j], DRAM_MODE)) {
+                    continue;
+                }
+                if ((last != NULL) && (last->vma_hash == vmas[v].hash) && (last->vma_ord == vmas[v].ord)
+                        && (last->offset + last->len == offset)) {
+                    last->len += page_size;
+                    continue;
+                }
+                if (proc->n_ranges == sc->max_ranges) {
+                    sc->max_ranges *= 2;
+                    sc->e.ranges = realloc(sc->e.ranges, sizeof(snap_range_t) * sc->max_ranges);
+                }
+                last = &sc->e.ranges[proc->n_ranges++];
+                last->vma_hash = vmas[v].hash;
+                last->vma_ord = vmas[v].ord;
+                last->offset = offset;
+                last->len = page_size;
+            }
+        }
+    }
+    if ((queried < budget) || (proc->n_ranges >= SNAPSHOT_MAX_RANGES)) {
+        sc->done = 1;
+    }
+    free(vmas);
+    return queried;
+}
+
+// Starts a snapshot round over the processes bound right now
+void snapshot_round_start() {
+    int pids[MAX_PIDS];
+    int n;
+
+    pthread_mutex_lock(&procs_lock);
+    n = n_bound;
+    for (int i=0; i < n; i++) {
+        pids[i] = bound_procs[i].pid;
+    }
+    pthread_mutex_unlock(&procs_lock);
+
+    n_snap_scans = 0;
+    for (int i=0; i < n; i++) {
+        snap_scan_t *sc = &snap_scans[n_snap_scans];
+
+        memset(sc, 0, sizeof(*sc));
+        if (!read_proc_identity(pids[i], sc->e.proc.exe, sc->e.proc.cgroup)) {
+            continue;
+        }
+        sc->e.proc.pid = pids[i];
+        sc->max_ranges = 64;
+        sc->e.ranges = malloc(sizeof(snap_range_t) * sc->max_ranges);
+        n_snap_scans++;
+    }
+    snap_scanning = 1;
+}
+
+// Spends up to budget page queries on the round in progress. Once it is complete its ranges replace the ones of the
+// previous round and 1 is returned.
+int snapshot_round_step(int budget) {
+    int used = 0;
+
+    for (int i=0; (i < n_snap_scans) && (used < budget); i++) {
+        if (!snap_scans[i].done) {
+            used += collect_hot_ranges(&snap_scans[i], budget - used);
+        }
+    }
+    for (int i=0; i < n_snap_scans; i++) {
+        if (!snap_scans[i].done) {
+            return 0;
+        }
+    }
+
+    for (int i=0; i < n_snap_taken; i++) {
+        free(snap_taken[i].ranges);
+    }
+    n_snap_taken = 0;
+    for (int i=0; i < n_snap_scans; i++) {
+        if (snap_scans[i].e.proc.n_ranges > 0) {
+            snap_taken[n_snap_taken++] = snap_scans[i].e;
+        }
+        else {
+            free(snap_scans[i].e.ranges);
+        }
+    }
+    n_snap_scans = 0;
+    snap_scanning = 0;
+    return 1;
+}
+
+// Writes the ranges of the last complete snapshot round to a temporary file renamed over the snapshot. Loaded entries
+// of programs that are not part of that round are carried over. Returns 1 on success.
+int snapshot_write() {
+    char tmp_path[PATH_MAX + 8];
+    snap_header_t hdr = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, (uint32_t) page_size, 0};
+    FILE *f;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+    if ((f = fopen(tmp_path, "w")) == NULL) {
+        fprintf(stderr, "Error creating %s: %s\n", tmp_path, strerror(errno));
+        return 0;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    for (int i=0; i < n_snap_taken; i++) {
+        fwrite(&snap_taken[i].proc, sizeof(snap_proc_t), 1, f);
+        fwrite(snap_taken[i].ranges, sizeof(snap_range_t), snap_taken[i].proc.n_ranges, f);
+        hdr.n_procs++;
+    }
+
+    for (int i=0; i < n_snap_entries; i++) {
+        int taken = 0;
+        for (int j=0; (j < n_snap_taken) && !taken; j++) {
+            taken = !strcmp(snap_entries[i].proc.exe, snap_taken[j].proc.exe)
+                    && !strcmp(snap_entries[i].proc.cgroup, snap_taken[j].proc.cgroup);
+        }
+        if (!taken) {
+            fwrite(&snap_entries[i].proc, sizeof(snap_proc_t), 1, f);
+            fwrite(snap_entries[i].ranges, sizeof(snap_range_t), snap_entries[i].proc.n_ranges, f);
+            hdr.n_procs++;
+        }
+    }
+
+    rewind(f);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "Error writing %s.\n", tmp_path);
+        unlink(tmp_path);
+        return 0;
+    }
+    if (rename(tmp_path, snapshot_path)) {
+        fprintf(stderr, "Error replacing %s: %s\n", snapshot_path, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+void snapshot_load() {
+    snap_header_t hdr;
+    FILE *f;
+
+    if ((f = fopen(snapshot_path, "r")) == NULL) {
+        return;
+    }
+    if ((fread(&hdr, sizeof(hdr), 1, f) != 1) || (hdr.magic != SNAPSHOT_MAGIC) || (hdr.version != SNAPSHOT_VERSION)
+            || (hdr.page_size != page_size)) {
+        fprintf(stderr, "Ignoring incompatible snapshot %s.\n", snapshot_path);
+        fclose(f);
+        return;
+    }
+
+    snap_entries = calloc(hdr.n_procs, sizeof(snap_entry_t));
+    for (n_snap_entries = 0; n_snap_entries < (int) hdr.n_procs; n_snap_entries++) {
+        snap_entry_t *e = &snap_entries[n_snap_entries];
+
+        if ((fread(&e->proc, sizeof(snap_proc_t), 1, f) != 1) || (e->proc.n_ranges > SNAPSHOT_MAX_RANGES)) {
+            break;
+        }
+        e->proc.exe[SNAPSHOT_NAME_MAX - 1] = '\0';
+        e->proc.cgroup[SNAPSHOT_NAME_MAX - 1] = '\0';
+        e->ranges = malloc(sizeof(snap_range_t) * (e->proc.n_ranges + 1));
+        if (fread(e->ranges, sizeof(snap_range_t), e->proc.n_ranges, f) != e->proc.n_ranges) {
+            free(e->ranges);
+            break;
+        }
+    }
+    fclose(f);
+    printf("Loaded placement snapshot of %d processes.\n", n_snap_entries);
+}
+
+// Queues a restore of the snapshot entry matching pid. Same pid and identity (ctl restart) is preferred over
+// identity only (new run of the same program).
+void snapshot_match(int pid) {
+    char exe[SNAPSHOT_NAME_MAX];
+    char cgroup[SNAPSHOT_NAME_MAX];
+    int match = -1;
+
+    if ((n_snap_entries == 0) || !read_proc_identity(pid, exe, cgroup)) {
+        return;
+    }
+    for (int i=0; i < n_snap_entries; i++) {
+        if (strcmp(snap_entries[i].proc.exe, exe) || strcmp(snap_entries[i].proc.cgroup, cgroup)) {
+            continue;
+        }
+        if ((match == -1) || (snap_entries[i].proc.pid == pid)) {
+            match = i;
+        }
+    }
+    if (match == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    for (int i=0; i < n_snap_restores; i++) {
+        if (snap_restores[i].pid == pid) {
+            pthread_mutex_unlock(&snapshot_lock);
+            return;
+        }
+    }
+    if (n_snap_restores < MAX_PIDS) {
+        snap_restore_t *r = &snap_restores[n_snap_restores++];
+
+        memset(r, 0, sizeof(*r));
+        r->pid = pid;
+        r->entry = match;
+        r->ticks_left = SNAPSHOT_RESTORE_TICKS;
+        r->clean = 1;
+        r->done = calloc(snap_entries[match].proc.n_ranges + 1, 1);
+        printf("SNAPSHOT: Restoring hot ranges of pid=%d.\n", pid);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+}
 
-            long long node_fr = 0;
-            numa_node_size64(curr_node, &node_fr);
-            int n_avail_pages = node_fr / page_size;
+void snapshot_init() {
+    const char *path = getenv(SNAPSHOT_ENV);
 
-            int j=0;
-            for (; (j < n_avail_pages) && (j+nvram_processed < n_found); j++) {
-                addr_nvram[nvram_processed+j] = (void *) candidates[nvram_processed+j].addr;
-                dest_nodes_dram[nvram_processed+j] = curr_node;
-            }
+    strncpy(snapshot_path, (path != NULL) ? path : SNAPSHOT_PATH, sizeof(snapshot_path) - 1);
+    snapshot_load();
 
-            nvram_processed += j;
+    // Processes that outlived a ctl restart keep their pid
+    for (int i=0; i < n_snap_entries; i++) {
+        if (kill(snap_entries[i].proc.pid, 0) == 0) {
+            snapshot_match(snap_entries[i].proc.pid);
         }
+    }
+}
 
-        if (old_n_processed < nvram_processed) {
-            // Send processed pages to DRAM
-            int n_migrated, i;
-            nvram_free = 1;
+// Moves up to budget NVRAM pages of the ranges of r that are not done yet back to DRAM, resuming where the previous
+// call stopped. A range is done once all its pages are found in DRAM, pages that are not present yet keep it pending
+// for a later pass. Returns the number of pages moved, or -1 if the process is gone.
+int restore_proc(snap_restore_t *r, snap_entry_t *e, int budget) {
+    void **pages = malloc(sizeof(void *) * SNAPSHOT_QUERY_PAGES);
+    void **addr = malloc(sizeof(void *) * SNAPSHOT_QUERY_PAGES);
+    int *dest_nodes = malloc(sizeof(int) * SNAPSHOT_QUERY_PAGES);
+    int *status = malloc(sizeof(int) * SNAPSHOT_QUERY_PAGES);
+    addr_info_t *cands = malloc(sizeof(addr_info_t) * SNAPSHOT_QUERY_PAGES);
+    vma_info_t *vmas;
+    int n_vmas, moved = 0, full = 0;
+    int pid = r->pid;
+
+    if ((n_vmas = read_vmas(pid, &vmas)) < 0) {
+        moved = -1;
+        goto out;
+    }
 
-            for (n_migrated=0, i=0; n_migrated < nvram_processed; n_migrated+=i) {
-                int curr_pid;
-                curr_pid=candidates[n_migrated].pid_retval;
+    // At most one pass over the pending ranges per call
+    while ((r->range < e->proc.n_ranges) && (moved < budget) && !full) {
+        uint32_t i = r->range;
+        vma_info_t key = {.hash = e->ranges[i].vma_hash, .ord = e->ranges[i].vma_ord};
+        vma_info_t *vma = r->done[i] ? NULL : bsearch(&key, vmas, n_vmas, sizeof(vma_info_t), vma_cmp);
+        unsigned long start = 0, end = 0, a = 0;
+
+        if (vma != NULL) {
+            start = vma->start + e->ranges[i].offset;
+            end = fmin(start + e->ranges[i].len, vma->end);
+            a = start + r->offset;
+        }
+        else if (!r->done[i]) {
+            r->clean = 0; // not mapped (yet) in this run
+        }
 
-                for (i=1; (candidates[n_migrated+i].pid_retval == curr_pid) && (n_migrated+i < nvram_processed); i++);
-                void **addr_displacement = addr_nvram + n_migrated;
-                int *dest_nodes_displacement = dest_nodes_dram + n_migrated;
-                if (numa_move_pages(curr_pid, (unsigned long) i, addr_displacement, dest_nodes_displacement, status, 0)) {
-                    // Migrate all and output addresses that could not migrate
-                    for (int j=0; j < i; j++) {
-                        if (numa_move_pages(curr_pid, 1, addr_displacement + j, dest_nodes_displacement + j, status, 0)) {
-                            printf("Error migrating NVRAM addr: %ld, pid: %d\n", (unsigned long) *(addr_displacement + j), curr_pid);
-                            nvram_e++;
-                        }
-                    }
+        while ((a < end) && (moved < budget) && !full) {
+            int cnt = fmin(fmin(SNAPSHOT_QUERY_PAGES, (end - a) / page_size), budget - moved);
+            int n_sel = 0;
+
+            for (int j=0; j < cnt; j++) {
+                pages[j] = (void *) (a + j * page_size);
+            }
+            a += cnt * page_size;
+            r->offset = a - start;
+            if (numa_move_pages(pid, cnt, pages, NULL, status, 0) < 0) {
+                r->clean = 0;
+                continue;
+            }
+            // Only pages that are present and on NVRAM are moved, untouched pages are left to first touch
+            for (int j=0; j < cnt; j++) {
+                if (status[j] < 0) {
+                    r->clean = 0;
+                }
+                else if (contains(status[j], NVRAM_MODE)) {
+                    cands[n_sel].addr = (unsigned long) pages[j];
+                    cands[n_sel++].pid_retval = pid;
                 }
             }
-        }
-        else {
-            nvram_free = 0;
+            if (n_sel == 0) {
+                continue;
+            }
+            int n_assigned = assign_dest(cands, addr, dest_nodes, 0, n_sel, DRAM_MODE);
+            int n_moved = (n_assigned > 0) ? move_batch(pid, NVRAM_MODE, addr, dest_nodes, status, n_assigned) : 0;
+            full = (n_assigned < n_sel);
+            moved += n_moved;
+            if (n_moved < n_sel) {
+                r->clean = 0;
+            }
         }
 
-        nvram_migrated = nvram_processed - nvram_e;
+        if (a >= end) {
+            if (!r->done[i] && r->clean) {
+                r->done[i] = 1;
+                r->n_done++;
+            }
+            r->range++;
+            r->offset = 0;
+            r->clean = 1;
+        }
     }
+    if (r->range >= e->proc.n_ranges) {
+        r->range = 0; // the next call starts another pass over the ranges still pending
+    }
+    free(vmas);
 
-    free(addr_dram);
-    free(addr_nvram);
-    free(dest_nodes_dram);
-    free(dest_nodes_nvram);
+out:
+    free(pages);
+    free(addr);
+    free(dest_nodes);
     free(status);
+    free(cands);
+    return moved;
+}
 
-    return dram_migrated + nvram_migrated;
+// Advances pending restores by up to budget pages. Caller holds placement_lock.
+int snapshot_restore_tick(int budget) {
+    int moved = 0;
+
+    pthread_mutex_lock(&snapshot_lock);
+    for (int i = n_snap_restores - 1; i >= 0; i--) {
+        snap_restore_t *r = &snap_restores[i];
+        int ret = (moved < budget) ? restore_proc(r, &snap_entries[r->entry], budget - moved) : 0;
+
+        if (ret > 0) {
+            moved += ret;
+        }
+        if ((ret >= 0) && (r->n_done == snap_entries[r->entry].proc.n_ranges)) {
+            printf("SNAPSHOT: Hot ranges of pid=%d restored.\n", r->pid);
+        }
+        if ((ret < 0) || (r->n_done == snap_entries[r->entry].proc.n_ranges) || (--r->ticks_left <= 0)) {
+            free(r->done);
+            *r = snap_restores[--n_snap_restores];
+        }
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+
+    send_fail();
+    return moved;
 }
 
 
@@ -407,104 +2298,126 @@ int do_switch(int n_found) {
 /*
 -------------------------------------------------------------------------------
 
-REQUEST PROCESSING FUNCTIONS
+PLACEMENT POLICY
 
 -------------------------------------------------------------------------------
 */
 
 
-int send_req(req_t req, addr_info_t **out) {
-
-    pthread_mutex_lock(&comm_lock);
+int policy_find(int n_pages, int mode) {
+    pthread_mutex_lock(&placement_lock);
+    int n_migrated = send_find(n_pages, mode);
+    pthread_mutex_unlock(&placement_lock);
+    return n_migrated;
+}
 
-    memset(NLMSG_DATA(nlmh_out), 0, MAX_PAYLOAD);
-    memcpy(NLMSG_DATA(nlmh_out), &req, sizeof(req));
-    sendmsg(netlink_fd, &msg_out, 0);
+int policy_find_nodes(int n_pages, int mode, unsigned long node_mask) {
+    pthread_mutex_lock(&placement_lock);
+    int n_migrated = send_find_nodes(n_pages, mode, node_mask);
+    pthread_mutex_unlock(&placement_lock);
+    return n_migrated;
+}
 
-    //configure_netlink_inbound();
-    memset(buffer, 0, buf_size);
-    int len = recvmsg(netlink_fd, &msg_in, 0);
+int policy_clear(unsigned long *young, unsigned long *scanned) {
+    pthread_mutex_lock(&placement_lock);
+    int ret = send_clear(young, scanned);
+    pthread_mutex_unlock(&placement_lock);
+    return ret;
+}
 
-    addr_info_t *curr_pointer = *out;
-    int i = 0;
-    struct nlmsghdr * curr_nlmh;
-    for (curr_nlmh = (struct nlmsghdr *) buffer; NLMSG_OK(curr_nlmh, len); curr_nlmh = NLMSG_NEXT(curr_nlmh, len)) {
-        if (curr_nlmh->nlmsg_type == NLMSG_ERROR) {
-            pthread_mutex_unlock(&comm_lock);
-            return 0;
-        }
-        int payload_len = NLMSG_PAYLOAD(curr_nlmh, 0);
-        memcpy(curr_pointer, (addr_info_t *) NLMSG_DATA(curr_nlmh), payload_len);
-        curr_pointer += payload_len/sizeof(addr_info_t);
-        i++;
+void policy_refresh(policy_state_t *st) {
+    st->dram_usage = free_space_tot_per(DRAM_MODE, &st->dram_sz);
+    st->nvram_usage = free_space_tot_per(NVRAM_MODE, &st->nvram_sz);
+}
 
+const policy_api_t policy_api = {
+    .find = policy_find,
+    .find_nodes = policy_find_nodes,
+    .clear = policy_clear,
+    .refresh = policy_refresh,
+    .time_us = get_time_us,
+    .node_socket = node_socket,
+};
+
+// Must be called with policy_lock and placement_lock held (or before the placement threads start)
+void policy_unload() {
+    if (policy == NULL) {
+        return;
     }
-    pthread_mutex_unlock(&comm_lock);
-    return 1;
+    if (policy->fini != NULL) {
+        policy->fini();
+    }
+    printf("Unloaded placement policy %s.\n", policy->name);
+    policy = NULL;
+    dlclose(policy_handle);
+    policy_handle = NULL;
 }
 
-int send_bind(int pid) {
-    req_t req;
-    addr_info_t *op_retval = malloc(sizeof(addr_info_t));
+// Must be called with policy_lock and placement_lock held (or before the placement threads start).
+// On failure the current policy is kept.
+int policy_load(const char *path) {
+    void *handle;
+    policy_t *new_policy;
 
-    req.op_code = BIND_OP;
-    req.pid_n = pid;
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        fprintf(stderr, "Could not load placement policy: %s\n", dlerror());
+        return 0;
+    }
+    if ((new_policy = dlsym(handle, POLICY_SYMBOL)) == NULL) {
+        fprintf(stderr, "Could not load placement policy: %s does not export %s.\n", path, POLICY_SYMBOL);
+        dlclose(handle);
+        return 0;
+    }
+    if ((new_policy->api_version != POLICY_API_VERSION) || (new_policy->tick == NULL)) {
+        fprintf(stderr, "Could not load placement policy: %s is incompatible (api version %d, expected %d).\n",
+                path, new_policy->api_version, POLICY_API_VERSION);
+        dlclose(handle);
+        return 0;
+    }
 
-    send_req(req, &op_retval);
-    if (op_retval->pid_retval == 0) {
-        free(op_retval);
+    if (handle == policy_handle) {
+        // dlopen hands out the loaded policy again: it is restarted in place, there is no other copy to fall back to
+        dlclose(handle);
+        if (policy->fini != NULL) {
+            policy->fini();
+        }
+        if ((policy->init != NULL) && policy->init(&policy_api)) {
+            fprintf(stderr, "Placement policy %s failed to reinitialize, its state may be stale.\n", policy->name);
+            return 0;
+        }
+        printf("Reloaded placement policy %s (%s).\n", policy->name, policy_path);
         return 1;
     }
-    free(op_retval);
-    return 0;
-}
-
-int send_unbind(int pid) {
-    req_t req;
-    addr_info_t *op_retval = malloc(sizeof(addr_info_t));
-
-    req.op_code = UNBIND_OP;
-    req.pid_n = pid;
 
-    send_req(req, &op_retval);
-    if (op_retval->pid_retval == 0) {
-        free(op_retval);
-        return 1;
+    // The new policy is initialized before the current one is finished, so that a failure keeps the current one
+    if ((new_policy->init != NULL) && new_policy->init(&policy_api)) {
+        fprintf(stderr, "Could not load placement policy: %s failed to initialize.\n", path);
+        dlclose(handle);
+        return 0;
     }
-    free(op_retval);
-    return 0;
+    policy_unload();
+    policy = new_policy;
+    policy_handle = handle;
+    snprintf(policy_path, sizeof(policy_path), "%s", path);
+    printf("Loaded placement policy %s (%s).\n", policy->name, path);
+    return 1;
 }
 
-int send_find(int n_pages, int mode) {
-    req_t req;
-
-    req.op_code = FIND_OP;
-    req.pid_n = n_pages;
-    req.mode = mode;
-
-    send_req(req, &candidates);
-
-    int n_found=-1;
-
-    while (candidates[++n_found].pid_retval > 0);
+const char *policy_auto_path() {
+    return pmm_mixed ? POLICY_MIXED : POLICY_DEFAULT;
+}
 
-    if (n_found == 0) {
-        return 0;
-    }
-    switch (mode) {
-        case DRAM_MODE:
-            return do_migration(DRAM_MODE, n_found);
-            break;
-        case NVRAM_MODE:
-        case NVRAM_INTENSIVE_MODE:
-        case NVRAM_WRITE_MODE:
-            return do_migration(NVRAM_MODE, n_found);
-            break;
-        case SWITCH_MODE:
-            return do_switch(n_found);
-            break;
+// Hot swap from the stdin/socket threads: waits for the current memcheck tick and placement request to finish
+int policy_swap(const char *path) {
+    pthread_mutex_lock(&policy_lock);
+    pthread_mutex_lock(&placement_lock);
+    int ret = policy_load(path);
+    if (!ret && (policy != NULL)) {
+        printf("Keeping placement policy %s (%s).\n", policy->name, policy_path);
     }
-    return 0;
+    pthread_mutex_unlock(&placement_lock);
+    pthread_mutex_unlock(&policy_lock);
+    return ret;
 }
 
 
@@ -519,143 +2432,148 @@ PLACEMENT FUNCTIONS
 
 
 void *memcheck_placement(void *args) {
-    long long dram_sz = 0;
-    long long nvram_sz = 0;
-    float dram_usage;
-    float nvram_usage;
+    policy_state_t st;
     int n_pages;
-    time_t prev_memdata_lmod = 0;
+    uint64_t prev_memdata_ts = 0;
+    int pressure = 0; // last sleep was cut short by a pressure event
+    float interval_mul = 1;
+    long long last_slow_us = 0; // last tick that also did the work paced by PCM_AGG_WINDOW_MS
+
+    memset(&st, 0, sizeof(st));
+    st.page_size = page_size;
+    snapshot_init();
 
     while (!exit_sig) {
-        int n_migrated = 0;
-        int switch_migrated = 0;
-        int thresh_migrated = 0;
-        int sleep_interval = memcheck_interval;
+        policy_result_t res = {0};
+        int sleep_interval = memcheck_interval * interval_mul;
+        int active = pressure; // a placement condition was met this tick
+
+        st.switch_act = switch_act;
+        st.thresh_act = thresh_act;
+        st.pressure = pressure;
+        st.memcheck_interval = memcheck_interval;
+        st.memdata_valid = 0;
+        st.nvram_latency = 0;
+        st.latency_slo = latency_slo;
 
         if (thresh_act || switch_act) {
-            dram_usage = free_space_tot_per(DRAM_MODE, &dram_sz);
-            nvram_usage = free_space_tot_per(NVRAM_MODE, &nvram_sz);
-            printf("Current DRAM Usage: %0.2f%%\n", dram_usage * 100);
-            printf("Current NVRAM Usage: %0.2f%%\n", nvram_usage * 100);
+            // Only the bandwidth and latency reaction needs the PCM_PERIOD_MS tick: sampling the home nodes (one
+            // /proc read per thread), snapshot restores and the usage printout follow the aggregate window
+            int slow_tick = pressure || (get_time_us() - last_slow_us >= PCM_AGG_WINDOW_MS * 1000LL);
+
+            node_mem_refresh();
+            if (slow_tick) {
+                last_slow_us = get_time_us();
+                procs_sample_cpus();
+            }
+            policy_refresh(&st);
+            if (slow_tick) {
+                printf("Current DRAM Usage: %0.2f%%\n", st.dram_usage * 100);
+                printf("Current NVRAM Usage: %0.2f%%\n", st.nvram_usage * 100);
+            }
+            rec_usage(&st);
+
+            // Snapshot restores only fill DRAM up to its target
+            if (slow_tick && (st.dram_usage < DRAM_TARGET)) {
+                n_pages = fmin((DRAM_TARGET - st.dram_usage) * st.dram_sz / page_size, MAX_N_FIND);
+                pthread_mutex_lock(&placement_lock);
+                int restored = snapshot_restore_tick(n_pages);
+                pthread_mutex_unlock(&placement_lock);
+                if (restored > 0) {
+                    printf("SNAPSHOT: Restored %d hot pages to DRAM.\n", restored);
+                    policy_refresh(&st);
+                    res.n_migrated += restored;
+                    active = 1;
+                }
+            }
         }
 
         if (switch_act) {
-            time_t memdata_lmod = get_memdata_mtime();
-            if (memdata_lmod == 0 || (memdata_lmod == prev_memdata_lmod)) {
+            uint64_t memdata_ts = 0;
+            if (!read_memdata(&st.md, &memdata_ts) || (memdata_ts == prev_memdata_ts)) {
                 printf("MEMCHECK: Old or invalid memdata values. Ignoring...\n");
             }
             else {
-                prev_memdata_lmod = memdata_lmod;
-                memdata_t *md = read_memdata();
-                if (!check_memdata(md)) {
+                prev_memdata_ts = memdata_ts;
+                if (!check_memdata(&st.md)) {
                     printf("MEMCHECK: Unexpected memdata values.\n");
                 }
                 else {
-                    float pmm_bw;
-                    if (PMM_MIXED) {
-                        pmm_bw = md->sys_pmmAppBW;
-                    }
-                    else {
-                        pmm_bw = md->sys_pmmWrites;
-                    }
-                    if (pmm_bw > NVRAM_BW_THRESH) {
-                        pthread_mutex_lock(&placement_lock);
-                        send_find(0, NVRAM_CLEAR);
-                        usleep(clear_interval);
-                        if (dram_usage >= DRAM_TARGET) {
-                            switch_migrated = send_find(MAX_N_SWITCH, SWITCH_MODE);
-                            if (switch_migrated > 0) {
-                                printf("DRAM<->NVRAM: Switched %d out of %ld pages.\n", switch_migrated, MAX_N_SWITCH * 2);
-                            }
+                    // Placement reacts to the latest sample, the cost model averages over PCM_AGG_WINDOW_MS
+                    memdata_t agg;
+                    cost_update_memdata(read_memdata_window(&agg, PCM_AGG_WINDOW_MS) ? &agg : &st.md);
+                    st.memdata_valid = 1;
+                    st.nvram_latency = memdata_nvram_latency(&st.md, memdata_ts);
+                    procs_sample_traffic(&st.md);
+                    // Ticking faster than pcm-memory samples only finds old samples
+                    memcheck_interval = fmax(MEMCHECK_INTERVAL * 1000, st.md.elapsed_ns / 1000);
+                    if (st.md.pmm_mixed != pmm_mixed) {
+                        pmm_mixed = st.md.pmm_mixed;
+                        printf("MEMCHECK: pcm reports %s NVRAM configuration.\n", pmm_mixed ? "App Direct + Memory Mode" : "App Direct");
+                        if (policy_auto) {
+                            policy_swap(policy_auto_path());
                         }
-                        else {
-                            long long n_bytes = (DRAM_LIMIT - dram_usage) * dram_sz;
-                            n_pages = n_bytes / page_size;
-                            n_pages = fmin(n_pages, MAX_N_FIND);
-                            switch_migrated = send_find(n_pages, NVRAM_INTENSIVE_MODE);
-
-                            if (switch_migrated > 0) {
-                                printf("NVRAM->DRAM: Sent %d out of %d intensive pages.\n", switch_migrated, n_pages);
-                                dram_usage = free_space_tot_per(DRAM_MODE, &dram_sz);
-                                nvram_usage = free_space_tot_per(NVRAM_MODE, &nvram_sz);
-                            }
-                        }
-
-                        pthread_mutex_unlock(&placement_lock);
                     }
                 }
-
-                n_migrated += switch_migrated;
-                free(md);
             }
         }
 
-        if (thresh_act) {
-            if ((dram_usage > DRAM_LIMIT) && (nvram_usage < NVRAM_TARGET)) {
-                long long n_bytes = fmin((dram_usage - DRAM_TARGET) * dram_sz,
-                                    (NVRAM_TARGET - nvram_usage) * nvram_sz);
-                n_pages = n_bytes / page_size;
-                n_pages = fmin(n_pages, MAX_N_FIND);
-                pthread_mutex_lock(&placement_lock);
-                thresh_migrated = send_find(n_pages, DRAM_MODE);
-                pthread_mutex_unlock(&placement_lock);
-                if (thresh_migrated > 0) {
-                    printf("DRAM->NVRAM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
-                }
+        if (thresh_act || switch_act) {
+            st.pmm_mixed = pmm_mixed;
+            st.bound_share = bound_traffic_share;
+            if (st.memdata_valid) {
+                rec_memdata(&st);
             }
-            else if (!switch_act && (nvram_usage > NVRAM_LIMIT) && (dram_usage < DRAM_TARGET)) {
-                long long n_bytes = fmin((nvram_usage - NVRAM_TARGET) * nvram_sz,
-                                    (DRAM_TARGET - dram_usage) * dram_sz);
-                n_pages = n_bytes / page_size;
-                n_pages = fmin(n_pages, MAX_N_FIND);
-                pthread_mutex_lock(&placement_lock);
-                thresh_migrated = send_find(n_pages, NVRAM_MODE);
-                pthread_mutex_unlock(&placement_lock);
-                if (thresh_migrated > 0) {
-                    printf("NVRAM->DRAM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
-                }
+            pthread_mutex_lock(&policy_lock);
+            if (policy != NULL) {
+                policy->tick(&st, &res);
             }
-
-            n_migrated += thresh_migrated;
+            pthread_mutex_unlock(&policy_lock);
         }
 
-        if (n_migrated > 0) {
+        if (res.n_migrated > 0) {
             sleep_interval *= 2; // give time for bw to settle given the migrated pages
-            if (switch_migrated > 0) {
-                sleep_interval -= clear_interval;
-            }
+            sleep_interval -= res.slept_us;
         }
 
+        // Idle ticks stretch the interval, pressure events still wake memcheck right away
+        active |= res.active;
+        interval_mul = active ? 1 : fmin(interval_mul * INTERVAL_INC_FACTOR, MAX_INTERVAL_MUL);
+        if (thresh_act || switch_act) {
+            rec_tick(&res, active, sleep_interval);
+        }
 
-        usleep(sleep_interval);
+        if ((pressure = pressure_wait(sleep_interval))) {
+            printf("MEMCHECK: Memory pressure event.\n");
+        }
     }
 
     return NULL;
 }
 
 /*void *nvramWrChk_placement(void *args) {
-    time_t prev_memdata_lmod = 0;
+    uint64_t prev_memdata_ts = 0;
     while (!exit_sig) {
         int sleep_interval = nvramWrChk_interval;
         if (nvramWrChk_act) {
-            time_t memdata_lmod = get_memdata_mtime();
-            if (memdata_lmod == 0 || (memdata_lmod == prev_memdata_lmod)) {
+            memdata_t md;
+            uint64_t memdata_ts = 0;
+            if (!read_memdata(&md, &memdata_ts) || (memdata_ts == prev_memdata_ts)) {
                 printf("NVRAMWRCHK: Old or invalid memdata values. Ignoring...\n");
             }
             else {
-                prev_memdata_lmod = memdata_lmod;
-                memdata_t *md = read_memdata();
-                if (!check_memdata(md)) {
+                prev_memdata_ts = memdata_ts;
+                if (!check_memdata(&md)) {
                     printf("NVRAMWRCHK: Unexpected memdata values.\n");
                 }
                 else {
                     float pmm_bw;
                     if (PMM_MIXED) {
                         // If mixed configuration (AD+MM), pcm cannot isolate PMM AD write BW, so use total AD BW
-                        pmm_bw = md->sys_pmmAppBW;
+                        pmm_bw = md.sys_pmmAppBW;
                     }
                     else {
-                        pmm_bw = md->sys_pmmWrites;
+                        pmm_bw = md.sys_pmmWrites;
                     }
 
                     if ((pmm_bw > NVRAM_BW_WR_THRESH)) {
@@ -676,7 +2594,6 @@ void *memcheck_placement(void *args) {
                         sleep_interval -= clearDirty_interval;
                     }
                 }
-                free(md);
             }
         }
 
@@ -703,11 +2620,14 @@ void *process_stdin(void *args) {
     long pid;
 
     printf("Available commands:\n"
-            "\tbind [pid]\n"
+            "\tbind [pid] [batch|normal|latency] [weight]\n"
             "\tunbind [pid]\n"
             "\tDEBUG: send [n] [dram|nvram|dramwr]\n"
             "\tDEBUG: switch [n]\n"
-            "\tDEBUG: toggle [switch|thresh|all]\n"
+            "\tDEBUG: toggle [switch|thresh|cost|all]\n"
+            "\tslo [ns]\n"
+            "\tpolicy load [path] | policy auto | policy [args]\n"
+            "\tDEBUG: stats\n"
             "\tDEBUG: clear\n"
             "\texit\n");
 
@@ -722,9 +2642,23 @@ void *process_stdin(void *args) {
                 continue;
             }
             pid = strtol(substring, NULL, 10);
+
+            int priority = PRIO_NORMAL;
+            int weight = DEFAULT_WEIGHT;
+            if ((substring = strtok(NULL, " \n")) != NULL) {
+                if ((priority = parse_prio(substring)) == -1) {
+                    fprintf(stderr, "Invalid priority for bind command.\n");
+                    continue;
+                }
+                if ((substring = strtok(NULL, " \n")) != NULL) {
+                    weight = strtol(substring, NULL, 10);
+                }
+            }
+
             if ((pid>0) && (pid<MAX_PID_N)) {
-                if (send_bind((int) pid)) {
-                    printf("Bind request success (pid=%d).\n", (int) pid);
+                if (send_bind((int) pid, priority, weight)) {
+                    printf("Bind request success (pid=%d, prio=%s).\n", (int) pid, prio_names[priority]);
+                    snapshot_match((int) pid);
                 }
                 else {
                     fprintf(stderr, "Bind request failed (pid=%d).\n", (int) pid);
@@ -766,6 +2700,7 @@ void *process_stdin(void *args) {
             }
 
             int n_migrated = 0;
+            node_mem_refresh();
 
             if (!strcmp(substring, "dram\n")) {
                 pthread_mutex_lock(&placement_lock);
@@ -799,6 +2734,7 @@ void *process_stdin(void *args) {
             }
             long n = strtol(substring, NULL, 10);
             n = fmin(n, MAX_N_SWITCH);
+            node_mem_refresh();
             pthread_mutex_lock(&placement_lock);
             int n_migrated = send_find((int) n, SWITCH_MODE);
             pthread_mutex_unlock(&placement_lock);
@@ -807,6 +2743,20 @@ void *process_stdin(void *args) {
             }
         }
 
+        else if (!strcmp(substring, "slo")) {
+            if ((substring = strtok(NULL, " ")) == NULL) {
+                fprintf(stderr, "Invalid argument for slo command.\n");
+                continue;
+            }
+            latency_slo = fmax(strtof(substring, NULL), 0);
+            if (latency_slo > 0) {
+                printf("NVRAM read latency SLO set to %.0fns\n", latency_slo);
+            }
+            else {
+                printf("NVRAM read latency trigger turned OFF\n");
+            }
+        }
+
         else if (!strcmp(substring, "toggle")) {
             if ((substring = strtok(NULL, " ")) == NULL) {
                 fprintf(stderr, "Invalid argument for toggle command.\n");
@@ -832,6 +2782,16 @@ void *process_stdin(void *args) {
                     printf("Threshold component turned OFF\n");
                 }
             }
+            else if (!strcmp(substring, "cost\n")) {
+                cost_act = 1 - cost_act;
+
+                if (cost_act) {
+                    printf("Cost model turned ON\n");
+                }
+                else {
+                    printf("Cost model turned OFF\n");
+                }
+            }
             else if (!strcmp(substring, "all\n")) {
                 switch_act = 1 - switch_act;
                 thresh_act = 1 - thresh_act;
@@ -852,6 +2812,76 @@ void *process_stdin(void *args) {
             }
         }
 
+        else if (!strcmp(substring, "stats\n")) {
+            printf("Cost model: %.2fus per migrated page, ~%.0f hot NVRAM pages, %.2fMB/s NVRAM reads, %.2fMB/s NVRAM writes\n",
+                    cost.page_mig_us, cost.hot_pages, cost.pmm_rd, cost.pmm_wr);
+            printf("Skipped migrations: %ld pages in %ld batches\n", cost.skipped_pages, cost.skipped_batches);
+            memdata_t md;
+            memset(&md, 0, sizeof(md));
+            if (read_memdata_window(&md, PCM_AGG_WINDOW_MS) && check_memdata(&md)) {
+                for (int i=0; i < md.n_sockets; i++) {
+                    printf("Socket %d: %.2fMB/s DRAM reads, %.2fMB/s DRAM writes, %.2fMB/s NVRAM reads, %.2fMB/s NVRAM writes\n",
+                            i, md.socket[i].dramReads, md.socket[i].dramWrites, md.socket[i].pmmReads,
+                            md.socket[i].pmmWrites);
+                    if (md.latency_ns > 0) {
+                        printf("Socket %d: %.0fns DRAM read latency, %.0fns NVRAM read latency\n", i,
+                                md.latency[i].ddrRead, md.latency[i].pmmRead);
+                    }
+                }
+                if (md.n_sockets > 1) {
+                    printf("Socket snapshot skew: %.1fus\n", md.snapshot_skew_ns / 1000.0);
+                }
+            }
+            if (latency_slo > 0) {
+                printf("NVRAM read latency SLO: %.0fns\n", latency_slo);
+            }
+            if (bound_traffic_share >= 0) {
+                printf("Bound processes: %.1f%% of the memory traffic (%s)\n", bound_traffic_share * 100,
+                        (md.n_cores > 0) ? "MBM" : "LLC misses");
+                pthread_mutex_lock(&procs_lock);
+                for (int i=0; i < n_bound; i++) {
+                    if (bound_procs[i].traffic_bw >= 0) {
+                        printf("\tpid=%d: %.2fMB/s\n", bound_procs[i].pid, bound_procs[i].traffic_bw);
+                    }
+                }
+                pthread_mutex_unlock(&procs_lock);
+            }
+            printf("Failed migrations:");
+            for (int i=0; i < N_FAIL_CLASSES; i++) {
+                printf(" %ld %s%s", fail_counts[i], fail_names[i], (i < N_FAIL_CLASSES - 1) ? "," : "\n");
+            }
+            pthread_mutex_lock(&policy_lock);
+            printf("Placement policy: %s (%s), NVRAM configuration: %s\n", (policy != NULL) ? policy->name : "none",
+                    policy_auto ? "auto" : "manual", pmm_mixed ? "App Direct + Memory Mode" : "App Direct");
+            if ((policy != NULL) && (policy->stats != NULL)) {
+                policy->stats();
+            }
+            pthread_mutex_unlock(&policy_lock);
+        }
+
+        else if (!strcmp(substring, "policy")) {
+            if ((substring = strtok(NULL, "\n")) == NULL) {
+                fprintf(stderr, "Invalid argument for policy command.\n");
+                continue;
+            }
+            if (!strncmp(substring, "load ", 5)) {
+                if (policy_swap(substring + 5)) {
+                    policy_auto = 0;
+                }
+                continue;
+            }
+            if (!strcmp(substring, "auto")) {
+                policy_auto = 1;
+                policy_swap(policy_auto_path());
+                continue;
+            }
+            pthread_mutex_lock(&policy_lock);
+            if ((policy == NULL) || (policy->command == NULL) || !policy->command(substring)) {
+                fprintf(stderr, "Invalid argument for policy command.\n");
+            }
+            pthread_mutex_unlock(&policy_lock);
+        }
+
         else if (!strcmp(substring, "clr\n") || !strcmp(substring, "clear\n")) {
             system("@cls||clear");
         }
@@ -859,11 +2889,14 @@ void *process_stdin(void *args) {
         else {
             fprintf(stderr, "Unknown command.\n"
                     "Available commands:\n"
-                    "\tbind [pid]\n"
+                    "\tbind [pid] [batch|normal|latency] [weight]\n"
                     "\tunbind [pid]\n"
                     "\tDEBUG: send [n] [dram|nvram|dramwr]\n"
                     "\tDEBUG: switch [n]\n"
-                    "\tDEBUG: toggle [switch|thresh|all]\n"
+                    "\tDEBUG: toggle [switch|thresh|cost|all]\n"
+                    "\tslo [ns]\n"
+                    "\tpolicy load [path] | policy auto | policy [args]\n"
+                    "\tDEBUG: stats\n"
                     "\tDEBUG: clear\n"
                     "\texit\n");
 
@@ -880,6 +2913,7 @@ void *process_socket(void *args) {
     struct sockaddr_un uds_addr;
     int unix_fd, sel, acc, rd;
     req_t unix_req;
+    headroom_t headroom;
 
     struct timeval sel_timeout;
     fd_set readfds;
@@ -923,8 +2957,9 @@ void *process_socket(void *args) {
             while ( (rd = read(acc, &unix_req,sizeof(req_t))) == sizeof(req_t)) {
                 switch (unix_req.op_code) {
                     case BIND_OP:
-                        if (send_bind(unix_req.pid_n)) {
+                        if (send_bind(unix_req.pid_n, unix_req.priority, unix_req.weight)) {
                             printf("Bind request success (pid=%d).\n", unix_req.pid_n);
+                            snapshot_match(unix_req.pid_n);
                         }
                         else {
                             fprintf(stderr, "Bind request failed (pid=%d).\n", unix_req.pid_n);
@@ -938,6 +2973,19 @@ void *process_socket(void *args) {
                             fprintf(stderr, "Unbind request failed (pid=%d).\n", unix_req.pid_n);
                         }
                         break;
+                    case HINT_OP:
+                        if (!send_hint(unix_req.pid_n, unix_req.mode, unix_req.addr, unix_req.len)) {
+                            fprintf(stderr, "Hint request failed (pid=%d, addr=%lx, len=%lu).\n", unix_req.pid_n, unix_req.addr, unix_req.len);
+                        }
+                        break;
+                    case HEADROOM_OP:
+                        node_mem_refresh(); // clients cache the reply, so a fresh read is cheap here
+                        headroom.dram_free = tier_headroom(DRAM_MODE);
+                        headroom.nvram_free = tier_headroom(NVRAM_MODE);
+                        if (write(acc, &headroom, sizeof(headroom_t)) != sizeof(headroom_t)) {
+                            fprintf(stderr, "Error replying to headroom request: %s\n", strerror(errno));
+                        }
+                        break;
                     default:
                         fprintf(stderr, "Unexpected request OPcode from accepted UD socket connection");
                 }
@@ -962,6 +3010,62 @@ void *process_socket(void *args) {
 
 
 
+// Starts a snapshot round every SNAPSHOT_INTERVAL and rewrites the snapshot when it completes. A round queries at most
+// SNAPSHOT_SCAN_PAGES pages per second, so large processes take several seconds (or intervals) to cover instead of
+// loading the system with a burst of page lookups.
+void *snapshot_periodic(void *args) {
+    long long last_round_us = get_time_us();
+
+    while (!exit_sig) {
+        sleep(SELECT_TIMEOUT);
+        if (exit_sig) {
+            break;
+        }
+        if (!snap_scanning) {
+            if (get_time_us() - last_round_us < SNAPSHOT_INTERVAL * 1000000LL) {
+                continue;
+            }
+            last_round_us = get_time_us();
+            snapshot_round_start();
+        }
+        if (snapshot_round_step(SNAPSHOT_SCAN_PAGES * SELECT_TIMEOUT)) {
+            snapshot_write();
+        }
+    }
+    return NULL;
+}
+
+// Unbinds processes as soon as they exit instead of waiting for the module to notice on the next FIND
+void *lifecycle_watch(void *args) {
+    struct epoll_event events[MAX_EXIT_EVENTS];
+
+    while (!exit_sig) {
+        int n = epoll_wait(lifecycle_fd, events, MAX_EXIT_EVENTS, SELECT_TIMEOUT * 1000);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error in lifecycle epoll_wait: %s\n", strerror(errno));
+            return NULL;
+        }
+        for (int i=0; i < n; i++) {
+            int pid = procs_pid_of(events[i].data.fd);
+            if (pid == 0) {
+                continue;
+            }
+            if (send_unbind(pid)) {
+                printf("Process exited, unbound pid=%d.\n", pid);
+            }
+            // The module may already have dropped it, the pidfd must be closed either way
+            procs_remove(pid);
+        }
+    }
+    return NULL;
+}
+
+
+
 /*
 -------------------------------------------------------------------------------
 
@@ -978,6 +3082,12 @@ int main() {
         return 1;
     }
     page_size = sysconf(_SC_PAGESIZE);
+    // Until pcm publishes a sample only the node layout tells whether Memory Mode is in use
+    pmm_mixed = (pmm_detect_mode() == PMM_MODE_MIXED);
+    policy_auto = (getenv(POLICY_ENV) == NULL);
+    cost_init();
+    node_mem_init();
+    pressure_init();
     int packet_size = NLMSG_SPACE(MAX_PAYLOAD);
     buf_size = packet_size * MAX_PACKETS;
 
@@ -999,6 +3109,9 @@ int main() {
         return 1;
     }
 
+    memdata_init();
+    rec_init();
+
     if (pthread_mutex_init(&comm_lock, NULL)) {
         fprintf(stderr, "Error creating communication mutex lock: %s\n", strerror(errno));
     }
@@ -1007,6 +3120,30 @@ int main() {
         fprintf(stderr, "Error creating placement mutex lock: %s\n", strerror(errno));
     }
 
+    else if (pthread_mutex_init(&node_mem_lock, NULL)) {
+        fprintf(stderr, "Error creating node memory mutex lock: %s\n", strerror(errno));
+    }
+
+    else if (pthread_mutex_init(&procs_lock, NULL)) {
+        fprintf(stderr, "Error creating bound processes mutex lock: %s\n", strerror(errno));
+    }
+
+    else if (pthread_mutex_init(&snapshot_lock, NULL)) {
+        fprintf(stderr, "Error creating snapshot mutex lock: %s\n", strerror(errno));
+    }
+
+    else if (pthread_mutex_init(&policy_lock, NULL)) {
+        fprintf(stderr, "Error creating policy mutex lock: %s\n", strerror(errno));
+    }
+
+    else if (!policy_load(policy_auto ? policy_auto_path() : getenv(POLICY_ENV))) {
+        fprintf(stderr, "Error loading placement policy (set %s or run make policies).\n", POLICY_ENV);
+    }
+
+    else if ((lifecycle_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        fprintf(stderr, "Error creating process lifecycle epoll fd: %s\n", strerror(errno));
+    }
+
     else if (pthread_create(&stdin_thread, NULL, process_stdin, NULL)) {
         fprintf(stderr, "Error spawning stdin thread: %s\n", strerror(errno));
     }
@@ -1019,22 +3156,47 @@ int main() {
         fprintf(stderr, "Error spawning memcheck placement thread: %s\n", strerror(errno));
     }
 
+    else if (pthread_create(&lifecycle_thread, NULL, lifecycle_watch, NULL)) {
+        fprintf(stderr, "Error spawning process lifecycle thread: %s\n", strerror(errno));
+    }
+
+    else if (pthread_create(&snapshot_thread, NULL, snapshot_periodic, NULL)) {
+        fprintf(stderr, "Error spawning snapshot thread: %s\n", strerror(errno));
+    }
+
     else {
         pthread_join(stdin_thread, NULL);
         printf("Exiting ctl...\n");
         pthread_join(socket_thread, NULL);
         pthread_join(memcheck_thread, NULL);
+        pthread_join(lifecycle_thread, NULL);
+        pthread_join(snapshot_thread, NULL);
+        close(lifecycle_fd);
+        snapshot_write();
+        policy_unload();
 
         pthread_mutex_destroy(&comm_lock);
         pthread_mutex_destroy(&placement_lock);
+        pthread_mutex_destroy(&node_mem_lock);
+        pthread_mutex_destroy(&procs_lock);
+        pthread_mutex_destroy(&snapshot_lock);
+        pthread_mutex_destroy(&policy_lock);
 
         close(netlink_fd);
+        node_mem_close();
+        pressure_close();
+        memdata_close();
+        rec_fini();
         free(candidates);
         free(buffer);
         free(nlmh_out);
         return 0;
     }
     close(netlink_fd);
+    node_mem_close();
+    pressure_close();
+    memdata_close();
+    rec_fini();
     free(candidates);
     free(buffer);
     free(nlmh_out);
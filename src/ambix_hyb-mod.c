@@ -48,6 +48,9 @@ addr_info_t *backup_addrs; // prevents a second page walk
 addr_info_t *switch_backup_addrs; // for switch walk
 
 struct task_struct **task_items;
+int *task_prio; // priority class of each bound task
+int *task_weight; // DRAM share weight of each bound task
+int *task_traffic; // share of the bound tasks' memory traffic reported by ctl (TRAFFIC_SHARE_SCALE), -1 if unknown
 struct nlmsghdr **nlmh_array;
 int n_pids = 0;
 
@@ -58,10 +61,179 @@ int last_pid_dram = 0;
 int last_pid_nvram = 0;
 
 int curr_pid = 0;
+int curr_prio = PRIO_NORMAL;
 int n_to_find = 0;
 int n_found = 0;
 int n_backup = 0;
 int n_switch_backup = 0;
+unsigned long find_nodes = 0; // node mask of the current FIND request, 0 for any node
+
+// Priority-aware walk state
+static const int promote_order[N_PRIO_CLASSES] = {PRIO_LATENCY, PRIO_NORMAL, PRIO_BATCH};
+static const int demote_order[N_PRIO_CLASSES] = {PRIO_BATCH, PRIO_NORMAL, PRIO_LATENCY};
+int walk_class = -1; // only tasks of this class are walked, -1 walks all
+int walk_demote = 0;
+int walk_traffic = 0; // bandwidth-driven promotion: budget also follows the traffic share of each task
+int pass_budget = 0; // pages to find in the current class pass
+long pass_weight_sum = 0;
+
+// Part of a task's range left unwalked when the task stopped at its quota, walked again by the refill passes
+typedef struct walk_seg {
+    unsigned long start;
+    unsigned long end; // exclusive
+} walk_seg_t;
+
+walk_seg_t *task_segs; // 2 per task: the task a walk resumes at is walked in two parts
+int *task_n_segs;
+
+// Sorted list of address ranges per pid, non-overlapping within a pid
+typedef struct range {
+    pid_t pid;
+    int kind;
+    unsigned long start;
+    unsigned long end; // exclusive
+    unsigned long expires; // jiffies after which the entry is ignored, 0 never expires
+} range_t;
+
+typedef struct range_table {
+    range_t *entries;
+    int n;
+    int max;
+} range_table_t;
+
+// Position of the current walk in a range table (walks visit addresses in increasing order)
+typedef struct range_cursor {
+    range_table_t *table;
+    pid_t pid;
+    int idx;
+} range_cursor_t;
+
+range_table_t hint_table = {.max = MAX_HINTS};
+range_cursor_t hint_cursor = {.table = &hint_table};
+range_table_t fail_table = {.max = MAX_FAIL_RANGES}; // pages ctl failed to migrate, skipped until their backoff expires
+range_cursor_t fail_cursor = {.table = &fail_table};
+
+
+
+/*
+-------------------------------------------------------------------------------
+
+RANGE TABLES
+
+-------------------------------------------------------------------------------
+*/
+
+
+
+// Index of the first entry of pid ending after addr (or of the first entry of a later pid)
+static int range_find(range_table_t *t, pid_t pid, unsigned long addr) {
+    int lo = 0, hi = t->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        range_t *e = &t->entries[mid];
+        if ((e->pid < pid) || ((e->pid == pid) && (e->end <= addr))) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Inserts [start, end) for pid, replacing whatever overlapped it. HINT_CLEAR only removes.
+static int range_insert(range_table_t *t, pid_t pid, unsigned long start, unsigned long end, int kind, unsigned long expires) {
+    int i = range_find(t, pid, start);
+
+    while ((i < t->n) && (t->entries[i].pid == pid) && (t->entries[i].start < end)) {
+        range_t *e = &t->entries[i];
+        if ((e->start < start) && (e->end > end)) {
+            // New range in the middle of an existing one: split it
+            if (t->n >= t->max) {
+                return -1;
+            }
+            memmove(&t->entries[i+2], &t->entries[i+1], (t->n - i - 1) * sizeof(range_t));
+            t->entries[i+1] = *e;
+            t->entries[i+1].start = end;
+            e->end = start;
+            t->n++;
+            i++;
+            break;
+        }
+        else if (e->start < start) {
+            e->end = start;
+            i++;
+        }
+        else if (e->end > end) {
+            e->start = end;
+            break;
+        }
+        else {
+            memmove(&t->entries[i], &t->entries[i+1], (t->n - i - 1) * sizeof(range_t));
+            t->n--;
+        }
+    }
+
+    if (kind == HINT_CLEAR) {
+        return 0;
+    }
+    if (t->n >= t->max) {
+        return -1;
+    }
+    memmove(&t->entries[i+1], &t->entries[i], (t->n - i) * sizeof(range_t));
+    t->entries[i].pid = pid;
+    t->entries[i].kind = kind;
+    t->entries[i].start = start;
+    t->entries[i].end = end;
+    t->entries[i].expires = expires;
+    t->n++;
+    return 0;
+}
+
+static int range_expired(range_t *e) {
+    return (e->expires != 0) && time_after_eq(jiffies, e->expires);
+}
+
+static void range_prune(range_table_t *t) {
+    int i, n = 0;
+
+    for (i = 0; i < t->n; i++) {
+        if (!range_expired(&t->entries[i])) {
+            t->entries[n++] = t->entries[i];
+        }
+    }
+    t->n = n;
+}
+
+static void range_remove_pid(range_table_t *t, pid_t pid) {
+    int first = range_find(t, pid, 0);
+    int last = first;
+
+    while ((last < t->n) && (t->entries[last].pid == pid)) {
+        last++;
+    }
+    memmove(&t->entries[first], &t->entries[last], (t->n - last) * sizeof(range_t));
+    t->n -= last - first;
+}
+
+static void range_cursor_init(range_cursor_t *c, pid_t pid, unsigned long addr) {
+    c->pid = pid;
+    c->idx = range_find(c->table, pid, addr);
+}
+
+// Kind of the range containing addr or -1. Addresses must not decrease between calls.
+static int range_kind_at(range_cursor_t *c, unsigned long addr) {
+    range_table_t *t = c->table;
+
+    while ((c->idx < t->n) && (t->entries[c->idx].pid == c->pid) && (t->entries[c->idx].end <= addr)) {
+        c->idx++;
+    }
+    if ((c->idx < t->n) && (t->entries[c->idx].pid == c->pid) && (t->entries[c->idx].start <= addr)
+            && !range_expired(&t->entries[c->idx])) {
+        return t->entries[c->idx].kind;
+    }
+    return -1;
+}
 
 
 
@@ -75,7 +247,7 @@ HELPER FUNCTIONS
 
 
 
-static int find_target_process(pid_t pid) {  // to find the task struct by process_name or pid
+static int find_target_process(pid_t pid, int prio, int weight) {  // to find the task struct by process_name or pid
     if (n_pids >= MAX_PIDS) {
         pr_info("PLACEMENT: Managed PIDs at capacity.\n");
         return 0;
@@ -94,6 +266,9 @@ static int find_target_process(pid_t pid) {  // to find the task struct by proce
     }
     struct task_struct *t = get_pid_task(pid_s, PIDTYPE_PID);
     if (t != NULL) {
+        task_prio[n_pids] = prio;
+        task_weight[n_pids] = weight;
+        task_traffic[n_pids] = -1;
         task_items[n_pids++] = t;
         return 1;
     }
@@ -102,6 +277,11 @@ static int find_target_process(pid_t pid) {  // to find the task struct by proce
 }
 
 static int update_pid_list(int i) {
+    if (task_items[i] != NULL) {
+        range_remove_pid(&hint_table, task_items[i]->pid);
+        range_remove_pid(&fail_table, task_items[i]->pid);
+    }
+
     if (last_pid_dram > i) {
         last_pid_dram--;
     }
@@ -128,6 +308,9 @@ static int update_pid_list(int i) {
     int j;
     for (j = i; j < (n_pids - 1); j++) {
         task_items[j] = task_items[j+1];
+        task_prio[j] = task_prio[j+1];
+        task_weight[j] = task_weight[j+1];
+        task_traffic[j] = task_traffic[j+1];
     }
 
     n_pids--;
@@ -135,6 +318,26 @@ static int update_pid_list(int i) {
     return 0;
 }
 
+// Weight used to split a pass budget: promotions favour heavy tasks, demotions favour light ones.
+// Bandwidth-driven promotions are also scaled by the traffic share of the task (an even share while unknown).
+static long effective_weight(int i) {
+    if (walk_demote) {
+        return MAX_WEIGHT / task_weight[i];
+    }
+    if (walk_traffic) {
+        int share = (task_traffic[i] >= 0) ? task_traffic[i] : TRAFFIC_SHARE_SCALE / n_pids;
+        return (long) task_weight[i] * (TRAFFIC_SHARE_MIN + share);
+    }
+    return task_weight[i];
+}
+
+static int task_quota(int i) {
+    if (pass_weight_sum == 0) {
+        return pass_budget;
+    }
+    return int_min(pass_budget, (int) ((pass_budget * effective_weight(i) + pass_weight_sum - 1) / pass_weight_sum));
+}
+
 static int refresh_pids(void) {
     int i;
 
@@ -148,7 +351,7 @@ static int refresh_pids(void) {
 
     printk(KERN_INFO "LIST AFTER REFRESH:");
     for(i=0; i<n_pids; i++) {
-        printk(KERN_INFO "i:%d, pid:%d\n", i, task_items[i]->pid);
+        printk(KERN_INFO "i:%d, pid:%d, prio:%d, weight:%d\n", i, task_items[i]->pid, task_prio[i], task_weight[i]);
     }
 
     return 0;
@@ -165,6 +368,49 @@ CALLBACK FUNCTIONS
 */
 
 
+// Candidates must be in the walked tier and, if the FIND request restricts it, on one of the requested nodes
+static int walk_node(int nid, int mode) {
+    return contains(nid, mode) && ((find_nodes == 0) || ((nid < BITS_PER_LONG) && (find_nodes & (1UL << nid))));
+}
+
+// Applies hints in DRAM walks. Returns 1 if the page was handled by a hint or recently failed to migrate.
+static int dram_hint(unsigned long addr) {
+    if (range_kind_at(&fail_cursor, addr) != -1) {
+        return 1;
+    }
+    switch (range_kind_at(&hint_cursor, addr)) {
+        case HINT_HOT:
+        case HINT_PIN_DRAM:
+            return 1;
+        case HINT_COLD:
+        case HINT_PIN_NVRAM:
+            // Send to NVRAM regardless of access bits
+            found_addrs[n_found].addr = addr;
+            found_addrs[n_found++].pid_retval = curr_pid;
+            return 1;
+    }
+    return 0;
+}
+
+// Applies hints in NVRAM walks. Returns 1 if the page was handled by a hint or recently failed to migrate.
+static int nvram_hint(unsigned long addr) {
+    if (range_kind_at(&fail_cursor, addr) != -1) {
+        return 1;
+    }
+    switch (range_kind_at(&hint_cursor, addr)) {
+        case HINT_COLD:
+        case HINT_PIN_NVRAM:
+            return 1;
+        case HINT_HOT:
+        case HINT_PIN_DRAM:
+            // Send to DRAM (priority) regardless of access bits
+            found_addrs[n_found].addr = addr;
+            found_addrs[n_found++].pid_retval = curr_pid;
+            return 1;
+    }
+    return 0;
+}
+
 static int pte_callback_mem(pte_t *ptep, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
 
@@ -175,7 +421,11 @@ static int pte_callback_mem(pte_t *ptep, unsigned long addr, unsigned long next,
     }
 
     // If page is not present, write protected, or not in DRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
+    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
+        return 0;
+    }
+
+    if (dram_hint(addr)) {
         return 0;
     }
 
@@ -187,7 +437,8 @@ static int pte_callback_mem(pte_t *ptep, unsigned long addr, unsigned long next,
         return 0;
     }
 
-    if (!pte_dirty(*ptep) && (n_backup < (n_to_find - n_found))) {
+    // Young pages of latency tasks are their hot set and never taken as demotion backups
+    if (!pte_dirty(*ptep) && (curr_prio != PRIO_LATENCY) && (n_backup < (n_to_find - n_found))) {
             // Add to backup list
             backup_addrs[n_backup].addr = addr;
             backup_addrs[n_backup++].pid_retval = curr_pid;
@@ -205,7 +456,7 @@ static int pte_callback_mem(pte_t *ptep, unsigned long addr, unsigned long next,
                         struct mm_walk *walk) {
 
     // If already found n pages, page is not present or page is not in DRAM node
-    if ((ptep == NULL) || (n_found >= n_to_find) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
+    if ((ptep == NULL) || (n_found >= n_to_find) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
         if ((n_found == n_to_find) && !found_last) { // found all + last
             last_addr_dram = addr;
             found_last = 1;
@@ -232,7 +483,7 @@ static int pte_callback_mem_force(pte_t *ptep, unsigned long addr, unsigned long
                         struct mm_walk *walk) {
 
     // If already found n pages, page is not present or page is not in DRAM node
-    if ((ptep == NULL) || (n_found >= n_to_find) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
+    if ((ptep == NULL) || (n_found >= n_to_find) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), DRAM_MODE)) {
         if ((n_found == n_to_find) && !found_last) { // found all + last
             last_addr_dram = addr;
             found_last = 1;
@@ -268,7 +519,11 @@ static int pte_callback_nvram_force(pte_t *ptep, unsigned long addr, unsigned lo
     }
 
     // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+        return 0;
+    }
+
+    if (nvram_hint(addr)) {
         return 0;
     }
 
@@ -304,7 +559,11 @@ static int pte_callback_nvram_write(pte_t *ptep, unsigned long addr, unsigned lo
     }
 
     // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+        return 0;
+    }
+
+    if (nvram_hint(addr)) {
         return 0;
     }
 
@@ -334,7 +593,11 @@ static int pte_callback_nvram_intensive(pte_t *ptep, unsigned long addr, unsigne
     }
 
     // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+        return 0;
+    }
+
+    if (nvram_hint(addr)) {
         return 0;
     }
 
@@ -365,7 +628,11 @@ static int pte_callback_nvram_switch(pte_t *ptep, unsigned long addr, unsigned l
     }
 
     // If page is not present, write protected, or not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+        return 0;
+    }
+
+    if (nvram_hint(addr)) {
         return 0;
     }
 
@@ -390,10 +657,16 @@ static int pte_callback_nvram_clear(pte_t *ptep, unsigned long addr, unsigned lo
                         struct mm_walk *walk) {
 
     // If  page is not present, write protected, or page is not in NVRAM node
-    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !contains(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
+    if ((ptep == NULL) || !pte_present(*ptep) || !pte_write(*ptep) || !walk_node(pfn_to_nid(pte_pfn(*ptep)), NVRAM_MODE)) {
         return 0;
     }
 
+    // Access density of the epoch ended by this clear
+    found_addrs[1].addr++;
+    if (pte_young(*ptep)) {
+        found_addrs[0].addr++;
+    }
+
     pte_t old_pte = ptep_modify_prot_start(walk->vma, addr, ptep);
     *ptep = pte_mkold(old_pte); // unset modified bit
     *ptep = pte_mkclean(old_pte); // unset dirty bit
@@ -440,33 +713,53 @@ PAGE WALKERS
 
 
 
+// Walks [start, end) of task i, taking at most its share of the current class pass
+static void walk_task(struct mm_walk_ops *mem_walk_ops, int i, unsigned long start, unsigned long end) {
+    struct mm_struct *mm = task_items[i]->mm;
+    unsigned long saved_addr_dram = last_addr_dram;
+    unsigned long saved_addr_nvram = last_addr_nvram;
+    unsigned long *stop_addr = walk_demote ? &last_addr_dram : &last_addr_nvram;
+    int total = n_to_find;
+
+    if ((mm == NULL) || ((walk_class != -1) && (task_prio[i] != walk_class))) {
+        return;
+    }
+
+    curr_pid = task_items[i]->pid;
+    curr_prio = task_prio[i];
+    n_to_find = int_min(total, n_found + task_quota(i));
+    range_cursor_init(&hint_cursor, curr_pid, start);
+    range_cursor_init(&fail_cursor, curr_pid, start);
+    *stop_addr = end; // the callbacks set it to the first page left once n_to_find is reached
+
+    mmap_read_lock(mm);
+    walk_page_range(mm, start, end, mem_walk_ops, NULL);
+    mmap_read_unlock(mm);
+
+    if ((n_found == n_to_find) && (n_found < total) && (*stop_addr < end) && (task_n_segs[i] < 2)) {
+        task_segs[2*i + task_n_segs[i]].start = *stop_addr;
+        task_segs[2*i + task_n_segs[i]++].end = end;
+    }
+
+    // Stopping at the task quota must not move the cursors, only reaching the total does
+    if (n_found < total) {
+        last_addr_dram = saved_addr_dram;
+        last_addr_nvram = saved_addr_nvram;
+    }
+    n_to_find = total;
+}
+
 static int do_page_walk(struct mm_walk_ops mem_walk_ops, int last_pid, unsigned long last_addr) {
-    struct mm_struct *mm;
     int i;
     // begin at last_pid->last_addr
-    mm = task_items[last_pid]->mm;
-    curr_pid = task_items[last_pid]->pid;
-
-    if(mm != NULL) {
-        mmap_read_lock(mm);
-        walk_page_range(mm, last_addr, MAX_ADDRESS, &mem_walk_ops, NULL);
-        mmap_read_unlock(mm);
-    }
+    walk_task(&mem_walk_ops, last_pid, last_addr, MAX_ADDRESS);
 
     if (n_found >= n_to_find) {
         return last_pid;
     }
 
     for (i=last_pid+1; i<n_pids; i++) {
-
-        mm = task_items[i]->mm;
-        curr_pid = task_items[i]->pid;
-
-        if(mm != NULL) {
-            mmap_read_lock(mm);
-            walk_page_range(mm, 0, MAX_ADDRESS, &mem_walk_ops, NULL);
-            mmap_read_unlock(mm);
-        }
+        walk_task(&mem_walk_ops, i, 0, MAX_ADDRESS);
 
         if (n_found >= n_to_find) {
             return i;
@@ -474,30 +767,92 @@ static int do_page_walk(struct mm_walk_ops mem_walk_ops, int last_pid, unsigned
     }
 
     for (i = 0; i < last_pid; i++) {
-        mm = task_items[i]->mm;
-        curr_pid = task_items[i]->pid;
+        walk_task(&mem_walk_ops, i, 0, MAX_ADDRESS);
 
-        if(mm != NULL) {
-            mmap_read_lock(mm);
-            walk_page_range(mm, 0, MAX_ADDRESS, &mem_walk_ops, NULL);
-            mmap_read_unlock(mm);
-        }
         if (n_found >= n_to_find) {
             return i;
         }
     }
 
     // finish cycle at last_pid->last_addr
-    mm = task_items[last_pid]->mm;
-    curr_pid = task_items[last_pid]->pid;
+    walk_task(&mem_walk_ops, last_pid, 0, last_addr+1);
+
+    return last_pid;
+}
+
+// Walks the segments the tasks of the current class left at their quota, splitting the budget that is still open over
+// those tasks only. Returns whether the pass found anything.
+static int refill_pass(struct mm_walk_ops *mem_walk_ops, int dram_walk) {
+    walk_seg_t segs[2];
+    int before = n_found;
+    int i, k, n;
 
-    if(mm != NULL) {
-        mmap_read_lock(mm);
-        walk_page_range(mm, 0, last_addr+1, &mem_walk_ops, NULL);
-        mmap_read_unlock(mm);
+    pass_budget = n_to_find - n_found;
+    pass_weight_sum = 0;
+    for (i = 0; i < n_pids; i++) {
+        if ((task_prio[i] == walk_class) && (task_n_segs[i] > 0)) {
+            pass_weight_sum += effective_weight(i);
+        }
+    }
+    if (pass_weight_sum == 0) {
+        return 0;
     }
 
-    return last_pid;
+    for (i = 0; (i < n_pids) && (n_found < n_to_find); i++) {
+        if ((task_prio[i] != walk_class) || (task_n_segs[i] == 0)) {
+            continue;
+        }
+        n = task_n_segs[i];
+        memcpy(segs, &task_segs[2*i], sizeof(walk_seg_t) * n);
+        task_n_segs[i] = 0;
+        for (k = 0; (k < n) && (n_found < n_to_find); k++) {
+            walk_task(mem_walk_ops, i, segs[k].start, segs[k].end);
+        }
+        if (n_found >= n_to_find) {
+            if (dram_walk) {
+                last_pid_dram = i;
+            }
+            else {
+                last_pid_nvram = i;
+            }
+        }
+    }
+    return n_found > before;
+}
+
+// Runs the walk passes of each priority class, in promotion or demotion order. A class keeps the budget its tasks leave
+// unused (tasks without enough candidates) for refill passes over its other tasks before the next class gets it.
+static void class_walk(struct mm_walk_ops mem_walk_ops, int dram_walk) {
+    const int *order = dram_walk ? demote_order : promote_order;
+    int c, i;
+
+    walk_demote = dram_walk;
+    for (c = 0; (c < N_PRIO_CLASSES) && (n_found < n_to_find); c++) {
+        walk_class = order[c];
+        for (i = 0; i < n_pids; i++) {
+            task_n_segs[i] = 0;
+        }
+        pass_budget = n_to_find - n_found;
+        pass_weight_sum = 0;
+        for (i = 0; i < n_pids; i++) {
+            if (task_prio[i] == walk_class) {
+                pass_weight_sum += effective_weight(i);
+            }
+        }
+        if (pass_weight_sum == 0) {
+            continue;
+        }
+
+        if (dram_walk) {
+            last_pid_dram = do_page_walk(mem_walk_ops, last_pid_dram, last_addr_dram);
+        }
+        else {
+            last_pid_nvram = do_page_walk(mem_walk_ops, last_pid_nvram, last_addr_nvram);
+        }
+
+        while ((n_found < n_to_find) && refill_pass(&mem_walk_ops, dram_walk));
+    }
+    walk_class = -1;
 }
 
 static int mem_walk(int n, int mode) {
@@ -525,13 +880,9 @@ static int mem_walk(int n, int mode) {
 
     n_to_find = n;
     n_backup = 0;
+    walk_traffic = (mode == NVRAM_INTENSIVE_MODE) || (mode == NVRAM_WRITE_MODE);
 
-    if (dram_walk) {
-        last_pid_dram = do_page_walk(mem_walk_ops, last_pid_dram, last_addr_dram);
-    }
-    else {
-        last_pid_nvram = do_page_walk(mem_walk_ops, last_pid_nvram, last_addr_nvram);
-    }
+    class_walk(mem_walk_ops, dram_walk);
 
     if (n_found >= n_to_find) {
         return 0;
@@ -556,6 +907,12 @@ static int clear_walk(int mode) {
     struct mm_struct *mm;
     struct mm_walk_ops mem_walk_ops = {.pte_entry = pte_callback_nvram_clear};
 
+    // Replies with the number of young NVRAM pages (first entry) out of those scanned (second entry)
+    found_addrs[0].addr = 0;
+    found_addrs[0].pid_retval = 0;
+    found_addrs[1].addr = 0;
+    found_addrs[1].pid_retval = 0;
+
     int i;
     for (i=0; i < n_pids; i++) {
         mm = task_items[i]->mm;
@@ -565,6 +922,7 @@ static int clear_walk(int mode) {
         spin_unlock(&mm->page_table_lock);
     }
 
+    n_found = 2;
     return 0;
 }
 
@@ -613,8 +971,9 @@ static int switch_walk(int n) {
 
     n_to_find = n;
     n_switch_backup = 0;
+    walk_traffic = 1;
 
-    last_pid_nvram = do_page_walk(mem_walk_ops, last_pid_nvram, last_addr_nvram);
+    class_walk(mem_walk_ops, 0);
 
     found_addrs[n_found].pid_retval = 0; // fill separator after
     if ((n_found == 0) && (n_switch_backup == 0)) {
@@ -629,7 +988,7 @@ static int switch_walk(int n) {
     n_backup = 0;
 
     mem_walk_ops.pte_entry = pte_callback_mem;
-    last_pid_dram = do_page_walk(mem_walk_ops, last_pid_dram, last_addr_dram);
+    class_walk(mem_walk_ops, 1);
     int dram_found = n_found - nvram_found - 1;
     // found equal number of dram and nvram entries
     if (dram_found == nvram_found) {
@@ -706,17 +1065,23 @@ BIND/UNBIND FUNCTIONS
 
 
 
-static int bind_pid(pid_t pid) {
+static int bind_pid(pid_t pid, int prio, int weight) {
     if ((pid <= 0) || (pid > MAX_PID_N)) {
         pr_info("PLACEMENT: Invalid pid value in bind command.\n");
         return -1;
     }
-    if (!find_target_process(pid)) {
+    if ((prio < 0) || (prio >= N_PRIO_CLASSES)) {
+        prio = PRIO_NORMAL;
+    }
+    if ((weight <= 0) || (weight > MAX_WEIGHT)) {
+        weight = DEFAULT_WEIGHT;
+    }
+    if (!find_target_process(pid, prio, weight)) {
         pr_info("PLACEMENT: Could not bind pid=%d.\n", pid);
         return -1;
     }
 
-    pr_info("PLACEMENT: Bound pid=%d.\n", pid);
+    pr_info("PLACEMENT: Bound pid=%d (prio=%d, weight=%d).\n", pid, prio, weight);
     return 0;
 }
 
@@ -744,6 +1109,84 @@ static int unbind_pid(pid_t pid) {
     return 0;
 }
 
+static int hint_pid(pid_t pid, int kind, unsigned long addr, unsigned long len) {
+    unsigned long start = addr & PAGE_MASK;
+    unsigned long end = PAGE_ALIGN(addr + len);
+
+    if ((kind < HINT_HOT) || (kind > HINT_CLEAR) || (len == 0) || (end <= start) || (end > MAX_ADDRESS)) {
+        pr_info("PLACEMENT: Invalid hint for pid=%d.\n", pid);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < n_pids; i++) {
+        if ((task_items[i] != NULL) && (task_items[i]->pid == pid)) {
+            break;
+        }
+    }
+    if (i == n_pids) {
+        pr_info("PLACEMENT: Hint for unbound pid=%d.\n", pid);
+        return -1;
+    }
+
+    if (range_insert(&hint_table, pid, start, end, kind, 0)) {
+        pr_info("PLACEMENT: Hint table at capacity.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Traffic shares measured by ctl. Tasks missing from the list keep their previous share.
+static int traffic_shares(int n, traffic_t *shares) {
+    int i, j;
+
+    if ((n <= 0) || (n > MAX_TRAFFIC_PER_REQ)) {
+        pr_info("PLACEMENT: Invalid number of traffic shares.\n");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n_pids; j++) {
+            if ((task_items[j] != NULL) && (task_items[j]->pid == shares[i].pid)) {
+                task_traffic[j] = (shares[i].share < 0) ? -1 : int_min(shares[i].share, TRAFFIC_SHARE_SCALE);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Pages in the given ranges are skipped by all walks until their backoff expires
+static int fail_ranges(int n, fail_range_t *ranges) {
+    int i, j;
+
+    if ((n <= 0) || (n > MAX_FAIL_PER_REQ)) {
+        pr_info("PLACEMENT: Invalid number of failure ranges.\n");
+        return -1;
+    }
+    range_prune(&fail_table);
+
+    for (i = 0; i < n; i++) {
+        fail_range_t *r = &ranges[i];
+        if ((r->end <= r->start) || (r->end > MAX_ADDRESS) || (r->backoff_ms <= 0)) {
+            continue;
+        }
+        for (j = 0; j < n_pids; j++) {
+            if ((task_items[j] != NULL) && (task_items[j]->pid == r->pid)) {
+                break;
+            }
+        }
+        if (j == n_pids) {
+            continue;
+        }
+        if (range_insert(&fail_table, r->pid, r->start & PAGE_MASK, PAGE_ALIGN(r->end), 0, jiffies + msecs_to_jiffies(r->backoff_ms))) {
+            pr_info("PLACEMENT: Failure table at capacity.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 
 
 /*
@@ -758,18 +1201,27 @@ MESSAGE/REQUEST PROCESSING
 
 /* Valid request commands:
 
-BIND [pid]
+BIND [pid] [priority] [weight]
 UNBIND [pid]
-FIND [tier] [n]
+HINT [pid] [kind] [addr] [len]
+FAIL [n] + n ranges
+TRAFFIC [n] + n shares
+FIND [tier] [n] [node mask]
 
 */
-static void process_req(req_t *req) {
+// Whether the n entries of entry_size bytes that follow req lie within the len bytes of the request
+static int req_has_entries(size_t len, int n, size_t entry_size) {
+    return (n > 0) && (len >= sizeof(req_t)) && ((size_t) n <= (len - sizeof(req_t)) / entry_size);
+}
+
+static void process_req(req_t *req, size_t len) {
     int ret = -1;
     n_found = 0;
-    if (req != NULL) {
+    if ((req != NULL) && (len >= sizeof(req_t))) {
         switch (req->op_code) {
             case FIND_OP:
                 refresh_pids();
+                find_nodes = req->node_mask;
                 if (n_pids > 0) {
                     int n = 0;
                     switch (req->mode) {
@@ -781,7 +1233,7 @@ static void process_req(req_t *req) {
                             ret = mem_walk(n, req->mode);
                             break;
                         case NVRAM_CLEAR:
-                            clear_walk(req->mode);
+                            ret = clear_walk(req->mode);
                             break;
                         case SWITCH_MODE:
                             n = int_min(MAX_N_SWITCH, req->pid_n);
@@ -794,12 +1246,29 @@ static void process_req(req_t *req) {
                 break;
             case BIND_OP:
                 refresh_pids();
-                ret = bind_pid(req->pid_n);
+                ret = bind_pid(req->pid_n, req->priority, req->weight);
                 break;
             case UNBIND_OP:
                 ret = unbind_pid(req->pid_n);
                 refresh_pids();
                 break;
+            case HINT_OP:
+                ret = hint_pid(req->pid_n, req->mode, req->addr, req->len);
+                break;
+            case FAIL_OP:
+                if (!req_has_entries(len, req->pid_n, sizeof(fail_range_t))) {
+                    pr_info("PLACEMENT: Fail request shorter than its ranges.\n");
+                    break;
+                }
+                ret = fail_ranges(req->pid_n, (fail_range_t *) (req + 1));
+                break;
+            case TRAFFIC_OP:
+                if (!req_has_entries(len, req->pid_n, sizeof(traffic_t))) {
+                    pr_info("PLACEMENT: Traffic request shorter than its entries.\n");
+                    break;
+                }
+                ret = traffic_shares(req->pid_n, (traffic_t *) (req + 1));
+                break;
 
             default:
                 pr_info("PLACEMENT: Unrecognized opcode.\n");
@@ -821,11 +1290,16 @@ static void placement_nl_process_msg(struct sk_buff *skb) {
 
     // input
     nlmh = (struct nlmsghdr *) skb->data;
+    if ((skb->len < NLMSG_HDRLEN) || (nlmh->nlmsg_len < NLMSG_HDRLEN) || (nlmh->nlmsg_len > skb->len)) {
+        pr_info("PLACEMENT: Dropped malformed message.\n");
+        return;
+    }
 
     in_req = (req_t *) NLMSG_DATA(nlmh);
     sender_pid = nlmh->nlmsg_pid;
 
-    process_req(in_req);
+    // Requests are only read within the length of the message
+    process_req(in_req, nlmh->nlmsg_len - NLMSG_HDRLEN);
 
 
     // Calculate size of the last netlink packet
@@ -884,10 +1358,17 @@ static int __init _on_module_init(void) {
     pr_info("PLACEMENT-HYB: Hello from module!\n");
 
     task_items = kmalloc(sizeof(struct task_struct *) * MAX_PIDS, GFP_KERNEL);
+    task_prio = kmalloc(sizeof(int) * MAX_PIDS, GFP_KERNEL);
+    task_weight = kmalloc(sizeof(int) * MAX_PIDS, GFP_KERNEL);
+    task_traffic = kmalloc(sizeof(int) * MAX_PIDS, GFP_KERNEL);
+    task_segs = kmalloc(sizeof(walk_seg_t) * 2 * MAX_PIDS, GFP_KERNEL);
+    task_n_segs = kmalloc(sizeof(int) * MAX_PIDS, GFP_KERNEL);
     found_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_FIND, GFP_KERNEL);
     backup_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_FIND, GFP_KERNEL);
     switch_backup_addrs = kmalloc(sizeof(addr_info_t) * MAX_N_SWITCH, GFP_KERNEL);
     nlmh_array = kmalloc(sizeof(struct nlmsghdr *) * MAX_PACKETS, GFP_KERNEL);
+    hint_table.entries = kmalloc(sizeof(range_t) * MAX_HINTS, GFP_KERNEL);
+    fail_table.entries = kmalloc(sizeof(range_t) * MAX_FAIL_RANGES, GFP_KERNEL);
 
     struct netlink_kernel_cfg cfg = {
         .input = placement_nl_process_msg,
@@ -907,10 +1388,17 @@ static void __exit _on_module_exit(void) {
     netlink_kernel_release(nl_sock);
 
     kfree(task_items);
+    kfree(task_prio);
+    kfree(task_weight);
+    kfree(task_traffic);
+    kfree(task_segs);
+    kfree(task_n_segs);
     kfree(found_addrs);
     kfree(backup_addrs);
     kfree(switch_backup_addrs);
     kfree(nlmh_array);
+    kfree(hint_table.entries);
+    kfree(fail_table.entries);
 }
 
 module_init(_on_module_init);
@@ -2,11 +2,17 @@
 #include <stdlib.h>
 #include "ambix-client.h"
 
+// Usage: bind.o [pid] [priority (0: batch, 1: normal, 2: latency)] [weight]
 int main(int argc, char **argv) {
-    if (argc != 2) {
+    if ((argc != 2) && (argc != 4)) {
         return 1;
     }
     int pid = atoi(argv[1]);
-    bind_uds(pid);
+    if (argc == 4) {
+        bind_uds_prio(pid, atoi(argv[2]), atoi(argv[3]));
+    }
+    else {
+        bind_uds(pid);
+    }
     return 0;
 }
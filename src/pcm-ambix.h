@@ -1,19 +1,310 @@
 #ifndef _PCM_AMBIX_H
 #define _PCM_AMBIX_H
 
-#define MAX_SOCKETS 2
-#define PCM_FILE_NAME "memdata"
-#define PCM_DELAY 1
-#define PMM_MIXED 1
+#define PCM_SHM_NAME "/ambix-memdata"
+#define PCM_PERIOD_MS 100 // default sampling period of pcm-memory, overridden by its first argument
+#define PCM_PERIOD_MIN_MS 10
+#define PCM_AGG_WINDOW_MS 1000 // window of the aggregates used for slow-moving estimates
+#define PCM_LATENCY_EVERY 10 // one sampling period out of this many measures read latency instead of bandwidth
+
+// Shared memory feed:
+#define PCM_RING_SIZE 256 // number of samples kept in the ring (history available to ctl)
+#define PCM_SHM_MAGIC 0x58424d41 // "AMBX"
+#define PCM_SHM_VERSION 7
+#define PCM_READ_RETRIES 16
+
+// Per-socket layout of the feed (larger systems still count in the system totals):
+#define PCM_MAX_SOCKETS 8
+#define PCM_MAX_IMCS 4 // memory controllers per socket
+#define PCM_MAX_CHANNELS 12 // memory channels per socket
+#define PCM_MAX_CORES 512 // logical cores with a per-core memory bandwidth entry (RDT MBM)
+
+// NVRAM configuration (App Direct only or App Direct + Memory Mode), detected at runtime:
+#define PMM_MODE_ENV "AMBIX_PMM_MODE" // "ad" or "mixed": overrides the detection from the node layout
+#define PMM_MODE_UNKNOWN -1
+#define PMM_MODE_AD 0
+#define PMM_MODE_MIXED 1
+#define NODE_SYSFS_PATH "/sys/devices/system/node"
+#define MAX_SYSFS_NODES 64
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// All bandwidths in MB/s
+typedef struct channel_bw {
+    float dramReads, dramWrites;
+    float pmmReads, pmmWrites; // App Direct only systems, mixed systems count NVRAM traffic per controller
+} channel_bw_t;
+
+typedef struct imc_bw {
+    float pmmReads, pmmWrites;
+} imc_bw_t;
+
+typedef struct socket_bw {
+    float dramReads, dramWrites;
+    float pmmReads, pmmWrites;
+    float pmmAppBW, pmmMemBW;
+    imc_bw_t imc[PCM_MAX_IMCS];
+    channel_bw_t channel[PCM_MAX_CHANNELS];
+} socket_bw_t; // floats only: aggregated as an array
+
+typedef struct socket_lat {
+    float ddrRead, pmmRead; // average read latency at the memory controllers in ns, 0 if there were no reads
+} socket_lat_t;
 
 typedef struct memdata {
     float sys_dramReads, sys_dramWrites;
     float sys_pmmReads, sys_pmmWrites;
     float sys_pmmAppBW, sys_pmmMemBW;
     uint64_t total_rDram, total_wDram, total_rOptane, total_wOptane;
+    float sys_mmMissRate; // fraction of DRAM cache reads that missed to Memory Mode NVRAM (mixed systems only)
+    uint32_t pmm_mixed; // Memory Mode is in use: seen in the node layout or in the DRAM cache miss counters
+    uint64_t elapsed_ns; // time between the counter reads the sample was computed from
+    uint64_t snapshot_skew_ns; // spread between the counter reads of the sockets (latest sample, not averaged)
+    uint32_t n_sockets, n_imcs, n_channels; // entries in use in socket[], and in imc[]/channel[] of each socket
+    socket_bw_t socket[PCM_MAX_SOCKETS];
+    float sys_ddrReadLatency, sys_pmmReadLatency; // ns, averaged over the reads of all sockets
+    uint64_t latency_ns; // CLOCK_MONOTONIC time of the latency measurement (latest one, not averaged), 0 if none yet
+    socket_lat_t latency[PCM_MAX_SOCKETS];
+    uint32_t n_cores; // entries in use in core_mbw[] (indexed by OS cpu id), 0 without MBM support
+    float core_mbw[PCM_MAX_CORES]; // memory bandwidth of each core from RDT MBM, not averaged by the aggregate
 } memdata_t;
 
+typedef struct memdata_sample {
+    uint32_t seq; // seqlock counter, odd while the writer is updating the slot
+    uint64_t index; // position of the sample in the stream, detects slots overwritten while reading
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC time of the sample
+    memdata_t md;
+} memdata_sample_t;
+
+typedef struct memdata_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t n_written; // samples published so far, the latest one is at (n_written - 1) % PCM_RING_SIZE
+    memdata_sample_t samples[PCM_RING_SIZE];
+} memdata_ring_t;
+
+
+static inline uint64_t memdata_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Reads a decimal value from a sysfs file. Returns -1 if it does not exist.
+static inline long long sysfs_read_ll(const char *path) {
+    char buf[32];
+    int fd = open(path, O_RDONLY);
+    ssize_t len;
+
+    if (fd == -1) {
+        return -1;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    return strtoll(buf, NULL, 10);
+}
+
+// Size in bytes of the memory-side cache (the DRAM cache of Memory Mode NVRAM) in front of node, 0 without one
+static inline long long node_side_cache_size(int node) {
+    char path[128];
+    snprintf(path, sizeof(path), NODE_SYSFS_PATH "/node%d/memory_side_cache/index1/size", node);
+    long long size = sysfs_read_ll(path);
+    return (size > 0) ? size : 0;
+}
+
+// Memory Mode NVRAM shows up as nodes with a memory-side cache, which the kernel exports from the firmware's HMAT.
+// Without HMAT (no node access classes either) the layout says nothing and PMM_MODE_UNKNOWN is returned.
+static inline int pmm_detect_mode(void) {
+    const char *env = getenv(PMM_MODE_ENV);
+    int hmat = 0;
+    char path[128];
+
+    if (env != NULL) {
+        if (!strcmp(env, "mixed")) {
+            return PMM_MODE_MIXED;
+        }
+        if (!strcmp(env, "ad")) {
+            return PMM_MODE_AD;
+        }
+    }
+    for (int node=0; node < MAX_SYSFS_NODES; node++) {
+        if (node_side_cache_size(node) > 0) {
+            return PMM_MODE_MIXED;
+        }
+        snprintf(path, sizeof(path), NODE_SYSFS_PATH "/node%d/access0", node);
+        hmat |= (access(path, F_OK) == 0);
+    }
+    return hmat ? PMM_MODE_AD : PMM_MODE_UNKNOWN;
+}
+
+// Maps the feed. The writer (pcm-memory) creates it, readers map it read-only. Returns NULL on failure.
+static inline memdata_ring_t *memdata_ring_open(int writer) {
+    int fd = shm_open(PCM_SHM_NAME, writer ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    memdata_ring_t *ring;
+
+    if (fd == -1) {
+        return NULL;
+    }
+    if (writer && (ftruncate(fd, sizeof(memdata_ring_t)) == -1)) {
+        close(fd);
+        return NULL;
+    }
+
+    ring = (memdata_ring_t *) mmap(NULL, sizeof(memdata_ring_t), writer ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (writer && ((ring->magic != PCM_SHM_MAGIC) || (ring->version != PCM_SHM_VERSION))) {
+        // The segment is never unlinked so readers keep a valid mapping across pcm-memory restarts
+        memset(ring, 0, sizeof(memdata_ring_t));
+        ring->version = PCM_SHM_VERSION;
+        __atomic_store_n(&ring->magic, PCM_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    return ring;
+}
+
+// Private feed for a writer in the reader's own process (pcm embedded in ctl). Returns NULL on failure.
+static inline memdata_ring_t *memdata_ring_anon() {
+    memdata_ring_t *ring = (memdata_ring_t *) mmap(NULL, sizeof(memdata_ring_t), PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+    ring->version = PCM_SHM_VERSION;
+    __atomic_store_n(&ring->magic, PCM_SHM_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+static inline void memdata_ring_close(memdata_ring_t *ring) {
+    munmap((void *) ring, sizeof(memdata_ring_t));
+}
+
+static inline int memdata_ring_valid(const memdata_ring_t *ring) {
+    return (ring != NULL) && (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) == PCM_SHM_MAGIC) && (ring->version == PCM_SHM_VERSION);
+}
+
+// Single writer only
+static inline void memdata_ring_publish(memdata_ring_t *ring, const memdata_t *md, uint64_t timestamp_ns) {
+    uint64_t index = ring->n_written;
+    memdata_sample_t *slot = &ring->samples[index % PCM_RING_SIZE];
+    uint32_t seq = slot->seq;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->index = index;
+    slot->timestamp_ns = timestamp_ns;
+    memcpy(&slot->md, md, sizeof(memdata_t));
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->n_written, index + 1, __ATOMIC_RELEASE);
+}
+
+// Copies the sample published age samples ago (0 is the latest). Returns 1 on success.
+static inline int memdata_ring_read(const memdata_ring_t *ring, unsigned int age, memdata_sample_t *out) {
+    uint64_t n_written, index;
+    const memdata_sample_t *slot;
+
+    if (!memdata_ring_valid(ring)) {
+        return 0;
+    }
+    n_written = __atomic_load_n(&ring->n_written, __ATOMIC_ACQUIRE);
+    if ((age >= PCM_RING_SIZE) || (age >= n_written)) {
+        return 0;
+    }
+    index = n_written - 1 - age;
+    slot = &ring->samples[index % PCM_RING_SIZE];
+
+    for (int i=0; i < PCM_READ_RETRIES; i++) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, (const void *) slot, sizeof(memdata_sample_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            // A different index means the writer lapped this reader
+            return out->index == index;
+        }
+    }
+    return 0;
+}
+
+static inline int memdata_ring_latest(const memdata_ring_t *ring, memdata_sample_t *out) {
+    return memdata_ring_read(ring, 0, out);
+}
+
+// Copies up to n of the most recent samples, newest first. Returns the number of samples copied.
+static inline int memdata_ring_history(const memdata_ring_t *ring, memdata_sample_t *out, int n) {
+    int i;
+    for (i=0; i < n; i++) {
+        if (!memdata_ring_read(ring, i, &out[i])) {
+            break;
+        }
+    }
+    return i;
+}
+
+// Averages the samples of the last window_ns (at least the latest one), weighted by the time each covers. Counters
+// and flags are taken from the latest sample. Returns the number of samples aggregated.
+static inline int memdata_ring_aggregate(const memdata_ring_t *ring, uint64_t window_ns, memdata_t *out) {
+    memdata_sample_t sample;
+    const int n_socket_fields = PCM_MAX_SOCKETS * sizeof(socket_bw_t) / sizeof(float);
+    double sum[7] = {0};
+    double socket_sum[PCM_MAX_SOCKETS * sizeof(socket_bw_t) / sizeof(float)] = {0};
+    uint64_t covered_ns = 0;
+    int n;
+
+    for (n=0; (covered_ns < window_ns) && memdata_ring_read(ring, n, &sample); n++) {
+        const memdata_t *md = &sample.md;
+        double w = md->elapsed_ns;
+
+        if (n == 0) {
+            *out = *md;
+        }
+        sum[0] += md->sys_dramReads * w;
+        sum[1] += md->sys_dramWrites * w;
+        sum[2] += md->sys_pmmReads * w;
+        sum[3] += md->sys_pmmWrites * w;
+        sum[4] += md->sys_pmmAppBW * w;
+        sum[5] += md->sys_pmmMemBW * w;
+        sum[6] += md->sys_mmMissRate * w;
+        for (int i=0; i < n_socket_fields; i++) {
+            socket_sum[i] += ((const float *) md->socket)[i] * w;
+        }
+        covered_ns += md->elapsed_ns;
+    }
+    if ((n == 0) || (covered_ns == 0)) {
+        return n;
+    }
+
+    out->sys_dramReads = sum[0] / covered_ns;
+    out->sys_dramWrites = sum[1] / covered_ns;
+    out->sys_pmmReads = sum[2] / covered_ns;
+    out->sys_pmmWrites = sum[3] / covered_ns;
+    out->sys_pmmAppBW = sum[4] / covered_ns;
+    out->sys_pmmMemBW = sum[5] / covered_ns;
+    out->sys_mmMissRate = sum[6] / covered_ns;
+    for (int i=0; i < n_socket_fields; i++) {
+        ((float *) out->socket)[i] = socket_sum[i] / covered_ns;
+    }
+    out->elapsed_ns = covered_ns;
+    return n;
+}
+
 
 #endif
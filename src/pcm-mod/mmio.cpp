@@ -23,6 +23,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <fcntl.h>
 #include "pci.h"
 #include "mmio.h"
+#include "regtrace.h"
 
 #ifndef _MSC_VER
 #include <sys/mman.h>
@@ -99,6 +100,7 @@ MMIORange::MMIORange(uint64 baseAddr_, uint64 /* size_ */, bool readonly_) : sta
 
 MMIORange::MMIORange(uint64 physical_address, uint64 size_, bool readonly_) :
     mmapAddr(NULL),
+    baseAddr(physical_address),
     size(size_),
     readonly(readonly_)
 {
@@ -145,9 +147,11 @@ MMIORange::~MMIORange()
 MMIORange::MMIORange(uint64 baseAddr_, uint64 size_, bool readonly_) :
     fd(-1),
     mmapAddr(NULL),
+    baseAddr(baseAddr_),
     size(size_),
     readonly(readonly_)
 {
+    if (RegisterTrace::replaying()) return;
     const int oflag = readonly ? O_RDONLY : O_RDWR;
     int handle = ::open("/dev/mem", oflag);
     if (handle < 0)
@@ -169,12 +173,30 @@ MMIORange::MMIORange(uint64 baseAddr_, uint64 size_, bool readonly_) :
 
 uint32 MMIORange::read32(uint64 offset)
 {
-    return *((uint32 *)(mmapAddr + offset));
+    uint32 val = 0;
+    if (RegisterTrace::replaying())
+    {
+        RegisterTrace::replay(RegisterTrace::MMIO, baseAddr, offset, &val, sizeof(val));
+        return val;
+    }
+    val = *((uint32 *)(mmapAddr + offset));
+    if (RegisterTrace::recording())
+        RegisterTrace::record(RegisterTrace::MMIO, baseAddr, offset, &val, sizeof(val));
+    return val;
 }
 
 uint64 MMIORange::read64(uint64 offset)
 {
-    return *((uint64 *)(mmapAddr + offset));
+    uint64 val = 0;
+    if (RegisterTrace::replaying())
+    {
+        RegisterTrace::replay(RegisterTrace::MMIO, baseAddr, offset, &val, sizeof(val));
+        return val;
+    }
+    val = *((uint64 *)(mmapAddr + offset));
+    if (RegisterTrace::recording())
+        RegisterTrace::record(RegisterTrace::MMIO, baseAddr, offset, &val, sizeof(val));
+    return val;
 }
 
 void MMIORange::write32(uint64 offset, uint32 val)
@@ -184,6 +206,7 @@ void MMIORange::write32(uint64 offset, uint32 val)
         std::cerr << "PCM Error: attempting to write to a read-only MMIORange\n";
         return;
     }
+    if (RegisterTrace::replaying()) return;
     *((uint32 *)(mmapAddr + offset)) = val;
 }
 void MMIORange::write64(uint64 offset, uint64 val)
@@ -193,6 +216,7 @@ void MMIORange::write64(uint64 offset, uint64 val)
         std::cerr << "PCM Error: attempting to write to a read-only MMIORange\n";
         return;
     }
+    if (RegisterTrace::replaying()) return;
     *((uint64 *)(mmapAddr + offset)) = val;
 }
 
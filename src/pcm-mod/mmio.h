@@ -99,6 +99,7 @@ class MMIORange
 {
     int32 fd;
     char * mmapAddr;
+    const uint64 baseAddr; // identifies the range in register traces
     const uint64 size;
     const bool readonly;
 public:
@@ -47,6 +47,7 @@ class PciHandle
     int32 fd;
 #endif
 
+    uint32 groupnr; // Linux only, identifies the device in register traces
     uint32 bus;
     uint32 device;
     uint32 function;
@@ -0,0 +1,162 @@
+// Record/replay of register reads, see regtrace.h
+
+#include "regtrace.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+namespace pcm {
+
+static const uint64 traceMagic = 0x45434152544d4350ULL; // "PCMTRACE"
+static const uint32 traceVersion = 1;
+static const uint64 traceFlushNs = 1000000000ULL;
+
+struct TraceHeader
+{
+    uint64 magic;
+    uint32 version;
+    uint32 entrySize;
+};
+
+RegisterTrace & RegisterTrace::instance()
+{
+    static RegisterTrace trace;
+    return trace;
+}
+
+RegisterTrace::RegisterTrace()
+{
+    const char * env = getenv("PCM_TRACE");
+    if (env == NULL) return;
+
+    const std::string spec(env);
+    const size_t colon = spec.find(':');
+    const std::string how = spec.substr(0, colon);
+    const std::string path = (colon == std::string::npos) ? std::string() : spec.substr(colon + 1);
+    if (path.empty())
+    {
+        std::cerr << "PCM Error: PCM_TRACE must be record:<file>, replay:<file> or replay-fast:<file>\n";
+        return;
+    }
+
+    if (how == "record")
+    {
+        file = fopen(path.c_str(), "wb");
+        TraceHeader header = { traceMagic, traceVersion, (uint32)sizeof(Entry) };
+        if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1)
+        {
+            std::cerr << "PCM Error: can't create register trace " << path << ": " << strerror(errno) << "\n";
+            return;
+        }
+        mode = Record;
+        std::cerr << "Recording register reads to " << path << "\n";
+    }
+    else if (how == "replay" || how == "replay-fast")
+    {
+        if (!load(path.c_str())) return;
+        mode = (how == "replay") ? Replay : ReplayFast;
+        std::cerr << "Replaying register reads from " << path << (mode == ReplayFast ? " (no waiting)" : "") << "\n";
+    }
+    else
+    {
+        std::cerr << "PCM Error: unknown PCM_TRACE mode " << how << "\n";
+    }
+}
+
+RegisterTrace::~RegisterTrace()
+{
+    if (file) fclose(file);
+}
+
+bool RegisterTrace::load(const char * path)
+{
+    FILE * in = fopen(path, "rb");
+    TraceHeader header;
+    Entry e;
+    size_t n = 0;
+
+    if (in == NULL)
+    {
+        std::cerr << "PCM Error: can't open register trace " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != traceMagic
+        || header.version != traceVersion || header.entrySize != sizeof(Entry))
+    {
+        std::cerr << "PCM Error: " << path << " is not a register trace of this version\n";
+        fclose(in);
+        return false;
+    }
+    while (fread(&e, sizeof(e), 1, in) == 1)
+    {
+        streams[Key(e.kind, e.device, e.offset)].entries.push_back(e);
+        ++n;
+    }
+    fclose(in);
+    std::cerr << "Loaded " << n << " register reads from " << path << "\n";
+    return true;
+}
+
+uint64 RegisterTrace::elapsedNs()
+{
+    const uint64 now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (startNs == 0) startNs = now;
+    return now - startNs;
+}
+
+void RegisterTrace::record(Kind kind, uint64 device, uint64 offset, const void * value, uint32 size)
+{
+    RegisterTrace & t = instance();
+    Entry e;
+
+    memset(&e, 0, sizeof(e));
+    e.kind = kind;
+    e.size = size;
+    e.device = device;
+    e.offset = offset;
+    memcpy(e.value, value, std::min(size, (uint32)sizeof(e.value)));
+
+    std::lock_guard<std::mutex> lock(t.mutex);
+    if (t.file == NULL) return;
+    e.timeNs = t.elapsedNs();
+    fwrite(&e, sizeof(e), 1, t.file);
+    if (e.timeNs - t.flushedNs > traceFlushNs)
+    {
+        fflush(t.file);
+        t.flushedNs = e.timeNs;
+    }
+}
+
+bool RegisterTrace::replay(Kind kind, uint64 device, uint64 offset, void * value, uint32 size)
+{
+    RegisterTrace & t = instance();
+    uint64 waitNs = 0;
+    Entry e;
+
+    {
+        std::lock_guard<std::mutex> lock(t.mutex);
+        auto it = t.streams.find(Key(kind, device, offset));
+        if (it == t.streams.end()) return false;
+
+        Stream & s = it->second;
+        e = s.entries[std::min(s.next, s.entries.size() - 1)];
+        if (s.next < s.entries.size())
+        {
+            ++s.next;
+            const uint64 now = t.elapsedNs();
+            if (t.mode == Replay && e.timeNs > now) waitNs = e.timeNs - now;
+        }
+    }
+    // Counters are not read before the time they were read during the recording
+    if (waitNs) std::this_thread::sleep_for(std::chrono::nanoseconds(waitNs));
+
+    memcpy(value, e.value, std::min(size, (uint32)sizeof(e.value)));
+    return true;
+}
+
+} // namespace pcm
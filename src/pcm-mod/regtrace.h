@@ -0,0 +1,90 @@
+#ifndef CPUCounters_REGTRACE_H
+#define CPUCounters_REGTRACE_H
+
+/*!     \file regtrace.h
+        \brief Record/replay of the register reads of MsrHandle, PciHandle, MMIORange and CPUID
+
+        PCM_TRACE=record:<file> appends every register read (with its value and time) to <file>.
+        PCM_TRACE=replay:<file> keeps the handles off the hardware: reads return the recorded values in order, each
+        one no earlier than it was read during the recording, and writes are dropped.
+        PCM_TRACE=replay-fast:<file> replays without waiting.
+
+        The OS view of the machine (online CPUs, sysfs topology) is not replayed: the replaying machine needs as many
+        logical CPUs as the recorded one. Linux only, and PciHandleMM (PCM_USE_PCI_MM_LINUX) is not traced.
+*/
+
+#include "types.h"
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <stdio.h>
+
+namespace pcm {
+
+class RegisterTrace
+{
+public:
+    enum Kind
+    {
+        MSR = 0, // device: core, offset: MSR address
+        PCICFG = 1, // device: PCI address (see pciDevice), offset: config space offset
+        PCI_EXISTS = 2, // device: PCI address, value: 1 if the device exists
+        MMIO = 3, // device: physical base address of the range, offset: offset in the range
+        CPUID = 4 // device: CPU the instruction ran on, offset: leaf << 32 | subleaf, value: eax, ebx, ecx, edx
+    };
+
+    struct Entry
+    {
+        uint32 kind;
+        uint32 size; // bytes read
+        uint64 device;
+        uint64 offset;
+        uint64 timeNs; // since the first read of the recording
+        uint64 value[2];
+    };
+
+    static bool recording() { return instance().mode == Record; }
+    static bool replaying() { return instance().mode != Off && instance().mode != Record; }
+    static bool active() { return instance().mode != Off; }
+
+    static uint64 pciDevice(uint32 groupnr, uint32 bus, uint32 device, uint32 function)
+    {
+        return (uint64(groupnr) << 32) | (uint64(bus) << 16) | (uint64(device) << 8) | uint64(function);
+    }
+
+    static void record(Kind kind, uint64 device, uint64 offset, const void * value, uint32 size);
+    //! Copies the next recorded value of (kind, device, offset) to value, the last one once they ran out.
+    //! Returns false (value untouched) if the key was never recorded.
+    static bool replay(Kind kind, uint64 device, uint64 offset, void * value, uint32 size);
+
+private:
+    enum Mode { Off, Record, Replay, ReplayFast };
+
+    struct Stream
+    {
+        std::vector<Entry> entries;
+        size_t next = 0;
+    };
+    typedef std::tuple<uint32, uint64, uint64> Key;
+
+    Mode mode = Off;
+    std::mutex mutex;
+    FILE * file = NULL;
+    uint64 startNs = 0; // steady clock time of the first read
+    uint64 flushedNs = 0;
+    std::map<Key, Stream> streams;
+
+    RegisterTrace();
+    ~RegisterTrace();
+    RegisterTrace(const RegisterTrace &) = delete;
+    RegisterTrace & operator = (const RegisterTrace &) = delete;
+
+    static RegisterTrace & instance();
+    uint64 elapsedNs();
+    bool load(const char * path);
+};
+
+} // namespace pcm
+
+#endif
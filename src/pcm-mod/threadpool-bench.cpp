@@ -0,0 +1,130 @@
+// Dispatch latency of pcm::ThreadPool against the previous single-queue pool (one std::queue, one mutex and condition
+// variable, 64 threads). Every round adds one LambdaJob per job from a single thread, as Aggregator::dispatch does for
+// every core, and waits for all of them.
+//
+// Build: make threadpool-bench.x
+// Usage: threadpool-bench.x [jobs per round (default: hardware threads)] [rounds (default 1000)]
+
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <vector>
+#include <stdlib.h>
+
+using namespace pcm;
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// The pool threadpool.h used to provide
+class SharedQueuePool {
+public:
+    SharedQueuePool( const int n ) {
+        for ( int i = 0; i < n; ++i )
+            threads_.push_back( std::thread( &SharedQueuePool::execute, this ) );
+    }
+    ~SharedQueuePool() {
+        for ( size_t i = 0; i < threads_.size(); ++i )
+            addWork( nullptr );
+        for ( auto& t : threads_ )
+            t.join();
+    }
+    void addWork( Work* w ) {
+        std::lock_guard<std::mutex> lg( qMutex_ );
+        workQ_.push( w );
+        queueCV_.notify_one();
+    }
+private:
+    void execute() {
+        while ( true ) {
+            std::unique_lock<std::mutex> lock( qMutex_ );
+            queueCV_.wait( lock, [this]{ return !workQ_.empty(); } );
+            Work* w = workQ_.front();
+            workQ_.pop();
+            lock.unlock();
+            if ( w == nullptr ) break;
+            w->execute();
+            delete w;
+        }
+    }
+    std::vector<std::thread> threads_;
+    std::queue<Work*> workQ_;
+    std::mutex qMutex_;
+    std::condition_variable queueCV_;
+};
+
+struct Result {
+    std::vector<uint64_t> dispatchNs; // addWork to start of the job
+    std::vector<uint64_t> roundNs; // first addWork to completion of the last job
+};
+
+template <class Pool>
+Result run( Pool& pool, const int jobs, const int rounds )
+{
+    Result r;
+    std::vector<std::future<uint64_t>> futures( jobs );
+    std::vector<uint64_t> submitNs( jobs );
+
+    r.dispatchNs.reserve( (size_t)jobs * rounds );
+    for ( int round = 0; round < rounds; ++round ) {
+        const uint64_t start = nowNs();
+        for ( int i = 0; i < jobs; ++i ) {
+            auto job = new LambdaJob<uint64_t>( []() -> uint64_t { return nowNs(); } );
+            futures[i] = job->getFuture();
+            submitNs[i] = nowNs();
+            pool.addWork( job );
+        }
+        for ( int i = 0; i < jobs; ++i )
+            r.dispatchNs.push_back( futures[i].get() - submitNs[i] );
+        r.roundNs.push_back( nowNs() - start );
+    }
+    return r;
+}
+
+static uint64_t percentile( std::vector<uint64_t> v, double p )
+{
+    std::sort( v.begin(), v.end() );
+    return v[std::min( v.size() - 1, (size_t)( p * v.size() ) )];
+}
+
+static void report( const char* name, size_t threads, const Result& r )
+{
+    std::cout << std::left << std::setw( 24 ) << name << std::right
+              << std::setw( 8 ) << threads
+              << std::setw( 12 ) << percentile( r.dispatchNs, 0.5 ) / 1000.0
+              << std::setw( 12 ) << percentile( r.dispatchNs, 0.99 ) / 1000.0
+              << std::setw( 12 ) << percentile( r.roundNs, 0.5 ) / 1000.0
+              << std::setw( 12 ) << percentile( r.roundNs, 0.99 ) / 1000.0 << "\n";
+}
+
+int main( int argc, char* argv[] )
+{
+    const int jobs = ( argc > 1 ) ? std::max( atoi( argv[1] ), 1 ) : std::max( (int)std::thread::hardware_concurrency(), 1 );
+    const int rounds = ( argc > 2 ) ? std::max( atoi( argv[2] ), 1 ) : 1000;
+
+    std::cout << jobs << " jobs per round, " << rounds << " rounds, " << std::thread::hardware_concurrency() << " hardware threads\n";
+    std::cout << std::fixed << std::setprecision( 1 );
+    std::cout << std::left << std::setw( 24 ) << "pool" << std::right << std::setw( 8 ) << "threads"
+              << std::setw( 12 ) << "disp p50" << std::setw( 12 ) << "disp p99"
+              << std::setw( 12 ) << "round p50" << std::setw( 12 ) << "round p99" << "  (us)\n";
+
+    {
+        SharedQueuePool shared( 64 );
+        run( shared, jobs, rounds / 10 + 1 ); // warm-up
+        report( "single queue", 64, run( shared, jobs, rounds ) );
+    }
+    {
+        ThreadPool& pool = ThreadPool::getInstance();
+        run( pool, jobs, rounds / 10 + 1 );
+        report( "work stealing", pool.size(), run( pool, jobs, rounds ) );
+    }
+    return 0;
+}
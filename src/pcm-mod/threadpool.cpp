@@ -32,9 +32,24 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "threadpool.h"
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace pcm {
 
-void ThreadPool::execute( ThreadPool* tp ) {
+void ThreadPool::execute( ThreadPool* tp, int index ) {
+    workerPool() = tp;
+    workerIndex() = index;
+#ifdef __linux__
+    if ( tp->pinned_ ) {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( index % std::max( (int)std::thread::hardware_concurrency(), 1 ), &set );
+        pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+    }
+#endif
     while( 1 ) {
         Work* w = tp->retrieveWork();
         if ( w == nullptr ) break;
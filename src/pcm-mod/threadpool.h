@@ -39,7 +39,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <functional>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
 
 namespace pcm {
 
@@ -73,63 +79,153 @@ private:
 
 class WorkQueue;
 
+// Work-stealing pool: every worker owns a deque. Work added by a worker goes to its own deque (and is run LIFO by it),
+// work added from other threads is spread round-robin over the workers. Idle workers steal from the front of the
+// other deques before they sleep, so one busy producer (e.g. Aggregator::dispatch adding one job per core) no longer
+// contends on a single queue lock.
 class ThreadPool {
 private:
-    ThreadPool( const int n ) {
+    struct Worker {
+        std::deque<Work*> deque;
+        std::mutex mutex;
+    };
+
+    ThreadPool( const int n, const bool pinned ) : workers_( n ), pinned_( pinned ) {
+        for ( int i = 0; i < n; ++i )
+            workers_[i].reset( new Worker() );
         for ( int i = 0; i < n; ++i )
-            addThread();
+            addThread( i );
     }
 
     ThreadPool( ThreadPool const& ) = delete;
 
 public:
     ~ThreadPool() {
-        for ( size_t i = 0; i < threads_.size(); ++i )
-            addWork( nullptr );
+        {
+            std::lock_guard<std::mutex> lg( sleepMutex_ );
+            stop_ = true;
+        }
+        sleepCV_.notify_all();
         for ( size_t i = 0; i < threads_.size(); ++i )
             threads_[i].join();
         threads_.clear();
     }
 
 public:
+    // One worker per hardware thread, at least minThreads since HTTPConnection jobs block their worker.
+    // PCM_THREADPOOL_PIN=1 pins worker i to CPU i.
     static ThreadPool& getInstance() {
-        static ThreadPool tp_(64);
+        static ThreadPool tp_( defaultSize(), pinEnv() );
         return tp_;
     }
 
+    static int defaultSize() {
+        return std::max( (int)std::thread::hardware_concurrency(), int( minThreads ) );
+    }
+
+    size_t size() const {
+        return workers_.size();
+    }
+
     void addWork( Work* w ) {
         DBG( 3, "WQ: Adding work" );
-        std::lock_guard<std::mutex> lg( qMutex_ );
-        workQ_.push( w );
-        queueCV_.notify_one();
+        const int self = currentWorker( this );
+        const size_t target = ( self >= 0 ) ? (size_t)self : next_++ % workers_.size();
+        {
+            std::lock_guard<std::mutex> lg( workers_[target]->mutex );
+            workers_[target]->deque.push_back( w );
+        }
+        pending_.fetch_add( 1 );
+        if ( sleeping_.load() > 0 ) {
+            // Taking the lock orders the notification after a worker's last check of pending_
+            std::lock_guard<std::mutex> lg( sleepMutex_ );
+            sleepCV_.notify_one();
+        }
         DBG( 3, "WQ: Work available" );
     }
 
+    // Blocks until work is available, returns nullptr once the pool is stopped and drained.
+    // Only meaningful on a worker thread of this pool.
     Work* retrieveWork() {
         DBG( 3, "WQ: Retrieving work" );
-        std::unique_lock<std::mutex> lock( qMutex_ );
-        queueCV_.wait( lock, [this]{ return !workQ_.empty(); } );
-        Work* w = workQ_.front();
-        workQ_.pop();
-        lock.unlock();
-        DBG( 3, "WQ: Work retrieved" );
-
-        return w;
+        const int self = currentWorker( this );
+        while ( true ) {
+            Work* w = tryRetrieve( self < 0 ? 0 : (size_t)self );
+            if ( w != nullptr ) {
+                DBG( 3, "WQ: Work retrieved" );
+                return w;
+            }
+            std::unique_lock<std::mutex> lock( sleepMutex_ );
+            if ( pending_.load() > 0 )
+                continue;
+            if ( stop_ )
+                return nullptr;
+            ++sleeping_;
+            sleepCV_.wait( lock, [this]{ return pending_.load() > 0 || stop_; } );
+            --sleeping_;
+        }
     }
 
 private:
-    void addThread() {
-        threads_.push_back( std::thread( std::bind( &this->execute, this ) ) );
+    static const int minThreads = 64;
+
+    static bool pinEnv() {
+        const char* env = std::getenv( "PCM_THREADPOOL_PIN" );
+        return env != nullptr && std::string( env ) == "1";
+    }
+
+    // Index of the calling thread in tp, -1 if it is not one of its workers
+    static int& workerIndex() {
+        static thread_local int index = -1;
+        return index;
+    }
+    static ThreadPool*& workerPool() {
+        static thread_local ThreadPool* pool = nullptr;
+        return pool;
+    }
+    static int currentWorker( ThreadPool* tp ) {
+        return ( workerPool() == tp ) ? workerIndex() : -1;
+    }
+
+    // Own deque from the back first, then the others from the front
+    Work* tryRetrieve( size_t self ) {
+        const size_t n = workers_.size();
+        for ( size_t k = 0; k < n; ++k ) {
+            Worker& victim = *workers_[( self + k ) % n];
+            std::lock_guard<std::mutex> lg( victim.mutex );
+            if ( victim.deque.empty() )
+                continue;
+            Work* w;
+            if ( k == 0 ) {
+                w = victim.deque.back();
+                victim.deque.pop_back();
+            } else {
+                w = victim.deque.front();
+                victim.deque.pop_front();
+            }
+            pending_.fetch_sub( 1 );
+            return w;
+        }
+        return nullptr;
+    }
+
+    void addThread( int index ) {
+        threads_.push_back( std::thread( &ThreadPool::execute, this, index ) );
     }
 
     // Executes work items from a std::thread, do not call manually
-    static void execute( ThreadPool* );
+    static void execute( ThreadPool*, int index );
 
 private:
+    std::vector<std::unique_ptr<Worker>> workers_;
     std::vector<std::thread> threads_;
-    std::queue<Work*> workQ_;
-    std::mutex qMutex_;
-    std::condition_variable queueCV_;
+    const bool pinned_;
+    std::atomic<size_t> next_{ 0 }; // round-robin target of work added from outside the pool
+    std::atomic<size_t> pending_{ 0 }; // work in the deques
+    std::atomic<int> sleeping_{ 0 };
+    bool stop_ = false; // guarded by sleepMutex_
+    std::mutex sleepMutex_;
+    std::condition_variable sleepCV_;
 };
 
 class WorkQueue {
@@ -0,0 +1,183 @@
+// Hybrid placement policy (DRAM + NVRAM in App Direct), ctl's default:
+//   - Switch: on NVRAM bandwidth above NVRAM_BW_THRESH or NVRAM read latency above the SLO, pages touched during an
+//     adaptive observation window are promoted to DRAM (switched with cold DRAM pages once DRAM reaches its target).
+//   - Threshold: DRAM above its limit is demoted down to its target (down from the target under memory pressure),
+//     NVRAM above its limit is promoted while the switch component is off.
+//   - On multi-socket systems the switch only promotes from the NVRAM nodes of the congested sockets (see
+//     SOCKET_BW_SHARE), using the per-socket bandwidth published by pcm.
+//
+// Build: make policies (policy-hyb.so)
+
+#include "ambix-policy.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+
+static const policy_api_t *api;
+
+static policy_clear_window_t clear_window = POLICY_CLEAR_WINDOW_INIT;
+
+
+static float socket_pmm_bw(policy_state_t *st, int socket) {
+    return st->pmm_mixed ? st->md.socket[socket].pmmAppBW : st->md.socket[socket].pmmWrites;
+}
+
+// Node mask for the switch walks: every DRAM node plus the NVRAM nodes of congested sockets. Returns 0 (all nodes) on
+// single socket systems, when the node layout is unknown or when every socket is congested.
+static unsigned long congested_nodes(policy_state_t *st) {
+    int n_sockets = st->md.n_sockets;
+    float max_bw = 0;
+    unsigned long mask = 0;
+    int skipped = 0;
+
+    if (n_sockets < 2) {
+        return 0;
+    }
+    for (int i=0; i < n_sockets; i++) {
+        max_bw = fmax(max_bw, socket_pmm_bw(st, i));
+    }
+
+    for (int i=0; i < n_nvram_nodes; i++) {
+        int socket = api->node_socket(NVRAM_NODES[i]);
+        if ((socket < 0) || (socket >= n_sockets) || (NVRAM_NODES[i] >= (int) (8 * sizeof(mask)))) {
+            return 0;
+        }
+        if (socket_pmm_bw(st, socket) >= SOCKET_BW_SHARE * max_bw) {
+            mask |= 1UL << NVRAM_NODES[i];
+        }
+        else {
+            skipped++;
+        }
+    }
+    if ((skipped == 0) || (mask == 0)) {
+        return 0;
+    }
+
+    for (int i=0; i < n_dram_nodes; i++) {
+        if (DRAM_NODES[i] >= (int) (8 * sizeof(mask))) {
+            return 0;
+        }
+        mask |= 1UL << DRAM_NODES[i];
+    }
+    return mask;
+}
+
+static int hyb_init(const policy_api_t *ctl_api) {
+    api = ctl_api;
+    clear_window = (policy_clear_window_t) POLICY_CLEAR_WINDOW_INIT;
+    return 0;
+}
+
+static void hyb_switch(policy_state_t *st, policy_result_t *res) {
+    float pmm_bw;
+    int n_pages;
+    int switch_migrated;
+    unsigned long young, scanned, nodes;
+
+    if (st->pmm_mixed) {
+        pmm_bw = st->md.sys_pmmAppBW;
+    }
+    else {
+        pmm_bw = st->md.sys_pmmWrites;
+    }
+    // Migrating pages of bound processes only relieves the part of the traffic they generate
+    if (st->bound_share >= 0) {
+        pmm_bw *= st->bound_share;
+    }
+    if ((pmm_bw <= NVRAM_BW_THRESH) && !policy_latency_missed(st)) {
+        return;
+    }
+    if (pmm_bw <= NVRAM_BW_THRESH) {
+        printf("NVRAM read latency %.0fns above the %.0fns SLO.\n", st->nvram_latency, st->latency_slo);
+    }
+
+    res->active = 1;
+    if (st->dram_usage >= DRAM_TARGET) {
+        n_pages = MAX_N_SWITCH;
+    }
+    else {
+        long long n_bytes = (DRAM_LIMIT - st->dram_usage) * st->dram_sz;
+        n_pages = n_bytes / st->page_size;
+        n_pages = fmin(n_pages, MAX_N_FIND);
+    }
+
+    api->clear(&young, &scanned);
+
+    // Other placement work (socket/stdin requests) may run while young bits accumulate
+    policy_adapt_clear_window(&clear_window, api->time_us(), young, scanned, pmm_bw, n_pages, st->page_size);
+    usleep(clear_window.interval_us);
+
+    nodes = congested_nodes(st);
+    if (st->dram_usage >= DRAM_TARGET) {
+        switch_migrated = api->find_nodes(MAX_N_SWITCH, SWITCH_MODE, nodes);
+        if (switch_migrated > 0) {
+            printf("DRAM<->NVRAM: Switched %d out of %ld pages.\n", switch_migrated, MAX_N_SWITCH * 2);
+        }
+    }
+    else {
+        switch_migrated = api->find_nodes(n_pages, NVRAM_INTENSIVE_MODE, nodes);
+        if (switch_migrated > 0) {
+            printf("NVRAM->DRAM: Sent %d out of %d intensive pages.\n", switch_migrated, n_pages);
+            api->refresh(st);
+        }
+    }
+
+    res->n_migrated += switch_migrated;
+    if (switch_migrated > 0) {
+        res->slept_us += clear_window.interval_us;
+    }
+}
+
+static void hyb_thresh(policy_state_t *st, policy_result_t *res) {
+    // Under memory pressure demotion starts at the target instead of waiting for the limit (and reclaim)
+    float dram_limit = st->pressure ? DRAM_TARGET : DRAM_LIMIT;
+    int n_pages;
+    int thresh_migrated = 0;
+
+    if ((st->dram_usage > dram_limit) && (st->nvram_usage < NVRAM_TARGET)) {
+        res->active = 1;
+        long long n_bytes = fmin((st->dram_usage - DRAM_TARGET) * st->dram_sz,
+                            (NVRAM_TARGET - st->nvram_usage) * st->nvram_sz);
+        n_pages = n_bytes / st->page_size;
+        n_pages = fmin(n_pages, MAX_N_FIND);
+        thresh_migrated = api->find(n_pages, DRAM_MODE);
+        if (thresh_migrated > 0) {
+            printf("DRAM->NVRAM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
+        }
+    }
+    else if (!st->switch_act && (st->nvram_usage > NVRAM_LIMIT) && (st->dram_usage < DRAM_TARGET)) {
+        res->active = 1;
+        long long n_bytes = fmin((st->nvram_usage - NVRAM_TARGET) * st->nvram_sz,
+                            (DRAM_TARGET - st->dram_usage) * st->dram_sz);
+        n_pages = n_bytes / st->page_size;
+        n_pages = fmin(n_pages, MAX_N_FIND);
+        thresh_migrated = api->find(n_pages, NVRAM_MODE);
+        if (thresh_migrated > 0) {
+            printf("NVRAM->DRAM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
+        }
+    }
+
+    res->n_migrated += thresh_migrated;
+}
+
+static void hyb_tick(policy_state_t *st, policy_result_t *res) {
+    if (st->switch_act && st->memdata_valid) {
+        hyb_switch(st, res);
+    }
+    if (st->thresh_act) {
+        hyb_thresh(st, res);
+    }
+}
+
+static void hyb_stats() {
+    printf("Clear window: %.1fms\n", clear_window.interval_us / 1000.0);
+}
+
+policy_t ambix_policy = {
+    .api_version = POLICY_API_VERSION,
+    .name = "hyb",
+    .init = hyb_init,
+    .tick = hyb_tick,
+    .stats = hyb_stats,
+};
@@ -0,0 +1,245 @@
+// MixM placement policy (NVRAM in Memory Mode, cached by DRAM, as the fast tier and NVRAM in App Direct as the slow
+// tier): same components as the hybrid policy, including its adaptive clear-to-switch window, but the Memory Mode tier
+// is only filled up to the fraction its DRAM cache can hold (cache_thresh / ratio), past which Memory Mode stops being
+// faster than App Direct.
+// It runs on the same ctl and module as the hybrid policy (ambix_hyb-ctl, ambix_hyb-mod), whose node lists in ambix.h
+// then describe the MixM layout: DRAM_NODES must list the Memory Mode nodes and NVRAM_NODES the App Direct ones.
+//
+// The ratio is read from the node layout when the kernel exports the memory-side cache, and the threshold is then
+// retuned from the DRAM cache miss rate measured by pcm: lowered while misses exceed MM_MISS_TARGET and raised while
+// the Memory Mode tier is full and misses stay below it.
+//
+// Commands:
+//   policy ratio [n]          Memory Mode (NVRAM) to DRAM cache capacity ratio
+//   policy cacheThresh [n]    percentage of the DRAM cache that the Memory Mode hot set may use
+//   policy adapt [on|off]     retuning from the miss rate (on by default)
+//
+// Build: make policies (policy-mixm.so)
+
+#include "ambix-policy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define ADM_BW_THRESH 10
+#define MM_RATIO 4 // used when the DRAM cache size is not exported
+#define CACHE_THRESH 1.25
+#define MM_MISS_TARGET 0.1 // DRAM cache miss rate the Memory Mode hot set is kept under
+#define MM_MISS_HYST 0.02
+#define MM_THRESH_STEP 0.01
+#define MM_THRESH_MIN 0.02
+
+static const policy_api_t *api;
+
+static int ratio = MM_RATIO;
+static float cache_thresh = CACHE_THRESH;
+static float mm_thresh = CACHE_THRESH / MM_RATIO;
+static float mm_target = CACHE_THRESH / MM_RATIO - 0.01;
+static long long cache_sz = 0; // DRAM cache in front of the Memory Mode nodes in bytes, 0 if unknown
+static int ratio_measured = 0;
+static int adapt = 1;
+static policy_clear_window_t clear_window = POLICY_CLEAR_WINDOW_INIT;
+static float miss_rate = -1; // moving average of the DRAM cache miss rate, -1 before the first sample
+
+
+static void set_mm_thresh() {
+    mm_thresh = cache_thresh / ratio;
+    mm_target = mm_thresh - 0.01;
+    printf("Set Memory Mode Threshold: %f\n", mm_thresh);
+}
+
+static int mixm_init(const policy_api_t *ctl_api) {
+    api = ctl_api;
+    cache_sz = 0;
+    for (int i=0; i < n_dram_nodes; i++) {
+        cache_sz += node_side_cache_size(DRAM_NODES[i]);
+    }
+    ratio_measured = 0;
+    miss_rate = -1;
+    clear_window = (policy_clear_window_t) POLICY_CLEAR_WINDOW_INIT;
+    return 0;
+}
+
+// Derives the capacity ratio from the Memory Mode tier size once it is known
+static void measure_ratio(policy_state_t *st) {
+    if (ratio_measured || (cache_sz == 0) || (st->dram_sz == 0)) {
+        return;
+    }
+    ratio_measured = 1;
+    ratio = (int) fmax(round(1.0 * st->dram_sz / cache_sz), 1);
+    set_mm_thresh();
+}
+
+static void retune_mm_thresh(policy_state_t *st) {
+    if (!st->memdata_valid || !st->md.pmm_mixed) {
+        return;
+    }
+    miss_rate = (miss_rate < 0) ? st->md.sys_mmMissRate
+                : COST_EWMA_WEIGHT * st->md.sys_mmMissRate + (1 - COST_EWMA_WEIGHT) * miss_rate;
+    if (!adapt) {
+        return;
+    }
+
+    float new_thresh = mm_thresh;
+    if (miss_rate > MM_MISS_TARGET + MM_MISS_HYST) {
+        // The hot set no longer fits in the DRAM cache: shrink it
+        new_thresh = fmax(mm_thresh - MM_THRESH_STEP, MM_THRESH_MIN);
+    }
+    else if ((miss_rate < MM_MISS_TARGET - MM_MISS_HYST) && (st->dram_usage >= mm_target)) {
+        // The tier is full and the cache still has room: let it grow
+        new_thresh = fmin(mm_thresh + MM_THRESH_STEP, DRAM_TARGET);
+    }
+    if (new_thresh != mm_thresh) {
+        mm_thresh = new_thresh;
+        mm_target = mm_thresh - 0.01;
+        printf("MIXM: DRAM cache miss rate %.1f%%, Memory Mode threshold set to %.2f%%\n", miss_rate * 100, mm_thresh * 100);
+    }
+}
+
+static void mixm_switch(policy_state_t *st, policy_result_t *res) {
+    float pmm_bw = st->md.sys_pmmAppBW;
+    int n_pages;
+    int switch_migrated = 0;
+    unsigned long young, scanned;
+
+    // Migrating pages of bound processes only relieves the part of the traffic they generate
+    if (st->bound_share >= 0) {
+        pmm_bw *= st->bound_share;
+    }
+    if ((pmm_bw <= ADM_BW_THRESH) && !policy_latency_missed(st)) {
+        return;
+    }
+    if (pmm_bw <= ADM_BW_THRESH) {
+        printf("NVRAM read latency %.0fns above the %.0fns SLO.\n", st->nvram_latency, st->latency_slo);
+    }
+
+    res->active = 1;
+    if (st->dram_usage >= mm_target) {
+        n_pages = MAX_N_SWITCH;
+    }
+    else {
+        long long n_bytes = (mm_thresh - st->dram_usage) * st->dram_sz;
+        n_pages = n_bytes / st->page_size;
+        n_pages = fmin(n_pages, MAX_N_FIND);
+    }
+
+    api->clear(&young, &scanned);
+    policy_adapt_clear_window(&clear_window, api->time_us(), young, scanned, pmm_bw, n_pages, st->page_size);
+    usleep(clear_window.interval_us);
+
+    if (st->dram_usage < mm_thresh) {
+        if (st->dram_usage >= mm_target) {
+            switch_migrated = api->find(MAX_N_SWITCH, SWITCH_MODE);
+            if (switch_migrated > 0) {
+                printf("MM<->ADM: Switched %d out of %ld pages.\n", switch_migrated, MAX_N_SWITCH * 2);
+            }
+        }
+        else {
+            switch_migrated = api->find(n_pages, NVRAM_INTENSIVE_MODE);
+            if (switch_migrated > 0) {
+                printf("ADM->MM: Sent %d out of %d intensive pages.\n", switch_migrated, n_pages);
+                api->refresh(st);
+            }
+        }
+    }
+
+    res->n_migrated += switch_migrated;
+    if (switch_migrated > 0) {
+        res->slept_us += clear_window.interval_us;
+    }
+}
+
+static void mixm_thresh(policy_state_t *st, policy_result_t *res) {
+    int n_pages;
+    int thresh_migrated = 0;
+
+    if ((st->dram_usage > mm_thresh) && (st->nvram_usage < NVRAM_TARGET)) {
+        res->active = 1;
+        long long n_bytes = fmin((st->dram_usage - mm_thresh) * st->dram_sz,
+                            (NVRAM_TARGET - st->nvram_usage) * st->nvram_sz);
+        n_pages = n_bytes / st->page_size;
+        n_pages = fmin(n_pages, MAX_N_FIND);
+        thresh_migrated = api->find(n_pages, DRAM_MODE);
+        if (thresh_migrated > 0) {
+            printf("MM->ADM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
+        }
+    }
+    else if (!st->switch_act && (st->nvram_usage > NVRAM_LIMIT) && (st->dram_usage < mm_target)) {
+        res->active = 1;
+        long long n_bytes = fmin((st->nvram_usage - NVRAM_TARGET) * st->nvram_sz,
+                            (mm_target - st->dram_usage) * st->dram_sz);
+        n_pages = n_bytes / st->page_size;
+        n_pages = fmin(n_pages, MAX_N_FIND);
+        thresh_migrated = api->find(n_pages, NVRAM_MODE);
+        if (thresh_migrated > 0) {
+            printf("ADM->MM: Migrated %d out of %d pages.\n", thresh_migrated, n_pages);
+        }
+    }
+
+    res->n_migrated += thresh_migrated;
+}
+
+static void mixm_tick(policy_state_t *st, policy_result_t *res) {
+    measure_ratio(st);
+    retune_mm_thresh(st);
+    if (st->switch_act && st->memdata_valid) {
+        mixm_switch(st, res);
+    }
+    if (st->thresh_act) {
+        mixm_thresh(st, res);
+    }
+}
+
+static int mixm_command(char *args) {
+    char *substring;
+
+    if ((substring = strtok(args, " ")) == NULL) {
+        return 0;
+    }
+    if (!strcmp(substring, "ratio")) {
+        if (((substring = strtok(NULL, " ")) == NULL) || (strtol(substring, NULL, 10) <= 0)) {
+            return 0;
+        }
+        ratio = strtol(substring, NULL, 10);
+        set_mm_thresh();
+        return 1;
+    }
+    if (!strcmp(substring, "adapt")) {
+        if ((substring = strtok(NULL, " ")) == NULL) {
+            return 0;
+        }
+        adapt = !strcmp(substring, "on");
+        printf("Memory Mode threshold retuning turned %s\n", adapt ? "ON" : "OFF");
+        return 1;
+    }
+    if (!strcmp(substring, "cacheThresh")) {
+        if ((substring = strtok(NULL, " ")) == NULL) {
+            return 0;
+        }
+        cache_thresh = ((float) strtol(substring, NULL, 10)) / 100;
+        set_mm_thresh();
+        return 1;
+    }
+    return 0;
+}
+
+static void mixm_stats() {
+    printf("Clear window: %.1fms\n", clear_window.interval_us / 1000.0);
+    printf("Memory Mode threshold: %.2f%% (target %.2f%%, ratio %d, retuning %s)\n", mm_thresh * 100, mm_target * 100,
+            ratio, adapt ? "on" : "off");
+    if (miss_rate >= 0) {
+        printf("DRAM cache miss rate: %.1f%%\n", miss_rate * 100);
+    }
+}
+
+policy_t ambix_policy = {
+    .api_version = POLICY_API_VERSION,
+    .name = "mixm",
+    .init = mixm_init,
+    .tick = mixm_tick,
+    .command = mixm_command,
+    .stats = mixm_stats,
+};
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "ambix-rec.h"
+
+// Usage: rec2csv.o [recording (default REC_PATH)] > out.csv
+// One row per record, oldest first. Columns that do not apply to the record type are left empty.
+int main(int argc, char **argv) {
+    const char *path = (argc > 1) ? argv[1] : REC_PATH;
+    rec_log_t *log = rec_open(path, 0);
+    rec_entry_t e;
+
+    if (log == NULL) {
+        perror(path);
+        return 1;
+    }
+    if (!rec_valid(log)) {
+        fprintf(stderr, "%s: not a recording of this version\n", path);
+        rec_close(log);
+        return 1;
+    }
+
+    uint64_t n_written = __atomic_load_n(&log->n_written, __ATOMIC_ACQUIRE);
+    uint64_t first = (n_written > REC_RECORDS) ? n_written - REC_RECORDS : 0;
+
+    printf("index,timestamp_ns,type,"
+           "dram_reads,dram_writes,pmm_reads,pmm_writes,pmm_app_bw,pmm_mem_bw,mm_miss_rate,nvram_latency,bound_share,"
+           "dram_usage,nvram_usage,dram_sz,nvram_sz,pressure,"
+           "mode,n_requested,n_found,n_migrated,node_mask,elapsed_us,"
+           "active,slept_us,sleep_us\n");
+
+    for (uint64_t i=first; i < n_written; i++) {
+        if (!rec_read(log, i, &e)) {
+            continue; // overwritten or still being written
+        }
+        printf("%" PRIu64 ",%" PRIu64 ",", i, e.timestamp_ns);
+        switch (e.type) {
+            case REC_MEMDATA:
+                printf("memdata,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.4f,%.1f,%.3f,,,,,,,,,,,,,,\n",
+                       e.u.memdata.dram_reads, e.u.memdata.dram_writes, e.u.memdata.pmm_reads,
+                       e.u.memdata.pmm_writes, e.u.memdata.pmm_app_bw, e.u.memdata.pmm_mem_bw,
+                       e.u.memdata.mm_miss_rate, e.u.memdata.nvram_latency, e.u.memdata.bound_share);
+                break;
+            case REC_USAGE:
+                printf("usage,,,,,,,,,,%.4f,%.4f,%" PRId64 ",%" PRId64 ",%d,,,,,,,,,\n",
+                       e.u.usage.dram_usage, e.u.usage.nvram_usage, e.u.usage.dram_sz, e.u.usage.nvram_sz,
+                       e.u.usage.pressure);
+                break;
+            case REC_FIND:
+                printf("find,,,,,,,,,,,,,,,%d,%d,%d,%d,0x%" PRIx64 ",%" PRId64 ",,,\n",
+                       e.u.find.mode, e.u.find.n_requested, e.u.find.n_found, e.u.find.n_migrated,
+                       e.u.find.node_mask, e.u.find.elapsed_us);
+                break;
+            case REC_TICK:
+                printf("tick,,,,,,,,,,,,,,,,,,%d,,,%d,%d,%d\n",
+                       e.u.tick.n_migrated, e.u.tick.active, e.u.tick.slept_us, e.u.tick.sleep_us);
+                break;
+            default:
+                printf("unknown,,,,,,,,,,,,,,,,,,,,,,,\n");
+                break;
+        }
+    }
+
+    rec_close(log);
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Checks that a FIND is not cut short by a bound process without candidates: two NORMAL processes with the same
+// weight are bound, one with all of its pages on NVRAM and one with none, and an NVRAM_MODE FIND for N_FIND pages must
+// return all N_FIND from the first one.
+//
+// Needs the ambix_hyb module loaded and the node lists of ../../src/ambix.h matching the machine.
+// Build: gcc -Wall -I../../src -o priority_test.o priority_test.c -lnuma
+// Run as root: ./priority_test.o
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <numaif.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/netlink.h>
+
+#include "ambix.h"
+
+#define N_PAGES 8192 // pages of the process with NVRAM candidates
+#define N_FIND 4096
+
+int netlink_fd;
+char reply[NLMSG_SPACE(MAX_PAYLOAD) * MAX_PACKETS];
+
+// Sends req to the module and returns the number of entries of the reply (the last one holds the return value)
+int send_req(req_t req, addr_info_t **ret) {
+    struct sockaddr_nl dst_addr = {.nl_family = AF_NETLINK, .nl_pid = 0};
+    char out[NLMSG_SPACE(MAX_PAYLOAD)];
+    struct nlmsghdr *nlmh = (struct nlmsghdr *) out;
+    int n = 0;
+    int len;
+
+    memset(out, 0, sizeof(out));
+    nlmh->nlmsg_len = NLMSG_SPACE(MAX_PAYLOAD);
+    nlmh->nlmsg_pid = getpid();
+    memcpy(NLMSG_DATA(nlmh), &req, sizeof(req));
+    if (sendto(netlink_fd, out, nlmh->nlmsg_len, 0, (struct sockaddr *) &dst_addr, sizeof(dst_addr)) < 0) {
+        return -1;
+    }
+    if ((len = recv(netlink_fd, reply, sizeof(reply), 0)) < 0) {
+        return -1;
+    }
+
+    for (nlmh = (struct nlmsghdr *) reply; NLMSG_OK(nlmh, len); nlmh = NLMSG_NEXT(nlmh, len)) {
+        n += NLMSG_PAYLOAD(nlmh, 0) / sizeof(addr_info_t);
+        *ret = ((addr_info_t *) NLMSG_DATA(nlmh)) + NLMSG_PAYLOAD(nlmh, 0) / sizeof(addr_info_t) - 1;
+    }
+    return n;
+}
+
+int bind_req(int op_code, int pid) {
+    req_t req = {.op_code = op_code, .pid_n = pid, .priority = PRIO_NORMAL, .weight = DEFAULT_WEIGHT};
+    addr_info_t *ret;
+
+    return (send_req(req, &ret) > 0) && (ret->pid_retval == 0);
+}
+
+// Child touching n_pages pages bound to node, writes one byte to ready once they are in place
+pid_t spawn(int node, int n_pages, int ready) {
+    pid_t pid = fork();
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    unsigned long mask = 1UL << node;
+    char *mem = mmap(NULL, n_pages * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((mem == MAP_FAILED) || mbind(mem, n_pages * page_size, MPOL_BIND, &mask, sizeof(mask) * 8, 0)) {
+        fprintf(stderr, "Error placing the test pages on node %d: %s\n", node, strerror(errno));
+        exit(1);
+    }
+    // Written just before the FIND, so that every page is young and dirty
+    for (int i=0; i < n_pages; i++) {
+        mem[i * page_size] = 1;
+    }
+    if (write(ready, "", 1) != 1) {
+        exit(1);
+    }
+    pause();
+    exit(0);
+}
+
+int main() {
+    struct sockaddr_nl src_addr = {.nl_family = AF_NETLINK, .nl_pid = getpid()};
+    req_t find = {.op_code = FIND_OP, .pid_n = N_FIND, .mode = NVRAM_MODE};
+    addr_info_t *ret;
+    int ready[2];
+    char c;
+    pid_t nvram_pid, dram_pid;
+    int n, found = 0;
+
+    if (((netlink_fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_USER)) < 0)
+            || bind(netlink_fd, (struct sockaddr *) &src_addr, sizeof(src_addr))) {
+        fprintf(stderr, "Error opening netlink socket (is the module loaded?): %s\n", strerror(errno));
+        return 1;
+    }
+    if (pipe(ready)) {
+        return 1;
+    }
+
+    nvram_pid = spawn(NVRAM_NODES[0], N_PAGES, ready[1]);
+    dram_pid = spawn(DRAM_NODES[0], N_PAGES / 8, ready[1]);
+    if ((read(ready[0], &c, 1) != 1) || (read(ready[0], &c, 1) != 1)) {
+        fprintf(stderr, "Test processes failed to start.\n");
+        return 1;
+    }
+
+    if (!bind_req(BIND_OP, dram_pid) || !bind_req(BIND_OP, nvram_pid)) {
+        fprintf(stderr, "Error binding the test processes.\n");
+    }
+    else if ((n = send_req(find, &ret)) > 0) {
+        found = n - 1;
+    }
+    bind_req(UNBIND_OP, dram_pid);
+    bind_req(UNBIND_OP, nvram_pid);
+    kill(nvram_pid, SIGKILL);
+    kill(dram_pid, SIGKILL);
+    waitpid(nvram_pid, NULL, 0);
+    waitpid(dram_pid, NULL, 0);
+
+    printf("FIND returned %d out of %d NVRAM pages: %s\n", found, N_FIND, (found == N_FIND) ? "PASS" : "FAIL");
+    return (found == N_FIND) ? 0 : 1;
+}